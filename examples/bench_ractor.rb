@@ -0,0 +1,44 @@
+require "carray-netcdf"
+require "benchmark"
+
+#
+# Reads the same variable with 1..NPROC Ractors, each opening its own
+# NCFile with metadata parsed once in the main Ractor.
+#
+# usage: ruby bench_ractor.rb [N] [NPROC] [LOOPS]
+#
+
+N     = ( ARGV[0] || 2048 ).to_i
+NPROC = ( ARGV[1] || 4 ).to_i
+LOOPS = ( ARGV[2] || 8 ).to_i
+PATH  = "bench_ractor.nc"
+
+unless File.exist?(PATH)
+  writer = NCFileWriter.new(PATH)
+  writer.define(dims: { "y" => N, "x" => N },
+                vars: { "v" => { type: NC::NC_SHORT,
+                                 dims: ["y", "x"],
+                                 attributes: { "scale_factor" => 0.01,
+                                               "add_offset"   => 100.0 } } },
+                attributes: {})
+  writer["v"].put(CArray.int16(N, N).seq!)
+  writer.close
+end
+
+metadata = NCFile.open(PATH).metadata
+
+1.upto(NPROC) do |np|
+  time = Benchmark.realtime {
+    workers = np.times.map {
+      Ractor.new(PATH, metadata, LOOPS) { |path, meta, loops|
+        nc = NCFile.open(path, metadata: meta)
+        loops.times { nc["v"].get.mean }
+        nc.close
+        loops
+      }
+    }
+    workers.each(&:take)
+  }
+  printf("%2d ractors: %8.3f sec  %8.1f reads/sec\n",
+         np, time, np * LOOPS / time)
+end
@@ -3,6 +3,15 @@ require "carray/mkmf"
 
 $CFLAGS += " -Wall"
 
+have_func("rb_arithmetic_sequence_extract", "ruby.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
+have_header("unistd.h")
+have_header("sys/mman.h")
+if have_header("pthread.h")
+  have_library("pthread", "pthread_create")
+end
+
 dir_config("netcdf", possible_includes("netcdf","netcdf3","netcdf-3"), possible_libs)
 
 if have_carray() and have_header("netcdf.h") and have_library("netcdf")
@@ -1,8 +1,59 @@
 require "carray"
 require "carray/netcdflib.so"
+require "tmpdir"
 
 module NC
 
+  @memory_budget = nil
+  @spill_dir     = nil
+  @write_chunk   = 64 * 1024 * 1024
+  @nonblocking_workers = 4
+  @nonblocking_threads = []
+  @nonblocking_queue   = Thread::Queue.new
+  @nonblocking_lock    = Mutex.new
+
+  class << self
+    #
+    # default upper limit in bytes of the result of a read through NCVar 
+    # (nil for unlimited). it can be overridden by the budget: option.
+    #
+    attr_accessor :memory_budget
+    #
+    # directory of the scratch files of spilled reads (default Dir.tmpdir)
+    #
+    attr_accessor :spill_dir
+    #
+    # upper limit in bytes of the staging buffer of chunked writes
+    #
+    attr_accessor :write_chunk
+    #
+    # number of worker threads of nc_nonblocking (default 4)
+    #
+    attr_accessor :nonblocking_workers
+
+    # job queue of nc_nonblocking. the workers are started on first use
+    # and started again when gone (after fork)
+
+    def nonblocking_queue
+      @nonblocking_lock.synchronize {
+        @nonblocking_threads.select!(&:alive?)
+        while @nonblocking_threads.size < @nonblocking_workers
+          @nonblocking_threads << Thread.new(@nonblocking_queue) { |queue|
+            while job = queue.pop
+              block, result = job
+              begin
+                result.push([true, block.call])
+              rescue Exception => e
+                result.push([false, e])
+              end
+            end
+          }
+        end
+      }
+      return @nonblocking_queue
+    end
+  end
+
   module_function
 
   def nc_decode (fd, varid, data)
@@ -18,6 +69,68 @@ module NC
     return data
   end
 
+  #
+  # Runs the block on one of the NC.nonblocking_workers threads when called
+  # from a non-blocking fiber under a Fiber scheduler (Ruby >= 3.2), so that
+  # the fiber yields to the scheduler until the read is done. Otherwise 
+  # just yields.
+  #
+  def nc_nonblocking (&block)
+    if Fiber.respond_to?(:scheduler) and Fiber.scheduler and 
+       Fiber.respond_to?(:blocking?) and not Fiber.blocking?
+      result = Thread::Queue.new
+      NC.nonblocking_queue.push([block, result])
+      ok, value = result.pop
+      raise value unless ok
+      return value
+    else
+      return yield
+    end
+  end
+
+  #
+  # start, count, stride of CA_REG_BLOCK index info (CArray.scan_index)
+  #
+  def nc_block_region (info)
+    start  = []
+    count  = []
+    stride = []
+    info.index.each do |idx|
+      case idx
+      when Array
+        start << idx[0]
+        count << idx[1]
+        stride << idx[2]
+      else
+        start << idx
+        count << 1
+        stride << 1
+      end
+    end
+    return start, count, stride
+  end
+
+  #
+  # start and count of the indices in range (Integer bounds counted from 
+  # the end if negative, nil for open) over n elements
+  #
+  def nc_range_span (range, n)
+    unless range.is_a?(Range)
+      raise ArgumentError, "Range of indices required (got #{range.class})"
+    end
+    first = range.begin || 0
+    first += n if first < 0
+    if range.end.nil?
+      last = n
+    else
+      last  = range.end
+      last += n if last < 0
+      last += 1 unless range.exclude_end?
+    end
+    raise IndexError, "index range #{range} out of range" if first < 0 or first > n
+    return first, last.clamp(first, n) - first
+  end
+
   def nc_put_att_simple (fd, varid, name, val)
     case val
     when Float
@@ -30,12 +143,8 @@ module NC
   end
 
   def nc_put_var_all (fd, varid, val)
-    data_type = NC.ca_type(nc_inq_vartype(fd, varid))
-    dim = (0...nc_inq_varndims(fd, varid)).collect do |dimid| 
-      nc_inq_dimlen(fd, dimid)
-    end
-    data = CArray.new(data_type, dim) { val }
-    nc_put_var(fd, varid, data)
+    val = val.to_ca if val.is_a?(CArray)
+    nc_put_var_fill(fd, varid, val, { chunk: NC.write_chunk })
   end
 
 end
@@ -61,21 +170,35 @@ class NCObject
 
   attr_reader :attributes
 
+  protected
+
+  # points the object to the reopened file (see NCFile#reopen)
+
+  def rebind (file_id)
+    @file_id = file_id
+  end
+
 end
 
 class NCVar < NCObject
   
   include NC
   
-  def initialize (ncfile, var_id)
+  def initialize (ncfile, var_id, meta = nil)
     @ncfile     = ncfile
     @file_id    = ncfile.file_id
     @var_id     = var_id
-    @name       = nc_inq_varname(@file_id, var_id)
-    @vartype    = nc_inq_vartype(@file_id, var_id)
-    @dims       = ncfile.dims.values_at(*nc_inq_vardimid(@file_id, var_id))
+    if meta
+      @name, @vartype, dimids, attrs = meta
+      @attributes = attrs.map { |k, v| [k, v.is_a?(Array) ? v.to_ca : v] }.to_h.freeze
+    else
+      @name       = nc_inq_varname(@file_id, var_id)
+      @vartype    = nc_inq_vartype(@file_id, var_id)
+      dimids      = nc_inq_vardimid(@file_id, var_id)
+      @attributes = get_attributes(@file_id, var_id)
+    end
+    @dims       = ncfile.dims.values_at(*dimids)
     @shape      = @dims.map{|d| d.len}
-    @attributes = get_attributes(@file_id, var_id)
     @dims.freeze
     @shape.freeze
   end
@@ -103,8 +226,12 @@ class NCVar < NCObject
     end
   end
 
-  def decode (value)
-    if @attributes.has_key?("_FillValue")
+  #
+  # masked : true if fill/missing values are already masked by the read
+  #          (fill: option of the native get paths)
+  #
+  def decode (value, masked: false)
+    if not masked and @attributes.has_key?("_FillValue")
       fill_value = @attributes["_FillValue"]
       case value
       when CArray
@@ -113,7 +240,7 @@ class NCVar < NCObject
         value = UNDEF if value == fill_value
       end
     end
-    if @attributes.has_key?("missing_value")
+    if not masked and @attributes.has_key?("missing_value")
       missing_values = [@attributes["missing_value"]].flatten
       missing_values.each do |mv|
         case value
@@ -140,14 +267,237 @@ class NCVar < NCObject
     return self[]
   end
 
-  def [] (*argv)
-    return get!(*argv)
+  def dim_index (dim)
+    case dim
+    when Integer
+      return ( dim < 0 ) ? dim + @dims.size : dim
+    else
+      index = @dims.index{|d| d.name == dim.to_s }
+      raise ArgumentError, "#{@name} has no dimension '#{dim}'" unless index
+      return index
+    end
+  end
+
+  def fill_values
+    values = []
+    values << @attributes["_FillValue"] if @attributes.has_key?("_FillValue")
+    if @attributes.has_key?("missing_value")
+      values.concat([@attributes["missing_value"]].flatten)
+    end
+    return values.map{|v| v.is_a?(CArray) ? v.to_a : v }.flatten
+  end
+
+  # fill/missing values masked by the native reads, nil if there are more
+  # than NC_MASK_FILL_MAX (decode masks them instead)
+
+  def native_fills
+    values = fill_values
+    return ( values.size <= NC_MASK_FILL_MAX ) ? values : nil
+  end
+  private :native_fills
+
+  #
+  # Reduces the variable over dims (all dims if nil) by streaming it in 
+  # slabs of at most budget bytes. Fill/missing values are skipped and
+  # scale_factor/add_offset are applied during the pass.
+  #
+  #   op : :sum, :mean, :min, :max, :variance (:var), :stddev (:std), :count
+  #
+  def reduce (op, dims: nil, budget: nil, threads: nil, ddof: 0)
+    if dims.nil?
+      dims = (0...@dims.size).to_a
+    else
+      dims = [dims].flatten.map{|d| dim_index(d) }
+    end
+    opts = { fill: fill_values, ddof: ddof }
+    opts[:scale_factor] = @attributes["scale_factor"] if @attributes.has_key?("scale_factor")
+    opts[:add_offset]   = @attributes["add_offset"] if @attributes.has_key?("add_offset")
+    opts[:budget]  = budget if budget
+    opts[:threads] = threads if threads
+    out = nc_reduce(@file_id, @var_id, op, dims, opts)
+    return ( dims.uniq.size == @dims.size ) ? out[0] : out
+  end
+
+  #
+  # Splits the CF time coordinate variable into runs of the same
+  # calendar period.
+  #
+  #   by : :year, :month, :day
+  #
+  # => [[key, first_index, length], ...]
+  #
+  def time_groups (by)
+    depth = { year: 1, month: 2, day: 3 }.fetch(by.to_sym) {
+      raise ArgumentError, "unknown period '#{by}'"
+    }
+    fields = nc_cf_time_fields(time_ns, time_calendar)
+    n = fields.dim0
+    return [] if n == 0
+    key = fields[nil, 0]
+    key = key * 100 + fields[nil, 1] if depth >= 2
+    key = key * 100 + fields[nil, 2] if depth >= 3
+    firsts = [0] + ( key[1..-1].ne(key[0..-2]).where + 1 ).to_a
+    ends   = firsts[1..-1] + [n]
+    return firsts.zip(ends).map { |i, j| [fields[i, 0...depth].to_a, i, j - i] }
+  end
+
+  def time_calendar
+    return ( @attributes["calendar"] || "standard" ).to_s.downcase
+  end
+
+  #
+  # Values of the CF time coordinate variable as int64 nanoseconds since
+  # 1970-01-01 00:00:00 of its calendar (converted natively once and cached)
+  #
+  def time_ns
+    @time_ns ||= begin
+      units = @attributes["units"] or 
+        raise RuntimeError, "#{@name} has no units attribute"
+      values = get!
+      values = CArray.float64(1) { values } unless values.is_a?(CArray)
+      nc_cf_time_decode(CA_DOUBLE(values), units.to_s, time_calendar).freeze
+    end
   end
 
-  def get (*argv)
+  #
+  # Time (or [year, month, day, hour, minute, second]) as a value of the
+  # CF time coordinate variable (or in units of its calendar)
+  #
+  def time_value (time, units: nil)
+    units ||= @attributes["units"] or 
+      raise RuntimeError, "#{@name} has no units attribute"
+    if time.respond_to?(:year)
+      time   = time.getutc if time.respond_to?(:getutc)
+      fields = [time.year, time.month, time.day]
+      if time.respond_to?(:hour)
+        sec = time.sec + ( time.respond_to?(:subsec) ? time.subsec.to_f : 0 )
+        fields += [time.hour, time.min, sec]
+      end
+    else
+      fields = time.to_a
+    end
+    return nc_cf_time_encode(fields, units.to_s, time_calendar)
+  end
+
+  #
+  # Aggregates the variable along time_dim into calendar periods. 
+  # Each period is reduced by nc_reduce over its records only, so that 
+  # the memory stays at one group whatever the length of the record.
+  # If into (NCFileWriter::Var) is given, the result of each group is 
+  # written to it as soon as the group is finished.
+  #
+  def resample (time_dim, by: :day, op: :mean, into: nil, 
+                budget: nil, threads: nil, ddof: 0)
+    tdim   = dim_index(time_dim)
+    tvar   = @ncfile[@dims[tdim].name] or 
+      raise RuntimeError, "no coordinate variable for '#{@dims[tdim].name}'"
+    groups = tvar.time_groups(by)
+    opts = { fill: fill_values, ddof: ddof }
+    opts[:scale_factor] = @attributes["scale_factor"] if @attributes.has_key?("scale_factor")
+    opts[:add_offset]   = @attributes["add_offset"] if @attributes.has_key?("add_offset")
+    opts[:budget]  = budget if budget
+    opts[:threads] = threads if threads
+    start = [0] * @shape.size
+    count = @shape.dup
+    out   = nil
+    unless into
+      shape = @shape.dup
+      shape[tdim] = groups.size
+      data_type = ( op.to_s == "count" ) ? CA_INT64 : CA_FLOAT64
+      out = CArray.new(data_type, shape)
+    end
+    groups.each_with_index do |(key, first, len), g|
+      start[tdim] = first
+      count[tdim] = len
+      value = nc_reduce(@file_id, @var_id, op, [tdim], 
+                        opts.merge(start: start, count: count))
+      if into
+        ostart = [0] * @shape.size
+        ostart[tdim] = g
+        ocount = @shape.dup
+        ocount[tdim] = 1
+        into.put_vara(ostart, ocount, value)
+      else
+        index = [nil] * @shape.size
+        index[tdim] = g
+        out[*index] = value
+      end
+      yield(key, value) if block_given?
+    end
+    return out
+  end
+
+  #
+  # Reads the region given by coordinate values of dimensions. 
+  #
+  #   var.sel(lat: -10..10, lon: 170..-170, time: t0..t1)
+  #
+  # Range selects the coordinate values within it, Numeric (or Time for 
+  # time coordinate) selects the nearest one. The hyperslabs (two when a 
+  # longitude range crosses the seam) are read into one output array.
+  #
+  def sel (**ranges)
+    ranges = ranges.transform_keys(&:to_s)
+    pieces = @dims.map do |dim|
+      range = ranges.delete(dim.name)
+      case range
+      when nil
+        list = [0..(dim.len-1)]
+      when Range
+        list = dim.slices_for(range)
+      when Numeric, Time
+        index = dim.nearest(range)
+        list = [index..index]
+      else
+        raise ArgumentError, "invalid selector for '#{dim.name}'"
+      end
+      if list.empty?
+        raise ArgumentError, "no '#{dim.name}' coordinate in #{range}"
+      end
+      offset = 0
+      list.map { |r| offset += r.size; [r, offset - r.size] }
+    end
+    unless ranges.empty?
+      raise ArgumentError, "#{@name} has no dimension '#{ranges.keys.first}'"
+    end
+    shape = pieces.map { |list| list.sum { |r, o| r.size } }
+    out = CArray.new(NC.ca_type(@vartype), shape)
+    combos = pieces.inject([[]]) { |acc, list| 
+      acc.product(list).map { |a, b| a + [b] } 
+    }
+    combos.each do |combo|
+      start  = combo.map { |r, o| r.first }
+      count  = combo.map { |r, o| r.size }
+      offset = combo.map { |r, o| o }
+      nc_nonblocking { 
+        nc_get_vara_into(@file_id, @var_id, start, count, out, offset) 
+      }
+    end
+    return decode(out)
+  end
+
+  def [] (*argv, **opts)
+    return get!(*argv, **opts)
+  end
+
+  #
+  # budget : upper limit in bytes of the result (default NC.memory_budget)
+  # spill  : if true, a result over the budget is read slab by slab into 
+  #          a file-backed CArray in NC.spill_dir instead of raising
+  #
+  def get (*argv, order: nil, budget: nil, spill: false)
+    return get_strings(argv, order, budget) if text?
+    if budget or NC.memory_budget
+      out = get_budgeted(argv, order, budget, spill, false)
+      return out unless out.nil?
+    end
     if argv.size > 0 and argv[0].is_a?(Struct::CAIndexInfo)
       info = argv.shift
     else
+      out = get_index(argv, order)
+      unless out.nil?
+        return ( out.is_a?(CArray) ) ? out.compact : out
+      end
       info = CArray.scan_index(@shape, argv)
     end
     out  = nil
@@ -161,37 +511,29 @@ class NCVar < NCObject
       end
       out = get_var1(*index)
     when CA_REG_FLATTEN
-      out = get_var[nil]
+      out = read_var[nil]
     when CA_REG_POINT
       out = get_var1(*info.index)
     when CA_REG_ALL
-      out = get_var()
+      out = read_var()
     when CA_REG_BLOCK
-      start = []
-      count = []
-      stride = []
-      info.index.each do |idx|
-        case idx
-        when Array
-          start << idx[0]
-          count << idx[1]
-          stride << idx[2]
-        else
-          start << idx
-          count << 1
-          stride << 1
-        end
-      end
+      start, count, stride = nc_block_region(info)
       if stride.all?{|x| x == 1 }
         out = get_vara(start, count)
       else
         out = get_vars(start, count, stride)
       end
     when CA_REG_SELECT, CA_REG_GRID
-      out = get_var[*argv]
+      out = read_var[*argv]
     else
       raise "invalid index"
     end
+    if order and out.is_a?(CArray)
+      unless info.type == CA_REG_ALL or info.type == CA_REG_BLOCK
+        raise ArgumentError, "order can not be used with this index"
+      end
+      out = out.transpose(*order).to_ca
+    end
     case out
     when CArray
       return out.compact
@@ -200,15 +542,216 @@ class NCVar < NCObject
     end
   end
   
-  def get! (*argv)
+  def get! (*argv, order: nil, budget: nil, spill: false)
+    return get_strings(argv, order, budget) if text?
+    if budget or NC.memory_budget
+      out = get_budgeted(argv, order, budget, spill, true)
+      return out unless out.nil?
+    end
+    fills = native_fills
+    out = get_index(argv, order, fills)
+    unless out.nil?
+      if out.is_a?(CArray)
+        return decode(out.compact, masked: !fills.nil?)
+      else
+        return decode(out)
+      end
+    end
     info = CArray.scan_index(@shape, argv)
     case info.type
     when CA_REG_METHOD_CALL
-      return decode(get_var)[*argv]
+      return decode(read_var)[*argv]
+    else
+      return decode(get(info, *argv, order: order))
+    end
+  end
+
+  # bytes per element of the result (decoded to float64 if packed)
+
+  def result_bytes (decoded)
+    bytes = CArray.new(NC.ca_type(@vartype), [1]).bytes
+    if decoded and 
+       ( @attributes.has_key?("scale_factor") or @attributes.has_key?("add_offset") )
+      bytes = 8 if bytes < 8
+    end
+    return bytes
+  end
+  private :result_bytes
+
+  #
+  # Checks the size of the result against the budget before reading. 
+  # Returns nil if the read fits (or can not be estimated), otherwise raises
+  # or returns the result spilled to a file-backed CArray.
+  #
+  def get_budgeted (argv, order, budget, spill, decoded)
+    limit = budget || NC.memory_budget
+    return nil if argv.size > 0 and argv[0].is_a?(Struct::CAIndexInfo)
+    info = CArray.scan_index(@shape, argv)
+    start = nil
+    case info.type
+    when CA_REG_ALL
+      start, count, stride = [0]*@shape.size, @shape.dup, [1]*@shape.size
+    when CA_REG_BLOCK
+      start, count, stride = nc_block_region(info)
+    when CA_REG_SELECT, CA_REG_GRID, CA_REG_FLATTEN, CA_REG_METHOD_CALL
+      count = @shape            # read as a whole before indexing
+    else
+      return nil
+    end
+    bytes = count.inject(1, :*) * result_bytes(decoded)
+    return nil if bytes <= limit
+    unless spill and start and order.nil?
+      raise "reading #{bytes} bytes of #{@name} exceeds memory budget (#{limit} bytes)"
+    end
+    return get_spilled(start, count, stride, limit, decoded)
+  end
+  private :get_budgeted
+
+  #
+  # Reads the region in slabs, each within the budget, into a CArray 
+  # backed by a scratch file. The slabs are split along the outermost 
+  # dimension for which the inner dimensions fit (as put_chunked of 
+  # NCFileWriter::Var), down to single elements. A decoded result 
+  # carries no mask (it would not be file-backed): masked elements are 
+  # written as NaN for float results, or as the fill value otherwise.
+  #
+  def get_spilled (start, count, stride, limit, decoded)
+    inner = result_bytes(decoded)
+    k = count.size - 1
+    while k > 0 and inner * count[k] <= limit.to_i
+      inner *= count[k]
+      k -= 1
+    end
+    rows  = ( limit.to_i / inner ).clamp(1, count[k])
+    outer = count[0...k]
+    tail  = [nil] * (count.size - k - 1)
+    out   = nil
+    view  = nil
+    outer.inject(1, :*).times do |n|
+      pos = []
+      outer.reverse_each do |c|
+        pos.unshift(n % c)
+        n /= c
+      end
+      (0...count[k]).step(rows) do |i|
+        m  = [rows, count[k] - i].min
+        st = pos.map.with_index { |p, j| start[j] + p * stride[j] } + 
+             [start[k] + i * stride[k]] + start[k+1..-1]
+        ct = [1] * k + [m] + count[k+1..-1]
+        if stride.all?{|x| x == 1 }
+          slab = get_vara(st, ct)
+        else
+          slab = get_vars(st, ct, stride)
+        end
+        if decoded
+          slab = decode(slab)
+          if slab.has_mask?
+            if slab.data_type == CA_FLOAT32 or slab.data_type == CA_FLOAT64
+              slab.unmask(Float::NAN)
+            else
+              slab.unmask(fill_values.first)
+            end
+          end
+        end
+        unless out
+          path = File.join(NC.spill_dir || Dir.tmpdir, 
+                           format("carray-netcdf-%d-%d-%08x", 
+                                  Process.pid, object_id, rand(2**32)))
+          out  = nc_mmap_carray(slab.data_type, count.reject{|c| c == 1 }, path)
+          view = out.reshape(*count)
+        end
+        view[*pos.map { |p| p..p }, i...i+m, *tail] = slab
+      end
+    end
+    return out
+  end
+  private :get_spilled
+
+  #
+  # true for NC_CHAR variable of strings: the last dimension is a string
+  # length (named like strlen, nchar, string80, ...) or the variable has
+  # an _Encoding attribute. Other NC_CHAR variables are read as int8.
+  #
+  def text?
+    return false unless @vartype == NC_CHAR and not @dims.empty?
+    return ( @attributes.has_key?("_Encoding") or 
+             @dims.last.name =~ /str|char|len/i ) ? true : false
+  end
+
+  # get_text for get/get!, with the budget checked over the strings 
+  # (order is not supported)
+
+  def get_strings (argv, order, budget)
+    raise ArgumentError, "order can not be used for strings" if order
+    if budget or NC.memory_budget
+      get_budgeted(argv.empty? ? argv : argv + [nil], nil, budget, false, false)
+    end
+    return get_text(*argv)
+  end
+  private :get_strings
+
+  #
+  # Reads NC_CHAR variable into a fixlen CArray over the leading 
+  # dimensions (NUL-padded as stored). A single string is returned 
+  # as a String without trailing NULs.
+  #
+  def get_text (*argv)
+    lead   = @shape[0..-2]
+    strlen = @shape[-1]
+    if lead.empty?
+      return nc_text_strings(nc_get_vara_text(@file_id, @var_id, [0], [strlen]))[0]
+    end
+    info = CArray.scan_index(lead, argv)
+    case info.type
+    when CA_REG_ALL
+      return nc_get_vara_text(@file_id, @var_id, [0] * @shape.size, @shape)
+    when CA_REG_POINT
+      out = nc_get_vara_text(@file_id, @var_id, 
+                             info.index + [0], [1] * lead.size + [strlen])
+      return nc_text_strings(out)[0]
+    when CA_REG_BLOCK
+      start = []
+      count = []
+      info.index.each do |idx|
+        case idx
+        when Array
+          break unless idx[2] == 1
+          start << idx[0]
+          count << idx[1]
+        else
+          start << idx
+          count << 1
+        end
+      end
+      if start.size == lead.size
+        return nc_get_vara_text(@file_id, @var_id, 
+                                start + [0], count + [strlen]).compact
+      end
+    end
+    return get_text()[*argv]
+  end
+
+  #
+  # Strings (Array) of NC_CHAR variable without trailing NULs
+  #
+  def strings (*argv)
+    out = get_text(*argv)
+    return ( out.is_a?(CArray) ) ? nc_text_strings(out) : out
+  end
+
+  def get_index (argv, order = nil, fill = nil)
+    if order or fill
+      opts = {}
+      opts[:order] = order if order
+      opts[:fill]  = fill if fill and not fill.empty?
+      return nc_nonblocking { 
+        nc_get_index(@file_id, @var_id, @shape, argv, opts) 
+      }
     else
-      return decode(get(info, *argv))
+      return nc_nonblocking { nc_get_index(@file_id, @var_id, @shape, argv) }
     end
   end
+  private :get_index
    
   def get_var1 (*index)
     return nc_get_var1(@file_id, @var_id, index)
@@ -218,36 +761,167 @@ class NCVar < NCObject
     return decode(get_var1(*index))
   end
 
-  def get_var ()
-    return nc_get_var(@file_id, @var_id)
+  def get_var (budget: nil, spill: false)
+    if budget or NC.memory_budget
+      out = get_budgeted([], nil, budget, spill, false)
+      return out unless out.nil?
+    end
+    return read_var()
   end
 
-  def get_var! ()
-    return decode(nc_get_var(@file_id, @var_id))
+  def get_var! (budget: nil, spill: false)
+    if budget or NC.memory_budget
+      out = get_budgeted([], nil, budget, spill, true)
+      return out unless out.nil?
+    end
+    fills = native_fills
+    return decode(nc_nonblocking { 
+                    nc_get_var(@file_id, @var_id, {fill: fills}) 
+                  }, masked: !fills.nil?)
   end
 
+  def read_var ()
+    return nc_nonblocking { nc_get_var(@file_id, @var_id) }
+  end
+  private :read_var
+
   def get_vara (start, count)
-    return nc_get_vara(@file_id, @var_id, start, count)
+    return nc_nonblocking { nc_get_vara(@file_id, @var_id, start, count) }
   end
 
   def get_vara! (start, count)
-    return decode(nc_get_vara(@file_id, @var_id, start, count))
+    fills = native_fills
+    return decode(nc_nonblocking { 
+                    nc_get_vara(@file_id, @var_id, start, count, 
+                                {fill: fills}) 
+                  }, masked: !fills.nil?)
   end
 
   def get_vars (start, count, stride)
-    return nc_get_vars(@file_id, @var_id, start, count, stride)
+    return nc_nonblocking { 
+      nc_get_vars(@file_id, @var_id, start, count, stride) 
+    }
   end
 
   def get_vars! (start, count, stride)
-    return decode(nc_get_vars(@file_id, @var_id, start, count, stride))
+    fills = native_fills
+    return decode(nc_nonblocking { 
+                    nc_get_vars(@file_id, @var_id, start, count, stride, 
+                                {fill: fills}) 
+                  }, masked: !fills.nil?)
   end
 
   def get_varm (start, count, stride, imap)
-    return nc_get_varm(@file_id, @var_id, start, count, stride, imap)
+    return nc_nonblocking { 
+      nc_get_varm(@file_id, @var_id, start, count, stride, imap) 
+    }
   end
 
   def get_varm! (start, count, stride, imap)
-    return decode(nc_get_varm(@file_id, @var_id, start, count, stride, imap))
+    fills = native_fills
+    return decode(nc_nonblocking { 
+                    nc_get_varm(@file_id, @var_id, start, count, stride, imap,
+                                {fill: fills}) 
+                  }, masked: !fills.nil?)
+  end
+
+  def record?
+    return ( not @dims.empty? and @dims.first.unlimited? )
+  end
+
+  #
+  # Re-reads the shape from the dimensions after the file has grown and 
+  # drops the caches depending on it (called by NCFile#refresh!)
+  #
+  def refresh_shape
+    @shape   = @dims.map{|d| d.len}.freeze
+    @time_ns = nil
+  end
+
+  #
+  # Time series at many points of a variable (time, ...) => [npoints, ntime]
+  # (decoded). Each record is read once: the block covering all the points
+  # is read for batches of records (as many as fit in budget bytes) and 
+  # the values are scattered natively into the output (nc_timeseries).
+  #
+  #   points     : [[j, i], ...] indices of the non-time dimensions, or 
+  #                int64 CArray (Integer Array) of flat addresses over them
+  #   time_range : Range of record indices, Range of time coordinate values
+  #                (Time, Numeric) or nil for all records
+  #
+  #   var.timeseries([[10, 20], [11, 40]], 0...365)
+  #
+  def timeseries (points, time_range = nil, budget: nil, threads: nil)
+    inner = @shape[1..-1]
+    if points.is_a?(Array) and points.first.is_a?(Array)
+      points = points.map { |pos| 
+        unless pos.size == inner.size
+          raise ArgumentError, "point #{pos.inspect} needs #{inner.size} indices"
+        end
+        pos.zip(inner).inject(0) { |a, (p, n)| 
+          raise IndexError, "point #{pos.inspect} out of range" unless p >= -n and p < n
+          a * n + ( p < 0 ? p + n : p )
+        }
+      }
+    end
+    points = CA_INT64(points) unless points.is_a?(CArray) and points.data_type == CA_INT64
+    case time_range
+    when nil
+      records = 0...@shape[0]
+    when Range
+      if [time_range.begin, time_range.end].compact.all? { |x| x.is_a?(Integer) }
+        records = time_range
+      else
+        records = @dims.first.slice_for(time_range) || (0...0)
+      end
+    else
+      raise ArgumentError, "invalid time range"
+    end
+    first, count = nc_range_span(records, @shape[0])
+    opts = {}
+    opts[:budget]  = budget if budget
+    opts[:threads] = threads if threads
+    out = nc_nonblocking { 
+      nc_timeseries(@file_id, @var_id, points, first, count, opts)
+    }
+    return decode(out)
+  end
+
+  #
+  # Yields the (decoded) records appended along the unlimited dimension 
+  # since the last call, after NCFile#refresh!. The first call starts at 
+  # record 0, and an explicit from (a record index, or :end to skip the 
+  # existing records) moves the cursor on any call. New records are read
+  # in blocks of batch records (as many as fit in NC.memory_budget or 
+  # 64 MiB by default). Returns the number of records yielded.
+  #
+  #   loop { var.each_new_record { |rec| plot(rec) }; sleep 5 }
+  #
+  def each_new_record (from: nil, batch: nil)
+    raise RuntimeError, "#{@name} is not a record variable" unless record?
+    @ncfile.refresh!
+    if from
+      @record_cursor = ( from == :end ) ? @shape[0] : from
+    else
+      @record_cursor ||= 0
+    end
+    first = @record_cursor
+    inner = @shape[1..-1]
+    unless batch
+      bytes = CArray.new(NC.ca_type(@vartype), [1]).bytes * inner.inject(1, :*)
+      batch = ( ( NC.memory_budget || 64 * 1024 * 1024 ) / bytes ).to_i
+    end
+    batch = [batch, 1].max
+    tail  = [nil] * inner.size
+    while @record_cursor < @shape[0]
+      m = [batch, @shape[0] - @record_cursor].min
+      block = get_vara!([@record_cursor] + [0] * inner.size, [m] + inner)
+      m.times do |i|
+        @record_cursor += 1
+        yield( block.is_a?(CArray) ? block[i, *tail] : block )
+      end
+    end
+    return @record_cursor - first
   end
 
 end
@@ -256,15 +930,37 @@ class NCDim < NCObject
   
   include NC
   
-  def initialize (ncfile, dim_id)
+  # units of NCVar#time_ns (in the calendar of the coordinate)
+
+  TIME_NS_UNITS = "nanoseconds since 1970-01-01 00:00:00"
+
+  def initialize (ncfile, dim_id, meta = nil)
     @ncfile      = ncfile
     @file_id     = ncfile.file_id
     @dim_id      = dim_id
-    @name        = nc_inq_dimname(@file_id, @dim_id)
-    @len         = nc_inq_dimlen(@file_id, @dim_id)
+    if meta
+      @name, @len = meta
+    else
+      @name      = nc_inq_dimname(@file_id, @dim_id)
+      @len       = nc_inq_dimlen(@file_id, @dim_id)
+    end
   end
 
-  attr_reader :name, :len
+  attr_reader :name, :len, :dim_id
+
+  def unlimited?
+    return @ncfile.unlimited_dims.include?(@dim_id)
+  end
+
+  #
+  # Sets the length after the file has grown and drops the coordinate 
+  # index (called by NCFile#refresh!)
+  #
+  def resize (len)
+    @len = len
+    @coord_index = nil
+    @time_index  = nil
+  end
 
   def definition
     return @len
@@ -286,41 +982,252 @@ class NCDim < NCObject
     return @ncfile[name][*argv]
   end
 
+  #
+  # Index of the coordinate value equal to value (nil if not found).
+  # Time objects are accepted for CF time coordinates.
+  #
+  def index_of (value)
+    return nc_coord_locate(*index_for(value), coord_value(value), NC_LOCATE_EXACT)
+  end
+
+  #
+  # Index (or int64 CArray of indices) of the nearest coordinate values
+  #
+  def nearest (values)
+    if values.is_a?(Array)
+      index  = index_for(*values.first(1))
+      values = CA_DOUBLE(values.map { |v| coord_value(v) }) 
+    elsif values.is_a?(CArray)
+      index  = coord_index
+      values = CA_DOUBLE(values)
+    else
+      index  = index_for(values)
+      values = coord_value(values)
+    end
+    return nc_coord_locate(*index, values, NC_LOCATE_NEAREST)
+  end
+
+  #
+  # Index range of the coordinate values within range (nil if none)
+  #
+  def slice_for (range)
+    index = index_for(range.begin || range.end)
+    lo = coord_value(range.begin) || -Float::INFINITY
+    hi = coord_value(range.end) || Float::INFINITY
+    excl = range.exclude_end?
+    if lo > hi
+      lo, hi = hi, lo
+      excl = false
+    end
+    first, last = nc_coord_range(*index, lo, hi, excl)
+    return first ? first..last : nil
+  end
+
+  #
+  # true if the coordinate is longitude (degrees_east)
+  #
+  def longitude?
+    var = @ncfile[@name]
+    return false unless var
+    units = var.attribute("units")
+    if units
+      return ( units.to_s.strip =~ /\Adegrees?_?E(ast)?\z/i ) ? true : false
+    else
+      return ( @name =~ /\Alon(gitude)?\z/i ) ? true : false
+    end
+  end
+
+  #
+  # Index ranges of the coordinate values within range in the storage
+  # order. For longitude, range runs eastward from its begin to its end 
+  # modulo 360 (170..-170 crosses the dateline) and is split in two when
+  # it crosses the seam of the coordinate.
+  #
+  def slices_for (range)
+    if longitude? and range.begin and range.end
+      coords, dir, step = coord_index
+      return [] if coords.elements == 0
+      if ( range.end - range.begin ).abs >= 360
+        return [0..(@len-1)]
+      end
+      base = ( dir > 0 ) ? coords[0] : coords[-1]
+      lo   = base + ( range.begin - base ) % 360
+      hi   = base + ( range.end - base ) % 360
+      if lo <= hi
+        list = [ slice_for(Range.new(lo, hi, range.exclude_end?)) ]
+      else
+        list = [ slice_for(lo..Float::INFINITY),
+                 slice_for(Range.new(-Float::INFINITY, hi, range.exclude_end?)) ]
+        list.reverse! if dir < 0
+      end
+      return list.compact
+    else
+      return [ slice_for(range) ].compact
+    end
+  end
+
+  private
+
+  # value for the lookup through index_for(value) : Time is converted to 
+  # nanoseconds as NCVar#time_ns
+
+  def coord_value (value)
+    if value.respond_to?(:year)
+      return @ncfile[@name].time_value(value, units: TIME_NS_UNITS)
+    else
+      return value
+    end
+  end
+
+  # coordinate index for looking up value: the cached time_ns of the CF 
+  # time coordinate variable for Time, the coordinate values otherwise
+
+  def index_for (value = nil)
+    return ( value.respond_to?(:year) ) ? time_index : coord_index
+  end
+
+  def time_index
+    @time_index ||= begin
+      var = @ncfile[@name] or 
+        raise RuntimeError, "no coordinate variable for '#{@name}'"
+      coords = CA_DOUBLE(var.time_ns)
+      dir, step = nc_coord_scan(coords)
+      if dir == 0
+        raise RuntimeError, "coordinate '#{@name}' is not monotonic"
+      end
+      [coords, dir, step].freeze
+    end
+  end
+
+  #
+  # [coordinate values, direction, step] built from the coordinate 
+  # variable on first use
+  #
+  def coord_index
+    @coord_index ||= begin
+      var = @ncfile[@name] or 
+        raise RuntimeError, "no coordinate variable for '#{@name}'"
+      coords = CA_DOUBLE(var[])
+      dir, step = nc_coord_scan(coords)
+      if dir == 0
+        raise RuntimeError, "coordinate '#{@name}' is not monotonic"
+      end
+      [coords, dir, step].freeze
+    end
+  end
+
 end
 
 class NCFile < NCObject
 
   include NC
 
-  def self.open (filename)
-    file_id = NC.open(filename)
-    return NCFile.new(file_id)
+  #
+  # metadata : NCFile#metadata of the same file to skip parsing
+  # share    : opens with NC_SHARE for reading a file being written by 
+  #            another process (see refresh!)
+  #
+  def self.open (filename, metadata: nil, share: false)
+    file_id = share ? NC.open(filename, NC_NOWRITE|NC_SHARE) : NC.open(filename)
+    return NCFile.new(file_id, filename, metadata: metadata, share: share)
   end
 
-  def initialize (file_id)
+  def initialize (file_id, path = nil, metadata: nil, share: false)
     @file_id  = file_id
+    @path     = path
+    @share    = share
+    @closed   = false
     @dims     = []
     @vars     = []
     @name2dim = {}
     @name2var = {}
-    @attributes = get_attributes(@file_id, NC::NC_GLOBAL)
-    parse_metadata()
+    if metadata
+      @attributes = metadata[:attributes].map { |k, v| 
+        [k, v.is_a?(Array) ? v.to_ca : v] 
+      }.to_h.freeze
+    else
+      @attributes = get_attributes(@file_id, NC::NC_GLOBAL)
+    end
+    parse_metadata(metadata)
+  end
+
+  attr_reader :file_id, :dims, :vars, :path
+
+  def close
+    nc_close(@file_id) unless @closed
+    @closed = true
+  end
+
+  def closed?
+    return @closed
+  end
+
+  #
+  # Opens the file again after close, keeping the parsed metadata
+  # (dimensions, variables and their caches) 
+  #
+  def reopen
+    raise RuntimeError, "file path unknown" unless @path
+    return self unless @closed
+    @file_id = @share ? nc_open(@path, NC_NOWRITE|NC_SHARE) : nc_open(@path)
+    @closed  = false
+    (@dims + @vars).each { |x| x.rebind(@file_id) }
+    return self
   end
 
-  attr_reader :file_id, :dims, :vars
+  #
+  # Re-reads the header of a file being appended by a writer (nc_sync) 
+  # and updates in place the lengths of the dimensions which have grown 
+  # (the unlimited dimension) and the shapes of the variables using them.
+  # Caches depending on them (coordinate index, time values, metadata) are
+  # dropped. The rest of the metadata is not parsed again.
+  #
+  def refresh!
+    nc_sync(@file_id)
+    resized = []
+    unlimited_dims.each do |dimid|
+      dim = @dims[dimid]
+      len = nc_inq_dimlen(@file_id, dimid)
+      if len != dim.len
+        dim.resize(len)
+        resized << dim
+      end
+    end
+    unless resized.empty?
+      @vars.each do |var|
+        var.refresh_shape unless ( var.dims & resized ).empty?
+      end
+      @metadata = nil
+    end
+    return self
+  end
 
-  def parse_metadata ()
+  #
+  # dimension ids of the unlimited dimensions
+  #
+  def unlimited_dims
+    @unlimited_dims ||= begin
+      unlimdim = nc_inq_unlimdim(@file_id)
+      ( unlimdim >= 0 ) ? [unlimdim].freeze : [].freeze
+    end
+  end
+
+  def parse_metadata (metadata = nil)
     ndims = nc_inq_ndims(@file_id)
+    nvars = nc_inq_nvars(@file_id)
+    if metadata and 
+       ( metadata[:dims].size != ndims or metadata[:vars].size != nvars )
+      raise ArgumentError, "metadata does not match the file"
+    end
     ndims.times do |i|
-      dim = NCDim.new(self, i)
+      dim = NCDim.new(self, i, metadata && metadata[:dims][i])
       @dims[i] = dim
       @name2dim[dim.name] = dim
     end
     @dims.freeze
     @name2dim.freeze
-    nvars = nc_inq_nvars(@file_id)
     nvars.times do |i|
-      var = NCVar.new(self, i)
+      var = NCVar.new(self, i, metadata && metadata[:vars][i])
       @vars[i] = var
       @name2var[var.name] = var
     end
@@ -328,6 +1235,46 @@ class NCFile < NCObject
     @name2var.freeze
   end
 
+  #
+  # Parsed metadata as a deeply frozen (Ractor-shareable) Hash. 
+  # It can be passed to other Ractors, which open the file by 
+  # NCFile.open(path, metadata: metadata) without parsing it again.
+  # Array-valued attributes are held as Arrays (restored by Array#to_ca).
+  #
+  #   { dims: [[name, len], ...],
+  #     vars: [[name, type, dimids, attributes], ...],
+  #     attributes: {...} }
+  #
+  def metadata
+    @metadata ||= begin
+      plain = lambda { |attrs|
+        attrs.map { |k, v| 
+          if v.is_a?(CArray)
+            v = ( v.elements == 1 ) ? v[0] : v.to_a
+          end
+          [k, v] 
+        }.to_h
+      }
+      meta = {
+        dims: @dims.map { |d| [d.name, d.len] },
+        vars: @vars.map { |v| 
+          [v.name, v.definition[:type], v.dims.map { |d| @dims.index(d) }, 
+           plain[v.attributes]] 
+        },
+        attributes: plain[@attributes],
+      }
+      if defined?(Ractor)
+        Ractor.make_shareable(meta)
+      else
+        freeze_all = lambda { |x|
+          x.each { |*e| e.each(&freeze_all) } if x.respond_to?(:each)
+          x.freeze
+        }
+        freeze_all[meta]
+      end
+    end
+  end
+
   def definition
     {
       dims: @dims.map{|x| [x.name, x.definition] }.to_h,
@@ -344,6 +1291,16 @@ class NCFile < NCObject
     return @name2dim[name]
   end
 
+  #
+  # Label-based selection (see NCVar#sel)
+  #
+  #   nc.sel("sst", lat: -10..10, lon: 170..-170)
+  #
+  def sel (name, **ranges)
+    var = @name2var[name.to_s] or raise ArgumentError, "no variable '#{name}'"
+    return var.sel(**ranges)
+  end
+
   def has_dim?(name)
     return @name2dim.has_key?(name)
   end
@@ -352,6 +1309,167 @@ class NCFile < NCObject
     return @name2var.has_key?(name)
   end
 
+  #
+  # Reads the record variables names over the records in range (all if
+  # nil) => Array of decoded CArrays [nrec, ...]. A classic format file is 
+  # read natively by walking the record section once with sequential 
+  # reads of at most buffer bytes, de-interleaving all the variables in 
+  # the same pass (nc_read_records). Other formats are read by one 
+  # get_vara per variable.
+  #
+  #   u, v, t = nc.read_records(["u", "v", "t"], 0...240)
+  #
+  def read_records (names, range = nil, buffer: nil)
+    vars = names.map { |name| 
+      @name2var[name.to_s] or raise ArgumentError, "no variable '#{name}'"
+    }
+    vars.each do |var|
+      raise ArgumentError, "#{var.name} is not a record variable" unless var.record?
+    end
+    nrec  = vars.first.dims.first.len
+    start, count = nc_range_span(range || (0...nrec), nrec)
+    data  = nil
+    if @path
+      opts = buffer ? { buffer: buffer } : {}
+      begin
+        data = nc_read_records(@path, vars.map(&:name), start, count, opts)
+      rescue NotImplementedError
+      end
+    end
+    if data
+      return vars.zip(data).map { |var, value| var.decode(value) }
+    else
+      return vars.map { |var|
+        inner = var.dims[1..-1].map(&:len)
+        var.get_vara!([start] + [0] * inner.size, [count] + inner)
+      }
+    end
+  end
+
+  #
+  # Extracts the values of a variable on a curvilinear grid (2D latitude/
+  # longitude coordinate variables) at the grid points nearest to 
+  # (lats, lons).
+  #
+  #   nc.extract_points("temp", lats, lons)         => [..., npoints]
+  #   nc.extract_points("temp", lats, lons, times)  => [npoints]
+  #
+  # times are the values of the time coordinate of each point. 
+  # All points are located at once by a KD-tree over the grid, which is 
+  # built on first use and cached. The values are read by hyperslabs 
+  # covering the located points (per time record if times are given), 
+  # batched along the first dimension within NC.memory_budget.
+  # Invalid query points (NaN) give masked values.
+  #
+  def extract_points (name, lats, lons, times = nil)
+    var = @name2var[name.to_s] or raise ArgumentError, "no variable '#{name}'"
+    lat, lon = grid_coordinates(var)
+    nx    = lat.dims[1].len
+    index = nc_kdtree_query(*point_index(lat, lon), 
+                            CA_DOUBLE(lats), CA_DOUBLE(lons)).to_a
+    valid = (0...index.size).select { |q| index[q] >= 0 }
+    lead  = var.dims[0..-3]
+    raise ArgumentError, "no valid query point" if valid.empty?
+    if times
+      unless lead.size == 1
+        raise ArgumentError, "times requires a variable of rank 3"
+      end
+      tindex = lead[0].nearest(CA_DOUBLE(times)).to_a
+      out = nil
+      valid.group_by { |q| tindex[q] }.each do |t, qs|
+        values = read_points(var, [t], [1], qs.map { |q| index[q] }, nx)
+        out ||= CArray.new(values.data_type, [index.size])
+        out[CArray.int64(qs.size) { qs }] = values[0, nil]
+      end
+    else
+      count  = lead.map(&:len)
+      values = read_points(var, [0] * lead.size, count, 
+                           valid.map { |q| index[q] }, nx)
+      out = CArray.new(values.data_type, count + [index.size])
+      out[*([nil] * lead.size), CArray.int64(valid.size) { valid }] = values
+    end
+    if valid.size < index.size
+      invalid = (0...index.size).to_a - valid
+      out[*([nil] * (out.rank - 1)), CArray.int64(invalid.size) { invalid }] = UNDEF
+    end
+    return out
+  end
+
+  private
+
+  # 2D latitude and longitude coordinate variables of var's grid 
+  # (the last two dimensions)
+
+  def grid_coordinates (var)
+    grid = var.dims[-2..-1]
+    unless grid and grid.size == 2
+      raise ArgumentError, "#{var.name} is not on a 2D grid"
+    end
+    names = var.attribute("coordinates").to_s.split
+    cands = names.map { |n| @name2var[n] }.compact
+    cands = @name2var.values if cands.empty?
+    cands = cands.select { |v| v.dims == grid }
+    lat = cands.find { |v| v.attribute("units").to_s =~ /\Adegrees?_?N(orth)?\z/i } ||
+          cands.find { |v| v.name =~ /\Alat/i }
+    lon = cands.find { |v| v.attribute("units").to_s =~ /\Adegrees?_?E(ast)?\z/i } ||
+          cands.find { |v| v.name =~ /\Alon/i }
+    unless lat and lon
+      raise RuntimeError, "no 2D latitude/longitude for #{var.name}"
+    end
+    return lat, lon
+  end
+
+  # KD-tree over the grid points (cached)
+
+  def point_index (lat, lon)
+    @point_index ||= {}
+    return @point_index[[lat.name, lon.name]] ||= begin
+      clat = CA_DOUBLE(lat[])
+      clon = CA_DOUBLE(lon[])
+      clat.unmask(Float::NAN) if clat.has_mask?
+      clon.unmask(Float::NAN) if clon.has_mask?
+      nc_kdtree_build(clat, clon).freeze
+    end
+  end
+
+  # reads the block covering the grid points (flat indices) and picks them,
+  # in batches along the first lead dimension within NC.memory_budget 
+  # (8 bytes per element assumed) => [*lead_count, npoints]
+
+  def read_points (var, lead_start, lead_count, points, nx)
+    js = points.map { |k| k / nx }
+    is = points.map { |k| k % nx }
+    j0, j1 = js.minmax
+    i0, i1 = is.minmax
+    bh = j1 - j0 + 1
+    bw = i1 - i0 + 1
+    addr  = js.zip(is).map { |j, i| (j - j0) * bw + (i - i0) }
+    sel   = CArray.int64(addr.size) { addr }
+    inner = lead_count.drop(1)
+    limit = NC.memory_budget
+    bytes = 8 * bh * bw * inner.inject(1, :*)
+    if limit and bytes > limit
+      raise "reading #{bytes} bytes of #{var.name} exceeds memory budget (#{limit} bytes)"
+    end
+    if lead_count.empty?
+      block = var.get_vara!([j0, i0], [bh, bw])
+      return block.reshape(bh * bw)[sel].to_ca
+    end
+    rows  = lead_count[0]
+    batch = limit ? [limit / bytes, 1].max : rows
+    out   = nil
+    (0...rows).step(batch) do |r|
+      m = [batch, rows - r].min
+      block = var.get_vara!([lead_start[0] + r] + lead_start.drop(1) + [j0, i0], 
+                            [m] + inner + [bh, bw])
+      block = block.reshape(m, *inner, bh * bw)
+      picked = block[*([nil] * lead_count.size), sel]
+      out ||= CArray.new(picked.data_type, lead_count + [addr.size])
+      out[r...r+m, false] = picked
+    end
+    return out
+  end
+
 end
 
 class NCFileWriter
@@ -362,6 +1480,11 @@ class NCFileWriter
 
     include NC
 
+    # hyperslabs tracked at most (fill: :fast) before the unwritten 
+    # regions are filled at once
+
+    MAX_WRITTEN = 256
+
     def initialize (ncfile, name, definition)
       @ncfile  = ncfile
       @file_id = ncfile.file_id
@@ -371,14 +1494,23 @@ class NCFileWriter
       @dims    = definition[:dims]
       @dim_ids = @dims.map{|key| @ncfile.dim(key).dim_id }
       @shape   = @dims.map{|key| @ncfile.dim(key).to_i }
+      @record  = ( not @dims.empty? and @ncfile.dim(@dims.first).unlimited? )
       @var_id  = nc_def_var(@file_id, @name, @type, @dim_ids)
       @attributes = definition[:attributes].map{|key, value| [key.to_s, value]}.to_h.freeze
       @attributes.each do |name, value|
         nc_put_att(@file_id, @var_id, name, value)
       end
+      @written = ( ncfile.fill_mode == :fast ) ? [] : nil
+      @pending = []
+      @pending_bytes = 0
+      @next_record = 0          # records appended to this variable
     end
     
     attr_reader :name, :attributes
+
+    def record?
+      return @record
+    end
     
     def []= (*argv)
       put(*argv)      
@@ -386,6 +1518,31 @@ class NCFileWriter
 
     def put (*argv)
       value = argv.pop
+      if @record
+        flush
+        update_shape
+      end
+      return put_text(argv, value) if @type == NC_CHAR
+      if defined?(CAVirtual) and value.is_a?(CAVirtual) and 
+         value.elements * value.bytes > NC.write_chunk
+        info = CArray.scan_index(@shape, argv)
+        case info.type
+        when CA_REG_ALL
+          return put_chunked([0]*@shape.size, @shape, [1]*@shape.size, value)
+        when CA_REG_BLOCK
+          return put_chunked(*nc_block_region(info), value)
+        end
+      end
+      if @written and ( region = nc_index_region(@shape, argv) )
+        start, count, stride = region
+        extent = count.zip(stride).map { |c, s| (c - 1) * s + 1 }
+        fill_unwritten(start, extent) unless stride.all? { |x| x == 1 }
+      end
+      status = nc_put_index(@file_id, @var_id, @shape, argv, value)
+      unless status.nil?
+        written(start, extent) if region
+        return status
+      end
       info = CArray.scan_index(@shape, argv)
       case info.type
       when CA_REG_ADDRESS
@@ -402,46 +1559,312 @@ class NCFileWriter
         put_var1(info.index, value)
       when CA_REG_ALL
         put_var(value)
+      when CA_REG_BLOCK
+        start, count, stride = nc_block_region(info)
+        if stride.all?{|x| x == 1 }
+          put_vara(start, count, value)
+        else
+          put_vars(start, count, stride, value)
+        end
+      when CA_REG_SELECT
+        mask = info.index[0]
+        addr = mask.where
+        if value.is_a?(CArray) and value.elements == mask.elements and 
+           value.elements != addr.elements
+          value = value[mask]
+        end
+        put_scatter(addr, value)
+      when CA_REG_GRID
+        lists = info.index.map.with_index { |idx, i| grid_list(idx, @shape[i]) }
+        put_scatter(lists, value)
+      else
+        raise "invalid index"
+      end
+    end
+
+    #
+    # Writes values to the elements at row-major addresses (sorted and 
+    # merged natively into runs or read-modify-write blocks). addr may be
+    # an Array of int64 CArrays, one index list per dimension, for the grid
+    # of their outer product (expanded natively).
+    #
+    def put_scatter (addr, value)
+      fill_unwritten
+      unless addr.is_a?(Array) and addr.first.is_a?(CArray) or 
+             addr.is_a?(CArray) and addr.data_type == CA_INT64
+        addr = CA_INT64(addr)
+      end
+      value = value.to_ca if value.is_a?(CArray)
+      return nc_put_scatter(@file_id, @var_id, addr, value)
+    end
+
+    #
+    # Fills the whole variable with a Numeric or a CArray broadcast along 
+    # the missing leading dimensions (written natively in chunks).
+    #
+    def fill (value)
+      status = nc_put_var_all(@file_id, @var_id, value)
+      written([0] * @shape.size, @shape)
+      return status
+    end
+
+    #
+    # Appends records to a variable of the unlimited dimension. block is 
+    # one record (shaped as the other dimensions) or [n, ...] records.
+    # Records are buffered and written by one nc_put_vara when NC.write_chunk
+    # bytes are pending (and at flush or NCFileWriter#close), so that the
+    # number of records in the header is updated once per flush.
+    #
+    def append (block)
+      raise "#{@name} is not a record variable" unless @record
+      inner = @shape[1..-1]
+      case block
+      when CArray
+      when Array
+        block = block.to_ca
+      else
+        block = CArray.new(NC.ca_type(@type), inner.empty? ? [1] : inner) { block }
+      end
+      if inner.empty?
+        block = block.reshape(block.elements)
+      elsif block.dim == inner
+        block = block.reshape(1, *inner)
+      elsif block.dim[1..-1] != inner
+        raise "shape of records #{block.dim.inspect} does not match #{inner.inspect}"
+      end
+      if block.has_mask?
+        flush
+        put_vara([@next_record] + [0] * inner.size, block.dim, block)
+        @next_record += block.dim0
+        update_shape
+        return self
+      end
+      @pending.push block.to_ca
+      @pending_bytes += block.elements * block.bytes
+      flush if @pending_bytes >= NC.write_chunk
+      return self
+    end
+
+    #
+    # Writes the records buffered by append.
+    #
+    def flush
+      return NC_NOERR if @pending.empty?
+      inner = @shape[1..-1]
+      n     = @pending.inject(0) { |s, b| s + b.dim0 }
+      tail  = [nil] * inner.size
+      data  = CArray.new(NC.ca_type(@type), [n] + inner)
+      k = 0
+      @pending.each do |b|
+        data[k...k+b.dim0, *tail] = b
+        k += b.dim0
+      end
+      @pending = []
+      @pending_bytes = 0
+      status = put_vara([@next_record] + [0] * inner.size, [n] + inner, data)
+      @next_record += n
+      update_shape
+      return status
+    end
+
+    def update_shape
+      @shape[0] = nc_inq_dimlen(@file_id, @dim_ids[0]) if @record
+    end
+    private :update_shape
+
+    #
+    # Writes the fill value to the regions not written yet (fill: :fast)
+    # within start/count (the whole variable by default). Called by 
+    # NCFileWriter#close, before a strided write (over its bounding box) 
+    # and before a scattered write. After a whole fill, a record variable
+    # keeps the records so far as one hyperslab, so that the records 
+    # appended later (by any variable) are still filled at close; other 
+    # variables stop tracking.
+    #
+    def fill_unwritten (start = nil, count = nil)
+      update_shape
+      return unless @written
+      whole = start.nil?
+      start ||= [0] * @shape.size
+      count ||= @shape.dup
+      unwritten(@written, start, start.zip(count).map { |s, c| s + c }).each do |st, ct|
+        nc_put_var_fill(@file_id, @var_id, nil, 
+                        { chunk: NC.write_chunk, start: st, count: ct })
+      end
+      if whole
+        @written = @record ? [[start, count]] : nil
+      end
+    end
+
+    # records the hyperslab written (fill: :fast), merging consecutive 
+    # slabs along the first dimension. Over MAX_WRITTEN slabs, fills the
+    # unwritten regions at once since finding them grows quadratically.
+
+    def written (start, count)
+      return unless @written
+      if not @record and start.zip(count, @shape).all? { |s, c, n| s == 0 and c >= n }
+        @written = nil
+        return
+      end
+      last = @written.last
+      if last and last[0][0] + last[1][0] == start[0] and 
+         last[0][1..-1] == start[1..-1] and last[1][1..-1] == count[1..-1]
+        last[1][0] += count[0]
+      else
+        @written.push [start.dup, count.dup]
+        fill_unwritten if @written.size > MAX_WRITTEN
+      end
+    end
+    private :written
+
+    # regions of the box lo...hi (dimensions d..) not covered by boxes 
+    # => [[start, count], ...]
+
+    def unwritten (boxes, lo, hi, d = 0, start = [], count = [], gaps = [])
+      if boxes.empty?
+        gaps.push [start + lo[d..-1], 
+                   count + hi[d..-1].zip(lo[d..-1]).map { |h, l| h - l }]
+      elsif d < lo.size
+        cuts = boxes.map { |s, c| [s[d], s[d] + c[d]] }.flatten
+        cuts = (cuts + [lo[d], hi[d]]).select { |x| x >= lo[d] and x <= hi[d] }.sort.uniq
+        cuts.each_cons(2) do |a, b|
+          active = boxes.select { |s, c| s[d] <= a and s[d] + c[d] >= b }
+          unwritten(active, lo, hi, d + 1, start + [a], count + [b - a], gaps)
+        end
+      end
+      return gaps
+    end
+    private :unwritten
+
+    # index list along a dimension of length len for an element of a grid
+    # index => int64 CArray (negative from the end, range checked natively)
+
+    def grid_list (idx, len)
+      case idx
+      when Integer
+        return CA_INT64([idx])
+      when Array
+        start, count, step = idx
+        return CA_INT64(Array.new(count) { |k| start + k * (step || 1) })
+      when CArray
+        return ( idx.data_type == CA_INT64 ) ? idx.to_ca : CA_INT64(idx)
+      when Range
+        first, count = nc_range_span(idx, len)
+        return CA_INT64(Array.new(count) { |k| first + k })
+      when nil
+        return CA_INT64(Array.new(len) { |k| k })
+      else
+        raise "invalid index"
+      end
+    end
+    private :grid_list
+
+    #
+    # Writes fixlen CArray, Array of Strings or String into NC_CHAR 
+    # variable indexed by the leading dimensions (padded with NUL).
+    #
+    def put_text (argv, value)
+      lead   = @shape[0..-2]
+      strlen = @shape[-1]
+      if lead.empty?
+        status = nc_put_vara_text(@file_id, @var_id, [0], [strlen], value)
+        written([0], [strlen])
+        return status
+      end
+      info = CArray.scan_index(lead, argv)
+      case info.type
+      when CA_REG_ALL
+        start = [0] * lead.size
+        count = lead
+      when CA_REG_POINT
+        start = info.index
+        count = [1] * lead.size
       when CA_REG_BLOCK
         start = []
         count = []
-        stride = []
         info.index.each do |idx|
           case idx
           when Array
+            raise "stride is not supported for NC_CHAR" unless idx[2] == 1
             start << idx[0]
             count << idx[1]
-            stride << idx[2]
           else
             start << idx
             count << 1
-            stride << 1
           end
         end
-        if stride.all?{|x| x == 1 }
-          put_vara(start, count, value)
-        else
-          put_vars(start, count, stride, value)
-        end
       else
-        raise "invalid index"
+        raise "invalid index for NC_CHAR"
+      end
+      status = nc_put_vara_text(@file_id, @var_id, start + [0], count + [strlen], value)
+      written(start + [0], count + [strlen])
+      return status
+    end
+
+    #
+    # Writes a virtual CArray (block, window, transposed view, ...) to the
+    # region in chunks of at most NC.write_chunk bytes, materializing only
+    # one chunk at a time. The chunks are split along the outermost 
+    # dimension for which the inner dimensions fit in a chunk.
+    #
+    def put_chunked (start, count, stride, value)
+      view  = ( value.dim == count ) ? value : value.reshape(*count)
+      inner = value.bytes
+      k = count.size - 1
+      while k > 0 and inner * count[k] <= NC.write_chunk
+        inner *= count[k]
+        k -= 1
+      end
+      rows  = ( NC.write_chunk / inner ).clamp(1, count[k])
+      outer = count[0...k]
+      tail  = [nil] * (count.size - k - 1)
+      outer.inject(1, :*).times do |n|
+        pos = []
+        outer.reverse_each do |c|
+          pos.unshift(n % c)
+          n /= c
+        end
+        (0...count[k]).step(rows) do |i|
+          m  = [rows, count[k] - i].min
+          st = pos.map.with_index { |p, j| start[j] + p * stride[j] } + 
+               [start[k] + i * stride[k]] + start[k+1..-1]
+          ct = [1] * k + [m] + count[k+1..-1]
+          slab = view[*pos.map { |p| p..p }, i...i+m, *tail].to_ca
+          if stride.all?{|x| x == 1 }
+            put_vara(st, ct, slab)
+          else
+            put_vars(st, ct, stride, slab)
+          end
+        end
       end
+      return NC_NOERR
     end
+    private :put_chunked
 
     def put_var1 (index, value)
-      return nc_put_var1(@file_id, @var_id, index, value)
+      status = nc_put_var1(@file_id, @var_id, index, value)
+      written(index, [1] * index.size)
+      return status
     end
 
     def put_var (value)
-      return nc_put_var(@file_id, @var_id, value)
+      status = nc_put_var(@file_id, @var_id, value)
+      written([0] * @shape.size, @shape)
+      return status
     end
 
     def put_vara (start, count, value)
-      return nc_put_vara(@file_id, @var_id, start, count, value)
+      status = nc_put_vara(@file_id, @var_id, start, count, value)
+      written(start, count)
+      return status
     end
 
     def put_vars (start, count, stride, value)
-      return nc_put_vars(@file_id, @var_id, start, count, stride, value)
+      extent = count.zip(stride).map { |c, s| (c - 1) * s + 1 }
+      fill_unwritten(start, extent) unless stride.all? { |x| x == 1 }
+      status = nc_put_vars(@file_id, @var_id, start, count, stride, value)
+      written(start, extent)
+      return status
     end
 
     def get_varm (start, count, stride, imap, value)
@@ -464,15 +1887,54 @@ class NCFileWriter
     end
     
     attr_reader :name, :dim_id
+
+    def unlimited?
+      return @len == NC_UNLIMITED
+    end
     
     def to_i
-      return @len
+      return unlimited? ? nc_inq_dimlen(@file_id, @dim_id) : @len
     end
     
   end
   
-  def initialize (file)
-    @file_id = nc_create(file)
+  FORMATS = {
+    classic: 0,
+    cdf1: 0,
+    cdf2: NC_64BIT_OFFSET,
+    offset64: NC_64BIT_OFFSET,
+  }
+  if NC.const_defined?(:NC_64BIT_DATA)
+    FORMATS[:cdf5]   = NC_64BIT_DATA
+    FORMATS[:data64] = NC_64BIT_DATA
+  end
+  FORMATS.freeze
+
+  #
+  # fill: nil   - libnetcdf pre-fills the variables with fill values
+  #       :fast - NC_NOFILL, only the regions not written are filled at close
+  #       :none - NC_NOFILL, unwritten regions are left undefined
+  #
+  def initialize (file, format: nil, fill: nil)
+    case format
+    when nil
+      mode = NC_CLOBBER
+    when Integer
+      mode = NC_CLOBBER | format
+    else
+      mode = NC_CLOBBER | FORMATS.fetch(format.to_sym) {
+        raise ArgumentError, "unknown netcdf format '#{format}'"
+      }
+    end
+    @file_id = nc_create(file, mode)
+    case fill
+    when nil
+    when :fast, :none
+      nc_set_fill(@file_id, NC_NOFILL)
+    else
+      raise ArgumentError, "unknown fill mode '#{fill}'"
+    end
+    @fill_mode = fill
     @dims    = []
     @name2dim = {}
     @vars    = []
@@ -480,10 +1942,11 @@ class NCFileWriter
     @attributes = nil
   end
   
-  attr_reader :file_id
+  attr_reader :file_id, :fill_mode
   
   def define (definition)
     definition[:dims].each do |name, len|
+      len = NC_UNLIMITED if len.nil? or len == :unlimited
       dim = Dim.new(self, name.to_s, len.to_i)
       @dims.push dim
       @name2dim[name.to_s] = dim
@@ -526,8 +1989,155 @@ class NCFileWriter
     return @name2var[name].put(value)
   end
   
+  #
+  # Writes the records buffered by Var#append and syncs the file.
+  #
+  def flush
+    @vars.each(&:flush)
+    nc_sync(@file_id)
+  end
+
   def close
+    @vars.each(&:flush)
+    @vars.each(&:fill_unwritten) if @fill_mode == :fast
     nc_close(@file_id)
   end
   
-end
\ No newline at end of file
+end
+
+#
+# Pool of read-only NCFile objects for services opening many files. 
+# Files are cached by path and mtime with their parsed metadata. At most 
+# max_open handles are kept open; idle files are closed least recently 
+# used first and reopened transparently on the next lease. A file 
+# modified on disk is opened anew.
+#
+#   pool = NC::HandlePool.new(max_open: 64)
+#   pool.lease(path) { |nc| nc["sst"][0, nil, nil] }
+#
+class NC::HandlePool
+
+  Entry = Struct.new(:path, :mtime, :ncfile, :leases, :last_used, :lock)
+
+  def initialize (max_open: 64, max_cached: 1024)
+    @max_open   = max_open
+    @max_cached = max_cached
+    @entries    = {}
+    @leased     = {}
+    @mutex      = Mutex.new
+    @clock      = 0
+  end
+
+  attr_reader :max_open, :max_cached
+
+  #
+  # Leases the NCFile of path. With a block, yields it and releases it
+  # afterwards. Without a block, it must be returned by release.
+  #
+  def lease (path)
+    ncfile = acquire(path)
+    return ncfile unless block_given?
+    begin
+      return yield(ncfile)
+    ensure
+      release(ncfile)
+    end
+  end
+
+  def release (ncfile)
+    @mutex.synchronize {
+      entry = @leased[ncfile.object_id] or 
+        raise ArgumentError, "not leased from this pool"
+      entry.leases -= 1
+      if entry.leases == 0
+        @leased.delete(ncfile.object_id)
+        entry.ncfile.close if @entries[entry.path] != entry   # stale
+      end
+      evict
+    }
+    return nil
+  end
+
+  def open_count
+    @mutex.synchronize { 
+      @entries.each_value.count { |e| not e.ncfile.closed? } 
+    }
+  end
+
+  def size
+    @mutex.synchronize { @entries.size }
+  end
+
+  def close_all
+    @mutex.synchronize {
+      @entries.each_value { |e| e.ncfile.close if e.leases == 0 }
+      @entries.delete_if { |_, e| e.leases == 0 }
+    }
+    return nil
+  end
+
+  private
+
+  # files are opened and reopened outside the pool lock. when two threads
+  # open the same path, the first one inserted wins and the other closes
+  # its copy
+
+  def acquire (path)
+    path  = File.expand_path(path)
+    mtime = File.mtime(path)
+    entry = @mutex.synchronize { lease_entry(path, mtime) }
+    unless entry
+      ncfile = NCFile.open(path)
+      entry = @mutex.synchronize {
+        lease_entry(path, mtime) or
+          lease_entry(path, mtime, 
+                      @entries[path] = Entry.new(path, mtime, ncfile, 0, 0, Mutex.new))
+      }
+      ncfile.close if entry.ncfile != ncfile
+    end
+    begin
+      entry.lock.synchronize { entry.ncfile.reopen if entry.ncfile.closed? }
+    rescue Exception
+      release(entry.ncfile)
+      raise
+    end
+    return entry.ncfile
+  end
+
+  # with the lock held, leases the entry of path (dropping it if stale);
+  # nil if there is none
+
+  def lease_entry (path, mtime, entry = @entries[path])
+    if entry and entry.mtime != mtime
+      @entries.delete(path)
+      entry.ncfile.close if entry.leases == 0
+      entry = nil
+    end
+    return nil unless entry
+    entry.leases += 1
+    entry.last_used = (@clock += 1)
+    @leased[entry.ncfile.object_id] = entry
+    evict
+    return entry
+  end
+
+  # closes idle handles over max_open and forgets idle files over 
+  # max_cached, least recently used first
+
+  def evict
+    idle = @entries.each_value.select { |e| e.leases == 0 }.sort_by(&:last_used)
+    nopen = @entries.each_value.count { |e| not e.ncfile.closed? }
+    idle.each do |e|
+      break if nopen <= @max_open
+      next if e.ncfile.closed?
+      e.ncfile.close
+      nopen -= 1
+    end
+    idle.each do |e|
+      break if @entries.size <= @max_cached
+      e.ncfile.close unless e.ncfile.closed?
+      @entries.delete(e.path)
+    end
+  end
+
+end
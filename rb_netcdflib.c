@@ -1,6 +1,34 @@
 #include "ruby.h"
 #include "carray.h"
 #include <netcdf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#endif
+
+/* libnetcdf calls are serialized by a process-wide lock (see Ractor safety) */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_RB_EXT_RACTOR_SAFE)
+#define NC_USE_LIB_LOCK
+static void nc_lib_lock (void);
+static void nc_lib_unlock (void);
+#else
+#define nc_lib_lock()
+#define nc_lib_unlock()
+#endif
 
 #define CHECK_ARGC(n) \
   if ( argc != n ) \
@@ -160,6 +188,21 @@ rb_nc_open (int argc, VALUE *argv, VALUE mod)
   return LONG2NUM(nc_id);
 }
 
+static VALUE
+rb_nc_inq_format (int argc, VALUE *argv, VALUE mod)
+{
+  int status, format;
+
+  CHECK_ARGC(1);
+  CHECK_TYPE_ID(argv[0]);
+  
+  status = nc_inq_format(NUM2LONG(argv[0]), &format);
+
+  CHECK_STATUS(status);
+
+  return LONG2NUM(format);
+}
+
 static VALUE
 rb_nc_close (int argc, VALUE *argv, VALUE mod)
 {
@@ -1018,672 +1061,5689 @@ nc_put_varm_numeric (int ncid, int varid, nc_type type,
   }
 }
 
-static VALUE
-rb_nc_get_var1 (int argc, VALUE *argv, VALUE mod)
+static size_t
+nc_type_size (nc_type type)
 {
-  int status;
-  nc_type type;
-  int ndims;
-  size_t index[NC_MAX_DIMS];
-  int i;
+  switch ( type ) {
+  case NC_BYTE:
+  case NC_CHAR:
+    return 1;
+  case NC_SHORT:
+    return 2;
+  case NC_INT:
+  case NC_FLOAT:
+    return 4;
+  case NC_DOUBLE:
+    return 8;
+  default:
+    return 0;
+  }
+}
 
-  if ( argc < 3 ) {
-    rb_raise(rb_eArgError, "invalid # of arguments");
+/* ------------------------------------------------------------------------
+ *  strided block copy
+ *
+ *  Copies a block of count[] elements from src to dst. sstep[] and dstep[]
+ *  are the byte steps of each dimension in src and dst. The innermost 
+ *  run is specialized by element size so that compiler can vectorize it.
+ * ------------------------------------------------------------------------ */
+
+#define NC_COPY_RUN(T) \
+  { \
+    const T *s = (const T *) src; \
+    T *d = (T *) dst; \
+    ptrdiff_t si = ss / (ptrdiff_t) sizeof(T); \
+    ptrdiff_t di = ds / (ptrdiff_t) sizeof(T); \
+    for (k=0; k<n; k++) { \
+      d[k*di] = s[k*si]; \
+    } \
   }
 
-  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+static void
+nc_copy_run (size_t n, size_t elsize, 
+             const char *src, ptrdiff_t ss, char *dst, ptrdiff_t ds)
+{
+  size_t k;
 
-  CHECK_STATUS(status);
+  if ( ss == (ptrdiff_t) elsize && ds == (ptrdiff_t) elsize ) {
+    memcpy(dst, src, n * elsize);
+    return;
+  }
 
-  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+  switch ( elsize ) {
+  case 1: 
+    NC_COPY_RUN(uint8_t);
+    break;
+  case 2:
+    NC_COPY_RUN(uint16_t);
+    break;
+  case 4:
+    NC_COPY_RUN(uint32_t);
+    break;
+  case 8:
+    NC_COPY_RUN(uint64_t);
+    break;
+  default:
+    for (k=0; k<n; k++) {
+      memcpy(dst + k*ds, src + k*ss, elsize);
+    }
+  }
+}
 
-  CHECK_STATUS(status);
+static void
+nc_copy_strided (int ndims, const size_t count[], size_t elsize,
+                 const char *src, const ptrdiff_t sstep[],
+                 char *dst, const ptrdiff_t dstep[])
+{
+  size_t idx[NC_MAX_VAR_DIMS];
+  ptrdiff_t soff = 0, doff = 0;
+  int i;
 
-  Check_Type(argv[2], T_ARRAY);
-  for (i=0; i<ndims; i++) {
-    index[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+  if ( ndims == 0 ) {
+    memcpy(dst, src, elsize);
+    return;
   }
 
-  if ( argc == 3 ) {
-    switch ( type ) {
-    case NC_BYTE: {
-      uint8_t val;
-      status = nc_get_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-				   type, index, &val);
-      CHECK_STATUS(status);
-      return INT2NUM(val);
-    }
-    case NC_SHORT: {
-      int16_t val;
-      status = nc_get_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-				   type, index, &val);
-      CHECK_STATUS(status);
-      return INT2NUM(val);
-    }
-    case NC_INT: {
-      int32_t val;
-      status = nc_get_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-				   type, index, &val);
-      CHECK_STATUS(status);
-      return INT2NUM(val);
-    }
-    case NC_FLOAT: {
-      float32_t val;
-      status = nc_get_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-				   type, index, &val);
-      CHECK_STATUS(status);
-      return rb_float_new(val);
+  for (i=0; i<ndims; i++) {
+    if ( count[i] == 0 ) {
+      return;
     }
-    case NC_DOUBLE: {
-      float64_t val;
-      status = nc_get_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-				   type, index, &val);
-      CHECK_STATUS(status);
-      return rb_float_new(val);
+    idx[i] = 0;
+  }
+
+  while ( 1 ) {
+    nc_copy_run(count[ndims-1], elsize, 
+                src + soff, sstep[ndims-1], dst + doff, dstep[ndims-1]);
+    for (i=ndims-2; i>=0; i--) {
+      idx[i]++;
+      soff += sstep[i];
+      doff += dstep[i];
+      if ( idx[i] < count[i] ) {
+        break;
+      }
+      soff -= sstep[i] * count[i];
+      doff -= dstep[i] * count[i];
+      idx[i] = 0;
     }
-    default: 
-      rb_raise(rb_eRuntimeError, "unknown att nc_type");
+    if ( i < 0 ) {
+      break;
     }
   }
-  else {
-    volatile VALUE data = argv[3];
-    CArray *ca;
+}
 
-    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-      rb_raise(rb_eTypeError, "arg4 must be a CArray object");
+/* ------------------------------------------------------------------------
+ *  strided read
+ *
+ *  nc_get_vars of libnetcdf reads classic files nearly element by element.
+ *  When the strides are small, it is much faster to read the covering 
+ *  block with nc_get_vara into a scratch buffer and to subsample it in 
+ *  memory. The covering block is read in slabs along the first dimension 
+ *  so that the scratch buffer stays within NC_STRIDE_SCRATCH_MAX bytes.
+ * ------------------------------------------------------------------------ */
+
+#ifndef NC_STRIDE_GATHER_RATIO
+#define NC_STRIDE_GATHER_RATIO   16
+#endif
+
+#ifndef NC_STRIDE_SCRATCH_MAX
+#define NC_STRIDE_SCRATCH_MAX    (64*1024*1024)
+#endif
+
+static int
+nc_get_vars_fast (int ncid, int varid, nc_type type, int ndims,
+                  const size_t start[], const size_t count[], 
+                  const ptrdiff_t stride[], void *value)
+{
+  size_t    elsize = nc_type_size(type);
+  size_t    span[NC_MAX_VAR_DIMS], cstart[NC_MAX_VAR_DIMS];
+  ptrdiff_t sstep[NC_MAX_VAR_DIMS], dstep[NC_MAX_VAR_DIMS];
+  size_t    out_row = 1, cover_row = 1, rows, n;
+  char     *buf;
+  int       status = NC_NOERR;
+  int       i;
+
+  if ( elsize == 0 || ndims < 1 || ndims > NC_MAX_VAR_DIMS ) {
+    goto native;
+  }
+
+  for (i=0; i<ndims; i++) {
+    if ( count[i] == 0 || stride[i] < 1 ) {
+      goto native;
+    }
+    span[i] = (count[i] - 1) * stride[i] + 1;
+    if ( i > 0 ) {
+      out_row   *= count[i];
+      cover_row *= span[i];
     }
+  }
 
-    Data_Get_Struct(data, CArray, ca);
+  /* cost : covering elements per output element */
+  if ( cover_row * stride[0] > out_row * NC_STRIDE_GATHER_RATIO ||
+       cover_row * elsize > NC_STRIDE_SCRATCH_MAX ) {
+    goto native;
+  }
 
-    type = rb_nc_rtypemap(ca->data_type);
+  /* output rows of the first dimension per slab */
+  rows = NC_STRIDE_SCRATCH_MAX / (cover_row * elsize * stride[0]);
+  if ( rows < 1 ) {
+    rows = 1;
+  }
+  if ( rows > count[0] ) {
+    rows = count[0];
+  }
 
-    ca_attach(ca);
-    status = nc_get_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			       type, index, ca->ptr);
+  buf = malloc(((rows - 1) * stride[0] + 1) * cover_row * elsize);
+  if ( ! buf ) {
+    goto native;
+  }
 
-    ca_sync(ca);
-    ca_detach(ca);
+  sstep[ndims-1] = stride[ndims-1] * elsize;
+  dstep[ndims-1] = elsize;
+  for (i=ndims-2; i>=0; i--) {
+    sstep[i] = sstep[i+1] / stride[i+1] * span[i+1] * stride[i];
+    dstep[i] = dstep[i+1] * count[i+1];
+  }
 
-    CHECK_STATUS(status);
+  for (i=0; i<ndims; i++) {
+    cstart[i] = start[i];
+  }
 
-    return LONG2NUM(status);
+  for (n=0; n<count[0]; n+=rows) {
+    size_t slab[NC_MAX_VAR_DIMS];
+    size_t m = ( n + rows > count[0] ) ? count[0] - n : rows;
+    for (i=1; i<ndims; i++) {
+      slab[i] = span[i];
+    }
+    slab[0]   = (m - 1) * stride[0] + 1;
+    cstart[0] = start[0] + n * stride[0];
+    status = nc_get_vara_numeric(ncid, varid, type, cstart, slab, buf);
+    if ( status != NC_NOERR ) {
+      break;
+    }
+    slab[0] = m;
+    memcpy(slab + 1, count + 1, (ndims - 1) * sizeof(size_t));
+    nc_copy_strided(ndims, slab, elsize, buf, sstep, 
+                    (char *) value + n * dstep[0], dstep);
   }
 
+  free(buf);
+
+  return status;
+
+ native:
+  return nc_get_vars_numeric(ncid, varid, type, start, count, stride, value);
 }
 
-static VALUE
-rb_nc_put_var1 (int argc, VALUE *argv, VALUE mod)
+/* ------------------------------------------------------------------------
+ *  blocking reads
+ *
+ *  The bulk transfer of the get paths runs without GVL, so that other 
+ *  threads, and the fibers of a Fiber scheduler waiting on a worker thread
+ *  (NC.nc_nonblocking), proceed while libnetcdf waits for the disk. This 
+ *  is done only when the calls are serialized by the library lock, since 
+ *  otherwise another thread could enter libnetcdf in the meantime.
+ * ------------------------------------------------------------------------ */
+
+enum {
+  NC_READ_VAR,
+  NC_READ_VARA,
+  NC_READ_VARS,
+  NC_READ_VARM
+};
+
+typedef struct {
+  int              kind;
+  int              ncid;
+  int              varid;
+  nc_type          type;
+  int              ndims;
+  const size_t    *start;
+  const size_t    *count;
+  const ptrdiff_t *stride;
+  const ptrdiff_t *imap;
+  void            *value;
+  int              status;
+} nc_read_t;
+
+static void *
+nc_read_nogvl (void *arg)
 {
-  volatile VALUE data;
-  int status;
-  nc_type type;
-  size_t index[NC_MAX_DIMS];
-  int ndims;
-  CArray *ca;
-  int i;
+  nc_read_t *rd = (nc_read_t *) arg;
+
+  switch ( rd->kind ) {
+  case NC_READ_VAR:
+    rd->status = nc_get_var_numeric(rd->ncid, rd->varid, rd->type, 
+                                    rd->value);
+    break;
+  case NC_READ_VARA:
+    rd->status = nc_get_vara_numeric(rd->ncid, rd->varid, rd->type, 
+                                     rd->start, rd->count, rd->value);
+    break;
+  case NC_READ_VARS:
+    rd->status = nc_get_vars_fast(rd->ncid, rd->varid, rd->type, rd->ndims,
+                                  rd->start, rd->count, rd->stride, 
+                                  rd->value);
+    break;
+  case NC_READ_VARM:
+    rd->status = nc_get_varm_numeric(rd->ncid, rd->varid, rd->type, 
+                                     rd->start, rd->count, rd->stride, 
+                                     rd->imap, rd->value);
+    break;
+  default:
+    rd->status = NC_EINVAL;
+  }
 
-  CHECK_ARGC(4);
+  return NULL;
+}
 
-  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+static int
+nc_read_blocking (int kind, int ncid, int varid, nc_type type, int ndims,
+                  const size_t start[], const size_t count[], 
+                  const ptrdiff_t stride[], const ptrdiff_t imap[], 
+                  void *value)
+{
+  nc_read_t rd;
+
+  rd.kind   = kind;
+  rd.ncid   = ncid;
+  rd.varid  = varid;
+  rd.type   = type;
+  rd.ndims  = ndims;
+  rd.start  = start;
+  rd.count  = count;
+  rd.stride = stride;
+  rd.imap   = imap;
+  rd.value  = value;
+  rd.status = NC_NOERR;
+
+#if defined(NC_USE_LIB_LOCK) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+  rb_thread_call_without_gvl(nc_read_nogvl, &rd, NULL, NULL);
+#else
+  nc_read_nogvl(&rd);
+#endif
+
+  return rd.status;
+}
 
-  CHECK_STATUS(status);
+#define nc_get_var_blocking(ncid, varid, type, value) \
+  nc_read_blocking(NC_READ_VAR, ncid, varid, type, 0, \
+                   NULL, NULL, NULL, NULL, value)
+
+#define nc_get_vara_blocking(ncid, varid, type, start, count, value) \
+  nc_read_blocking(NC_READ_VARA, ncid, varid, type, 0, \
+                   start, count, NULL, NULL, value)
+
+#define nc_get_vars_blocking(ncid, varid, type, ndims, start, count, stride, value) \
+  nc_read_blocking(NC_READ_VARS, ncid, varid, type, ndims, \
+                   start, count, stride, NULL, value)
+
+#define nc_get_varm_blocking(ncid, varid, type, start, count, stride, imap, value) \
+  nc_read_blocking(NC_READ_VARM, ncid, varid, type, 0, \
+                   start, count, stride, imap, value)
+
+/* ------------------------------------------------------------------------
+ *  masked writes
+ *
+ *  A CArray with mask is written through a staging buffer of at most 
+ *  NC_STAGE_MAX bytes which is reused slab by slab along the first 
+ *  dimension. Masked elements are replaced while copying by the _FillValue
+ *  of the variable, or the default fill value of its type.
+ * ------------------------------------------------------------------------ */
+
+#ifndef NC_STAGE_MAX
+#define NC_STAGE_MAX    (4*1024*1024)
+#endif
+
+static double
+nc_default_fill (nc_type type)
+{
+  switch (type) {
+  case NC_BYTE:
+    return NC_FILL_BYTE;
+  case NC_CHAR:
+    return NC_FILL_CHAR;
+  case NC_SHORT:
+    return NC_FILL_SHORT;
+  case NC_INT:
+    return NC_FILL_INT;
+  case NC_FLOAT:
+    return NC_FILL_FLOAT;
+  case NC_DOUBLE:
+  default:
+    return NC_FILL_DOUBLE;
+  }
+}
 
-  Check_Type(argv[2], T_ARRAY);
+/* Numeric stored as the classic type 'type' (converted as by CArray) */
 
-  for (i=0; i<ndims; i++) {
-    index[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+static int
+nc_scalar_value (VALUE num, nc_type type, void *dst)
+{
+  switch (type) {
+  case NC_BYTE:
+  case NC_CHAR:
+    *(int8_t *) dst = (int8_t) NUM2LONG(num);
+    break;
+  case NC_SHORT:
+    *(int16_t *) dst = (int16_t) NUM2LONG(num);
+    break;
+  case NC_INT:
+    *(int32_t *) dst = (int32_t) NUM2LONG(num);
+    break;
+  case NC_FLOAT:
+    *(float32_t *) dst = (float32_t) NUM2DBL(num);
+    break;
+  case NC_DOUBLE:
+    *(float64_t *) dst = NUM2DBL(num);
+    break;
+  default:
+    return NC_EBADTYPE;
   }
+  return NC_NOERR;
+}
 
-  data = argv[3];
+/* fill value of the variable stored as the memory type 'type' */
 
-  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-    rb_raise(rb_eTypeError, "arg4 must be a CArray object");
+static int
+nc_fill_value (int ncid, int varid, nc_type type, void *fill)
+{
+  nc_type vartype;
+  size_t len;
+  double val;
+  int status;
+
+  status = nc_inq_attlen(ncid, varid, "_FillValue", &len);
+  if ( status == NC_NOERR && len == 1 ) {
+    return nc_get_att_numeric(ncid, varid, "_FillValue", type, fill);
   }
 
-  Data_Get_Struct(data, CArray, ca);
+  status = nc_inq_vartype(ncid, varid, &vartype);
+  if ( status != NC_NOERR ) {
+    return status;
+  }
 
-  type = rb_nc_rtypemap(ca->data_type);
+  val = nc_default_fill(vartype);
 
-  ca_attach(ca);
-  status = nc_put_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			       type, index, ca->ptr);
-  ca_detach(ca);
+  switch (type) {
+  case NC_BYTE:
+  case NC_CHAR:
+    if ( val < -128 || val > 255 ) {
+      return NC_ERANGE;
+    }
+    *(int8_t *) fill = (int8_t) val;
+    break;
+  case NC_SHORT:
+    if ( val < INT16_MIN || val > INT16_MAX ) {
+      return NC_ERANGE;
+    }
+    *(int16_t *) fill = (int16_t) val;
+    break;
+  case NC_INT:
+    if ( val < INT32_MIN || val > INT32_MAX ) {
+      return NC_ERANGE;
+    }
+    *(int32_t *) fill = (int32_t) val;
+    break;
+  case NC_FLOAT:
+    *(float32_t *) fill = (float32_t) val;
+    break;
+  case NC_DOUBLE:
+    *(float64_t *) fill = val;
+    break;
+  default:
+    return NC_EBADTYPE;
+  }
 
-  CHECK_STATUS(status);
-  
-  return LONG2NUM(status);
+  return NC_NOERR;
 }
 
-static VALUE
-rb_nc_get_var (int argc, VALUE *argv, VALUE mod)
-{
-  int status;
-  int ndims;
-  int dimid[NC_MAX_DIMS];
-  nc_type type;
-
-  if ( argc < 2 ) {
-    rb_raise(rb_eArgError, "invalid # of arguments");
+/* 
+ *  Masked slabs are staged as double and written by nc_put_vara_double, 
+ *  so that the fill value of the variable (in its external type) needs 
+ *  not be representable in the memory type of the CArray.
+ */
+
+#define NC_STAGE_MASKED(T) \
+  { \
+    const T *s = (const T *) src; \
+    for (i=0; i<n; i++) { \
+      dst[i] = ( mask[i] ) ? fill : (double) s[i]; \
+    } \
   }
-  
-  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
 
-  CHECK_STATUS(status);
+static int
+nc_stage_masked (size_t n, int8_t data_type, const char *src, 
+                 const boolean8_t *mask, double fill, double *dst)
+{
+  size_t i;
 
-  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+  switch ( data_type ) {
+  case CA_INT8:
+    NC_STAGE_MASKED(int8_t);
+    break;
+  case CA_UINT8:
+    NC_STAGE_MASKED(uint8_t);
+    break;
+  case CA_INT16:
+    NC_STAGE_MASKED(int16_t);
+    break;
+  case CA_INT32:
+    NC_STAGE_MASKED(int32_t);
+    break;
+  case CA_FLOAT32:
+    NC_STAGE_MASKED(float32_t);
+    break;
+  case CA_FLOAT64:
+    NC_STAGE_MASKED(float64_t);
+    break;
+  default:
+    return NC_EBADTYPE;
+  }
 
-  CHECK_STATUS(status);
+  return NC_NOERR;
+}
 
-  status = nc_inq_vardimid(NUM2LONG(argv[0]), NUM2LONG(argv[1]), dimid);
+/*
+ *  Writes the attached CArray 'ca' with mask to the region (start, count
+ *  [, stride]) substituting the fill value for masked elements.
+ */
 
-  CHECK_STATUS(status);
+static int
+nc_put_masked (int ncid, int varid, int ndims,
+               const size_t start[], const size_t count[], 
+               const ptrdiff_t stride[], CArray *ca)
+{
+  size_t     cstart[NC_MAX_VAR_DIMS], ccount[NC_MAX_VAR_DIMS];
+  size_t     row = 1, total, rows, n, m, k;
+  boolean8_t *mask = (boolean8_t *) ca->mask->ptr;
+  nc_type    vartype;
+  double     fill;
+  double    *buf;
+  int        status;
+  int        i;
+
+  for (i=1; i<ndims; i++) {
+    row *= count[i];
+  }
+  total = ( ndims > 0 ) ? row * count[0] : 1;
+  if ( total != (size_t) ca->elements ) {
+    return NC_EINVAL;
+  }
 
-  if ( argc == 2 ) {
-    volatile VALUE out;
-    CArray *ca;
-    int8_t rank, data_type;
-    ca_size_t dim[CA_RANK_MAX];
-    size_t len;
-    int i;
+  status = nc_inq_vartype(ncid, varid, &vartype);
+  if ( status != NC_NOERR ) {
+    return status;
+  }
+  status = nc_fill_value(ncid, varid, NC_DOUBLE, &fill);
+  if ( status != NC_NOERR || total == 0 ) {
+    return status;
+  }
 
-    data_type = rb_nc_typemap (type);
-    rank = ndims;
-    for (i=0; i<rank; i++) {
-      status = nc_inq_dimlen(NUM2LONG(argv[0]), dimid[i], &len);
-      CHECK_STATUS(status);
-      dim[i] = len;
+  if ( ndims == 0 ) {
+    double val;
+    status = nc_stage_masked(1, ca->data_type, ca->ptr, mask, fill, &val);
+    if ( status == NC_NOERR ) {
+      status = nc_put_var_double(ncid, varid, &val);
     }
+    return status;
+  }
 
-    out = rb_carray_new(data_type, rank, dim, 0, NULL);
-    Data_Get_Struct(out, CArray, ca);
+  rows = NC_STAGE_MAX / (row * sizeof(double));
+  if ( rows < 1 ) {
+    rows = 1;
+  }
+  if ( rows > count[0] ) {
+    rows = count[0];
+  }
 
-    status = nc_get_var_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-				type, ca->ptr);
+  buf = malloc(rows * row * sizeof(double));
+  if ( ! buf ) {
+    return NC_ENOMEM;
+  }
 
-    CHECK_STATUS(status);
-  
-    return out;
+  for (i=0; i<ndims; i++) {
+    cstart[i] = start[i];
+    ccount[i] = count[i];
   }
-  else {
-    volatile VALUE data = argv[2];
-    CArray *ca;
 
-    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-      rb_raise(rb_eTypeError, "arg3 must be a CArray object");
+  for (n=0; n<count[0]; n+=rows) {
+    m = ( n + rows > count[0] ) ? count[0] - n : rows;
+    cstart[0] = start[0] + n * ( ( stride ) ? stride[0] : 1 );
+    ccount[0] = m;
+    status = nc_stage_masked(m * row, ca->data_type, 
+                             ca->ptr + n * row * ca->bytes, 
+                             mask + n * row, fill, buf);
+    if ( status != NC_NOERR ) {
+      break;
     }
+    /* uint8 data is written to NC_BYTE bitwise as the unmasked path */
+    if ( vartype == NC_BYTE && ca->data_type == CA_UINT8 ) {
+      for (k=0; k<m * row; k++) {
+        if ( buf[k] > 127 && ! mask[n * row + k] ) {
+          buf[k] -= 256;
+        }
+      }
+    }
+    if ( stride ) {
+      status = nc_put_vars_double(ncid, varid, cstart, ccount, stride, buf);
+    }
+    else {
+      status = nc_put_vara_double(ncid, varid, cstart, ccount, buf);
+    }
+    if ( status != NC_NOERR ) {
+      break;
+    }
+  }
 
-    Data_Get_Struct(data, CArray, ca);
+  free(buf);
 
-    type = rb_nc_rtypemap(ca->data_type);
+  return status;
+}
 
-    ca_attach(ca);
-    status = nc_get_var_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-				type, ca->ptr);
-    ca_sync(ca);
-    ca_detach(ca);
+/* ------------------------------------------------------------------------
+ *  masked reads
+ *
+ *  With opts[:fill] (a value or an Array of fill/missing values), the get
+ *  paths set the mask of the result for the elements equal to one of them.
+ *  The region is read in slabs of at most NC_STAGE_MAX bytes along the 
+ *  first dimension and each slab is scanned right after it is read, while
+ *  still in cache, instead of comparing the whole result in a second pass.
+ *  The mask is created only when a fill value is found. At most 
+ *  NC_MASK_FILL_MAX values are accepted (more raise, see NCVar#decode).
+ * ------------------------------------------------------------------------ */
+
+#define NC_MASK_FILL_MAX    8
+
+typedef struct {
+  int    n;
+  double value[NC_MASK_FILL_MAX];
+} nc_fills_t;
+
+static void
+nc_scan_fills (VALUE opts, nc_fills_t *fills)
+{
+  volatile VALUE val;
+  int i;
 
-    CHECK_STATUS(status);
-  
-    return LONG2NUM(status);
+  fills->n = 0;
+
+  if ( NIL_P(opts) ) {
+    return;
   }
-}
 
-static VALUE
-rb_nc_put_var (int argc, VALUE *argv, VALUE mod)
-{
-  volatile VALUE data;
-  int status;
-  nc_type type;
-  CArray *ca;
+  Check_Type(opts, T_HASH);
+  val = rb_hash_aref(opts, ID2SYM(rb_intern("fill")));
+  if ( NIL_P(val) ) {
+    return;
+  }
+  if ( TYPE(val) != T_ARRAY ) {
+    val = rb_ary_new3(1, val);
+  }
+  for (i=0; i<RARRAY_LEN(val); i++) {
+    if ( ! NIL_P(RARRAY_PTR(val)[i]) ) {
+      if ( fills->n >= NC_MASK_FILL_MAX ) {
+        rb_raise(rb_eArgError, "too many fill values (max %i)", 
+                 NC_MASK_FILL_MAX);
+      }
+      fills->value[fills->n++] = NUM2DBL(RARRAY_PTR(val)[i]);
+    }
+  }
+}
+
+#define NC_MASK_SCAN(T) \
+  { \
+    const T *p = (const T *) ca->ptr + offset; \
+    for (i=0; i<n; i++) { \
+      x = (double) p[i]; \
+      for (f=0; f<fills->n; f++) { \
+        if ( x == fills->value[f] ) { \
+          if ( ! mask ) { \
+            ca_create_mask(ca); \
+            mask = (boolean8_t *) ca->mask->ptr; \
+          } \
+          mask[offset+i] = 1; \
+          break; \
+        } \
+      } \
+    } \
+  }
+
+/* masks the elements [offset, offset+n) of ca equal to one of fills */
+
+static void
+nc_mask_fills (CArray *ca, size_t offset, size_t n, const nc_fills_t *fills)
+{
+  boolean8_t *mask = NULL;
+  double x;
+  size_t i;
+  int f;
+
+  if ( fills->n == 0 ) {
+    return;
+  }
+
+  if ( ca_has_mask(ca) ) {
+    mask = (boolean8_t *) ca->mask->ptr;
+  }
+
+  switch ( ca->data_type ) {
+  case CA_INT8:
+    NC_MASK_SCAN(int8_t);
+    break;
+  case CA_UINT8:
+    NC_MASK_SCAN(uint8_t);
+    break;
+  case CA_INT16:
+    NC_MASK_SCAN(int16_t);
+    break;
+  case CA_INT32:
+    NC_MASK_SCAN(int32_t);
+    break;
+  case CA_FLOAT32:
+    NC_MASK_SCAN(float32_t);
+    break;
+  case CA_FLOAT64:
+    NC_MASK_SCAN(float64_t);
+    break;
+  }
+}
+
+/*
+ *  Reads the region (start, count[, stride]) into the new CArray 'ca' 
+ *  slab by slab and masks each slab for fills.
+ */
+
+static int
+nc_get_masked (int ncid, int varid, nc_type type, int ndims,
+               const size_t start[], const size_t count[], 
+               const ptrdiff_t stride[], CArray *ca, const nc_fills_t *fills)
+{
+  size_t cstart[NC_MAX_VAR_DIMS], ccount[NC_MAX_VAR_DIMS];
+  size_t elsize = ca->bytes;
+  size_t row = 1, rows, n, m;
+  int    status = NC_NOERR;
+  int    i;
+
+  if ( ndims == 0 ) {
+    status = nc_get_var_blocking(ncid, varid, type, ca->ptr);
+    if ( status == NC_NOERR ) {
+      nc_mask_fills(ca, 0, 1, fills);
+    }
+    return status;
+  }
+
+  for (i=1; i<ndims; i++) {
+    row *= count[i];
+  }
+  if ( row == 0 || count[0] == 0 ) {
+    return NC_NOERR;
+  }
+
+  rows = NC_STAGE_MAX / (row * elsize);
+  if ( rows < 1 ) {
+    rows = 1;
+  }
+  if ( rows > count[0] ) {
+    rows = count[0];
+  }
+
+  for (i=0; i<ndims; i++) {
+    cstart[i] = start[i];
+    ccount[i] = count[i];
+  }
+
+  for (n=0; n<count[0]; n+=rows) {
+    m = ( n + rows > count[0] ) ? count[0] - n : rows;
+    cstart[0] = start[0] + n * ( ( stride ) ? stride[0] : 1 );
+    ccount[0] = m;
+    if ( stride ) {
+      status = nc_get_vars_blocking(ncid, varid, type, ndims, cstart, ccount, 
+                                    stride, ca->ptr + n * row * elsize);
+    }
+    else {
+      status = nc_get_vara_blocking(ncid, varid, type, cstart, ccount, 
+                                    ca->ptr + n * row * elsize);
+    }
+    if ( status != NC_NOERR ) {
+      break;
+    }
+    nc_mask_fills(ca, n * row, m * row, fills);
+  }
+
+  return status;
+}
+
+/* ------------------------------------------------------------------------
+ *  scatter writes
+ *
+ *  nc_put_scatter(fd, varid, addr, value) writes the values to the 
+ *  elements at the row-major addresses addr (int64 CArray), or to the grid
+ *  given by addr as an Array of per-dimension index lists (int64 CArrays,
+ *  negative from the end), which is expanded here. The addresses are sorted (the last value wins for duplicates) and merged into runs 
+ *  along the last dimension. Runs are grouped into windows of consecutive
+ *  rows within a plane of the last two dimensions (at most 
+ *  NC_SCATTER_BUDGET bytes). A window is written by read-modify-write of 
+ *  its covering block when that moves less data than writing its runs one
+ *  by one (a call counts as NC_SCATTER_CALL_COST elements), otherwise run
+ *  by run. The transfer is done in double, which holds every classic type
+ *  exactly, so the untouched elements of a block are written back as read.
+ * ------------------------------------------------------------------------ */
+
+#define NC_SCATTER_BUDGET      (16*1024*1024)
+#define NC_SCATTER_CALL_COST   4096
+
+typedef struct {
+  int64_t addr;
+  size_t  idx;
+} nc_scatter_pt_t;
+
+static int
+nc_scatter_cmp (const void *a, const void *b)
+{
+  const nc_scatter_pt_t *p = (const nc_scatter_pt_t *) a;
+  const nc_scatter_pt_t *q = (const nc_scatter_pt_t *) b;
+  if ( p->addr != q->addr ) {
+    return ( p->addr < q->addr ) ? -1 : 1;
+  }
+  return ( p->idx < q->idx ) ? -1 : ( p->idx > q->idx );
+}
+
+static void
+nc_scatter_index (int ndims, const size_t dim[], int64_t addr, 
+                  size_t start[], size_t count[])
+{
+  int i;
+  for (i=ndims-1; i>=0; i--) {
+    start[i] = addr % dim[i];
+    count[i] = 1;
+    addr /= dim[i];
+  }
+}
+
+/*
+ *  Expands the grid of per-dimension index lists into the row-major 
+ *  addresses of its elements (row-major over the grid) => [pts, n]
+ */
+
+static VALUE
+nc_scatter_grid (VALUE vlists, int ndims, const size_t dim[], size_t *np)
+{
+  volatile VALUE vpts, vidx;
+  nc_scatter_pt_t *pts;
+  CArray  *cl;
+  int64_t *idx[NC_MAX_DIMS], *p, v, a;
+  size_t   len[NC_MAX_DIMS], pos[NC_MAX_DIMS], n = 1, sum = 0, i;
+  int      d;
+
+  if ( RARRAY_LEN(vlists) != ndims ) {
+    rb_raise(rb_eRuntimeError, "grid needs %i index lists", ndims);
+  }
+  for (d=0; d<ndims; d++) {
+    VALUE vl = RARRAY_PTR(vlists)[d];
+    if ( ! rb_obj_is_kind_of(vl, rb_cCArray) ) {
+      rb_raise(rb_eTypeError, "grid index list must be a CArray object");
+    }
+    Data_Get_Struct(vl, CArray, cl);
+    if ( cl->data_type != CA_INT64 ) {
+      rb_raise(rb_eRuntimeError, "grid index list must be int64 CArray");
+    }
+    len[d] = cl->elements;
+    n     *= len[d];
+    sum   += len[d];
+  }
+
+  /* normalized copies of the lists */
+
+  vidx = rb_str_new(NULL, ( sum + 1 ) * sizeof(int64_t));
+  p    = (int64_t *) RSTRING_PTR(vidx);
+  for (d=0; d<ndims; d++) {
+    Data_Get_Struct(RARRAY_PTR(vlists)[d], CArray, cl);
+    idx[d] = p;
+    ca_attach(cl);
+    for (i=0; i<len[d]; i++) {
+      v = ((int64_t *) cl->ptr)[i];
+      if ( v < 0 ) {
+        v += dim[d];
+      }
+      if ( v < 0 || v >= (int64_t) dim[d] ) {
+        ca_detach(cl);
+        rb_raise(rb_eIndexError, "index out of range (%lld for dim[%i] = %zu)", 
+                 (long long) ((int64_t *) cl->ptr)[i], d, dim[d]);
+      }
+      *p++ = v;
+    }
+    ca_detach(cl);
+    pos[d] = 0;
+  }
+
+  vpts = rb_str_new(NULL, ( n + 1 ) * sizeof(nc_scatter_pt_t));
+  pts  = (nc_scatter_pt_t *) RSTRING_PTR(vpts);
+  for (i=0; i<n; i++) {
+    a = 0;
+    for (d=0; d<ndims; d++) {
+      a = a * dim[d] + idx[d][pos[d]];
+    }
+    pts[i].addr = a;
+    pts[i].idx  = i;
+    for (d=ndims-1; d>=0; d--) {
+      if ( ++pos[d] < len[d] ) {
+        break;
+      }
+      pos[d] = 0;
+    }
+  }
+
+  *np = n;
+  return vpts;
+}
+
+#define NC_SCATTER_LOAD(T) \
+  { \
+    const T *p = (const T *) cv->ptr; \
+    for (i=0; i<n; i++) { \
+      vals[i] = (double) p[i]; \
+    } \
+  }
+
+static VALUE
+rb_nc_put_scatter (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE vpts, vvals, vbuf;
+  nc_scatter_pt_t *pts;
+  CArray  *ca, *cv;
+  int      ncid, varid, ndims, dimid[NC_MAX_DIMS];
+  size_t   dim[NC_MAX_DIMS], start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+  size_t   n, m, i, j, k, total = 1, L, R, wrows, nruns;
+  int64_t  row0, row;
+  double  *vals, *buf;
+  int      status = NC_NOERR;
+  int      d;
+
+  CHECK_ARGC(4);
+  CHECK_TYPE_ID(argv[0]);
+  CHECK_TYPE_ID(argv[1]);
+
+  ncid  = NUM2INT(argv[0]);
+  varid = NUM2INT(argv[1]);
+
+  status = nc_inq_varndims(ncid, varid, &ndims);
+  CHECK_STATUS(status);
+  status = nc_inq_vardimid(ncid, varid, dimid);
+  CHECK_STATUS(status);
+  for (d=0; d<ndims; d++) {
+    status = nc_inq_dimlen(ncid, dimid[d], &dim[d]);
+    CHECK_STATUS(status);
+    total *= dim[d];
+  }
+  if ( ndims == 0 ) {
+    rb_raise(rb_eRuntimeError, "scatter write to scalar variable");
+  }
+
+  if ( TYPE(argv[2]) == T_ARRAY ) {
+    vpts = nc_scatter_grid(argv[2], ndims, dim, &n);
+    pts  = (nc_scatter_pt_t *) RSTRING_PTR(vpts);
+  }
+  else {
+    if ( ! rb_obj_is_kind_of(argv[2], rb_cCArray) ) {
+      rb_raise(rb_eTypeError, "arg3 must be a CArray object");
+    }
+    Data_Get_Struct(argv[2], CArray, ca);
+    if ( ca->data_type != CA_INT64 ) {
+      rb_raise(rb_eRuntimeError, "addresses must be int64 CArray");
+    }
+
+    n    = ca->elements;
+    vpts = rb_str_new(NULL, ( n + 1 ) * sizeof(nc_scatter_pt_t));
+    pts  = (nc_scatter_pt_t *) RSTRING_PTR(vpts);
+
+    ca_attach(ca);
+    for (i=0; i<n; i++) {
+      pts[i].addr = ((int64_t *) ca->ptr)[i];
+      pts[i].idx  = i;
+      if ( pts[i].addr < 0 || pts[i].addr >= (int64_t) total ) {
+        ca_detach(ca);
+        rb_raise(rb_eIndexError, "address out of range (%lld)", 
+                 (long long) pts[i].addr);
+      }
+    }
+    ca_detach(ca);
+  }
+
+  if ( n == 0 ) {
+    return LONG2NUM(NC_NOERR);
+  }
+
+  vvals = rb_str_new(NULL, n * sizeof(double));
+  vals  = (double *) RSTRING_PTR(vvals);
+
+  /* values as double, masked elements are given the fill value */
+
+  if ( rb_obj_is_kind_of(argv[3], rb_cCArray) ) {
+    Data_Get_Struct(argv[3], CArray, cv);
+    if ( (size_t) cv->elements != n ) {
+      rb_raise(rb_eRuntimeError, "data size mismatch (%lld for %lld)", 
+               (long long) cv->elements, (long long) n);
+    }
+    ca_attach(cv);
+    switch ( cv->data_type ) {
+    case CA_INT8:    NC_SCATTER_LOAD(int8_t);    break;
+    case CA_UINT8:   NC_SCATTER_LOAD(uint8_t);   break;
+    case CA_INT16:   NC_SCATTER_LOAD(int16_t);   break;
+    case CA_UINT16:  NC_SCATTER_LOAD(uint16_t);  break;
+    case CA_INT32:   NC_SCATTER_LOAD(int32_t);   break;
+    case CA_UINT32:  NC_SCATTER_LOAD(uint32_t);  break;
+    case CA_INT64:   NC_SCATTER_LOAD(int64_t);   break;
+    case CA_FLOAT32: NC_SCATTER_LOAD(float32_t); break;
+    case CA_FLOAT64: NC_SCATTER_LOAD(float64_t); break;
+    default:
+      ca_detach(cv);
+      rb_raise(rb_eRuntimeError, "invalid data type for scatter write");
+    }
+    if ( ca_has_mask(cv) ) {
+      boolean8_t *mask = (boolean8_t *) cv->mask->ptr;
+      double fill;
+      status = nc_fill_value(ncid, varid, NC_DOUBLE, &fill);
+      for (i=0; i<n && status == NC_NOERR; i++) {
+        if ( mask[i] ) {
+          vals[i] = fill;
+        }
+      }
+    }
+    ca_detach(cv);
+    CHECK_STATUS(status);
+  }
+  else {
+    double val = NUM2DBL(argv[3]);
+    for (i=0; i<n; i++) {
+      vals[i] = val;
+    }
+  }
+
+  /* sort, keep the last of duplicates */
+
+  qsort(pts, n, sizeof(nc_scatter_pt_t), nc_scatter_cmp);
+
+  for (i=0, m=0; i<n; i++) {
+    if ( i + 1 < n && pts[i+1].addr == pts[i].addr ) {
+      continue;
+    }
+    pts[m++] = pts[i];
+  }
+
+  /* rows of the last dimension (each element is a row for 1-D) */
+
+  L = ( ndims >= 2 ) ? dim[ndims-1] : 1;
+  R = ( ndims >= 2 ) ? dim[ndims-2] : dim[0];
+
+  wrows = NC_SCATTER_BUDGET / (L * sizeof(double));
+  if ( wrows < 1 ) {
+    wrows = 1;
+  }
+
+  vbuf = rb_str_new(NULL, 0);
+
+#define NC_SCATTER_BREAK(a, b) \
+  ( (b) != (a) + 1 || ( ndims >= 2 && (b) / (int64_t) L != (a) / (int64_t) L ) )
+
+  for (i=0; i<m && status == NC_NOERR; i=j) {
+
+    row0  = pts[i].addr / L;
+    nruns = 1;
+    for (j=i+1; j<m; j++) {
+      row = pts[j].addr / L;
+      if ( row / R != row0 / R || (size_t) (row - row0) + 1 > wrows ) {
+        break;
+      }
+      if ( NC_SCATTER_BREAK(pts[j-1].addr, pts[j].addr) ) {
+        nruns++;
+      }
+    }
+
+    row = pts[j-1].addr / L;
+
+    if ( 2 * ((row - row0 + 1) * L + NC_SCATTER_CALL_COST) < 
+         nruns * NC_SCATTER_CALL_COST + (j - i) ) {
+      /* read-modify-write of the covering block */
+      size_t nrows = row - row0 + 1;
+      rb_str_resize(vbuf, nrows * L * sizeof(double));
+      buf = (double *) RSTRING_PTR(vbuf);
+      nc_scatter_index(ndims, dim, row0 * L, start, count);
+      if ( ndims >= 2 ) {
+        count[ndims-2] = nrows;
+        count[ndims-1] = L;
+      }
+      else {
+        count[0] = nrows;
+      }
+      status = nc_get_vara_double(ncid, varid, start, count, buf);
+      if ( status != NC_NOERR ) {
+        break;
+      }
+      for (k=i; k<j; k++) {
+        buf[pts[k].addr - row0 * L] = vals[pts[k].idx];
+      }
+      status = nc_put_vara_double(ncid, varid, start, count, buf);
+    }
+    else {
+      /* run by run */
+      size_t k0, len;
+      for (k0=i; k0<j && status == NC_NOERR; k0=k) {
+        for (k=k0+1; k<j && ! NC_SCATTER_BREAK(pts[k-1].addr, pts[k].addr); k++) {
+          ;
+        }
+        len = k - k0;
+        rb_str_resize(vbuf, len * sizeof(double));
+        buf = (double *) RSTRING_PTR(vbuf);
+        for (d=0; d<(int)len; d++) {
+          buf[d] = vals[pts[k0+d].idx];
+        }
+        nc_scatter_index(ndims, dim, pts[k0].addr, start, count);
+        count[ndims-1] = len;
+        status = nc_put_vara_double(ncid, varid, start, count, buf);
+      }
+    }
+  }
+
+#undef NC_SCATTER_BREAK
+
+  CHECK_STATUS(status);
+
+  return LONG2NUM(status);
+}
+
+/* ------------------------------------------------------------------------
+ *  constant and broadcast fill
+ *
+ *  nc_put_var_fill(fd, varid, value[, opts]) writes a Numeric, or a CArray
+ *  broadcast over the whole variable (aligned to the trailing dimensions, 
+ *  missing leading dimensions and dimensions of extent 1 are repeated). 
+ *  The variable is written in slabs of at most opts[:chunk] bytes from one
+ *  reused buffer, which is filled only once when the value does not vary
+ *  along the slab position. opts[:start], opts[:count] restrict the fill
+ *  to a hyperslab, and a nil value stands for the fill value of the
+ *  variable (_FillValue or the default of its type). A Numeric is 
+ *  converted to the type of the variable first (NC_CHAR takes its code).
+ * ------------------------------------------------------------------------ */
+
+#define NC_FILL_CHUNK    (64*1024*1024)
+
+static VALUE
+rb_nc_put_var_fill (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE opts = Qnil, vchunk, vstart = Qnil, vcount = Qnil, vbuf;
+  CArray   *cv = NULL;
+  int       ncid, varid, ndims, dimid[NC_MAX_DIMS];
+  size_t    dim[NC_MAX_DIMS], vdim[NC_MAX_DIMS], off[NC_MAX_DIMS];
+  size_t    start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+  ptrdiff_t vstep[NC_MAX_DIMS], sstep[NC_MAX_DIMS], dstep[NC_MAX_DIMS];
+  size_t    chunk = NC_FILL_CHUNK, elsize, inner, rows, nouter, o, q, r;
+  ptrdiff_t soff;
+  nc_type   type;
+  double    scalar;                   /* also holds the fill value */
+  const char *vptr;
+  char     *buf;
+  int       status = NC_NOERR, invariant = 1;
+  int       k, d;
+
+  if ( argc == 4 ) {
+    opts = argv[3];
+    argc--;
+  }
 
   CHECK_ARGC(3);
-  
-  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+  CHECK_TYPE_ID(argv[0]);
+  CHECK_TYPE_ID(argv[1]);
+
+  ncid  = NUM2INT(argv[0]);
+  varid = NUM2INT(argv[1]);
+
+  if ( ! NIL_P(opts) ) {
+    Check_Type(opts, T_HASH);
+    vchunk = rb_hash_aref(opts, ID2SYM(rb_intern("chunk")));
+    if ( ! NIL_P(vchunk) ) {
+      chunk = NUM2SIZET(vchunk);
+    }
+    vstart = rb_hash_aref(opts, ID2SYM(rb_intern("start")));
+    vcount = rb_hash_aref(opts, ID2SYM(rb_intern("count")));
+  }
 
+  status = nc_inq_varndims(ncid, varid, &ndims);
+  CHECK_STATUS(status);
+  status = nc_inq_vardimid(ncid, varid, dimid);
   CHECK_STATUS(status);
+  if ( ! NIL_P(vstart) || ! NIL_P(vcount) ) {
+    Check_Type(vstart, T_ARRAY);
+    Check_Type(vcount, T_ARRAY);
+    if ( RARRAY_LEN(vstart) != ndims || RARRAY_LEN(vcount) != ndims ) {
+      rb_raise(rb_eRuntimeError, "invalid length of start or count");
+    }
+  }
 
-  data = argv[2];
+  for (d=0; d<ndims; d++) {
+    if ( NIL_P(vstart) ) {
+      status = nc_inq_dimlen(ncid, dimid[d], &dim[d]);
+      CHECK_STATUS(status);
+      off[d] = 0;
+    }
+    else {
+      off[d] = NUM2SIZET(RARRAY_PTR(vstart)[d]);
+      dim[d] = NUM2SIZET(RARRAY_PTR(vcount)[d]);
+    }
+    if ( dim[d] == 0 ) {
+      return LONG2NUM(NC_NOERR);
+    }
+    vdim[d] = 1;
+  }
+
+  if ( rb_obj_is_kind_of(argv[2], rb_cCArray) ) {
+    Data_Get_Struct(argv[2], CArray, cv);
+    if ( cv->rank > ndims ) {
+      rb_raise(rb_eRuntimeError, "rank of value exceeds rank of variable");
+    }
+    for (d=0; d<cv->rank; d++) {
+      int e = ndims - cv->rank + d;
+      if ( cv->dim[d] != 1 && (size_t) cv->dim[d] != dim[e] ) {
+        rb_raise(rb_eRuntimeError, 
+                 "dim[%i] of value can not be broadcast to variable", d);
+      }
+      vdim[e] = cv->dim[d];
+    }
+    type   = rb_nc_rtypemap(cv->data_type);
+    elsize = cv->bytes;
+    if ( elsize == 1 ) {
+      nc_type vartype;
+      status = nc_inq_vartype(ncid, varid, &vartype);
+      CHECK_STATUS(status);
+      if ( vartype == NC_CHAR ) {
+        type = NC_CHAR;
+      }
+    }
+  }
+  else if ( NIL_P(argv[2]) ) {
+    status = nc_inq_vartype(ncid, varid, &type);
+    CHECK_STATUS(status);
+    if ( type == NC_CHAR ) {
+      status = nc_inq_attlen(ncid, varid, "_FillValue", &elsize);
+      if ( status == NC_NOERR && elsize == 1 ) {
+        status = nc_get_att_text(ncid, varid, "_FillValue", (char *) &scalar);
+      }
+      else {
+        *(char *) &scalar = NC_FILL_CHAR;
+        status = NC_NOERR;
+      }
+    }
+    else {
+      status = nc_fill_value(ncid, varid, type, &scalar);
+    }
+    CHECK_STATUS(status);
+    elsize = nc_type_size(type);
+  }
+  else {
+    status = nc_inq_vartype(ncid, varid, &type);
+    CHECK_STATUS(status);
+    status = nc_scalar_value(argv[2], type, &scalar);
+    CHECK_STATUS(status);
+    elsize = nc_type_size(type);
+  }
+
+  if ( ndims == 0 ) {
+    if ( cv ) {
+      ca_attach(cv);
+      vptr = cv->ptr;
+    }
+    else {
+      vptr = (const char *) &scalar;
+    }
+    if ( type == NC_CHAR ) {
+      status = nc_put_var_text(ncid, varid, vptr);
+    }
+    else {
+      status = nc_put_var_numeric(ncid, varid, type, (void *) vptr);
+    }
+    if ( cv ) {
+      ca_detach(cv);
+    }
+    CHECK_STATUS(status);
+    return LONG2NUM(status);
+  }
+
+  /* steps in value (0 along broadcast dimensions) */
+
+  vstep[ndims-1] = elsize;
+  for (d=ndims-2; d>=0; d--) {
+    vstep[d] = vstep[d+1] * vdim[d+1];
+  }
+  for (d=0; d<ndims; d++) {
+    sstep[d] = ( vdim[d] == 1 ) ? 0 : vstep[d];
+  }
+
+  /* split dimension k : the dimensions after k fit in a chunk */
+
+  inner = elsize;
+  for (k=ndims-1; k>0 && inner * dim[k] <= chunk; k--) {
+    inner *= dim[k];
+  }
+  rows = chunk / inner;
+  if ( rows < 1 ) {
+    rows = 1;
+  }
+  if ( rows > dim[k] ) {
+    rows = dim[k];
+  }
+
+  for (d=0; d<=k; d++) {
+    if ( vdim[d] != 1 ) {
+      invariant = 0;
+    }
+  }
+
+  for (d=0; d<ndims; d++) {
+    start[d] = 0;
+    count[d] = ( d < k ) ? 1 : ( d == k ) ? rows : dim[d];
+  }
+  dstep[ndims-1] = elsize;
+  for (d=ndims-2; d>=0; d--) {
+    dstep[d] = dstep[d+1] * count[d+1];
+  }
+
+  vbuf = rb_str_new(NULL, rows * inner);
+  buf  = RSTRING_PTR(vbuf);
+
+  if ( cv ) {
+    ca_attach(cv);
+    vptr = cv->ptr;
+  }
+  else {
+    vptr = (const char *) &scalar;
+  }
+
+  if ( invariant ) {
+    nc_copy_strided(ndims, count, elsize, vptr, sstep, buf, dstep);
+  }
+
+  nouter = 1;
+  for (d=0; d<k; d++) {
+    nouter *= dim[d];
+  }
+
+  for (o=0; o<nouter && status == NC_NOERR; o++) {
+    q = o;
+    for (d=k-1; d>=0; d--) {
+      start[d] = q % dim[d];
+      q /= dim[d];
+    }
+    for (r=0; r<dim[k] && status == NC_NOERR; r+=rows) {
+      start[k] = r;
+      count[k] = ( r + rows > dim[k] ) ? dim[k] - r : rows;
+      if ( ! invariant ) {
+        soff = 0;
+        for (d=0; d<=k; d++) {
+          soff += start[d] * sstep[d];
+        }
+        nc_copy_strided(ndims, count, elsize, vptr + soff, sstep, buf, dstep);
+      }
+      for (d=0; d<ndims; d++) {
+        start[d] += off[d];
+      }
+      if ( type == NC_CHAR ) {
+        status = nc_put_vara_text(ncid, varid, start, count, buf);
+      }
+      else {
+        status = nc_put_vara_numeric(ncid, varid, type, start, count, buf);
+      }
+      for (d=0; d<ndims; d++) {
+        start[d] -= off[d];
+      }
+    }
+  }
+
+  if ( cv ) {
+    ca_detach(cv);
+  }
+
+  CHECK_STATUS(status);
+
+  return LONG2NUM(status);
+}
+
+/* ------------------------------------------------------------------------
+ *  permuted copy (transpose)
+ *
+ *  Copies a block stored in file order into an output whose dimensions 
+ *  are permuted by order[] (out.dim[i] = count[order[i]]). When the 
+ *  innermost dimension moves, the two dimensions involved are copied in 
+ *  cache-sized tiles (and with SSE 4x4 kernels for 4-byte elements).
+ * ------------------------------------------------------------------------ */
+
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#endif
+
+#define NC_TRANSPOSE_TILE 32
+
+#define NC_TRANSPOSE_TILE_LOOP(T) \
+  for (r=r0; r<r1; r++) { \
+    const T *s = (const T *) (src + r * srow); \
+    for (c=c0; c<c1; c++) { \
+      *(T *) (dst + c * dcol + r * sizeof(T)) = s[c]; \
+    } \
+  }
+
+/* src(r, c) at src + r*srow + c*elsize  ->  dst(r, c) at dst + c*dcol + r*elsize */
+
+static void
+nc_transpose_2d (size_t rows, size_t cols, size_t elsize,
+                 const char *src, ptrdiff_t srow, char *dst, ptrdiff_t dcol)
+{
+  size_t r0, c0, r1, c1, r, c;
+
+  for (r0=0; r0<rows; r0+=NC_TRANSPOSE_TILE) {
+    r1 = ( r0 + NC_TRANSPOSE_TILE < rows ) ? r0 + NC_TRANSPOSE_TILE : rows;
+    for (c0=0; c0<cols; c0+=NC_TRANSPOSE_TILE) {
+      c1 = ( c0 + NC_TRANSPOSE_TILE < cols ) ? c0 + NC_TRANSPOSE_TILE : cols;
+      switch ( elsize ) {
+      case 1:
+        NC_TRANSPOSE_TILE_LOOP(uint8_t);
+        break;
+      case 2:
+        NC_TRANSPOSE_TILE_LOOP(uint16_t);
+        break;
+      case 4:
+#ifdef __SSE2__
+        if ( r1 - r0 == NC_TRANSPOSE_TILE && c1 - c0 == NC_TRANSPOSE_TILE ) {
+          for (r=r0; r<r1; r+=4) {
+            for (c=c0; c<c1; c+=4) {
+              __m128 a0 = _mm_loadu_ps((const float *)(src + (r+0)*srow) + c);
+              __m128 a1 = _mm_loadu_ps((const float *)(src + (r+1)*srow) + c);
+              __m128 a2 = _mm_loadu_ps((const float *)(src + (r+2)*srow) + c);
+              __m128 a3 = _mm_loadu_ps((const float *)(src + (r+3)*srow) + c);
+              _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+              _mm_storeu_ps((float *)(dst + (c+0)*dcol) + r, a0);
+              _mm_storeu_ps((float *)(dst + (c+1)*dcol) + r, a1);
+              _mm_storeu_ps((float *)(dst + (c+2)*dcol) + r, a2);
+              _mm_storeu_ps((float *)(dst + (c+3)*dcol) + r, a3);
+            }
+          }
+          break;
+        }
+#endif
+        NC_TRANSPOSE_TILE_LOOP(uint32_t);
+        break;
+      case 8:
+        NC_TRANSPOSE_TILE_LOOP(uint64_t);
+        break;
+      default:
+        for (r=r0; r<r1; r++) {
+          for (c=c0; c<c1; c++) {
+            memcpy(dst + c * dcol + r * elsize, src + r * srow + c * elsize, 
+                   elsize);
+          }
+        }
+      }
+    }
+  }
+}
+
+static void
+nc_copy_permuted (int ndims, const size_t count[], const int order[], 
+                  size_t elsize, const char *src, char *dst)
+{
+  ptrdiff_t sstep[CA_RANK_MAX], dstep[CA_RANK_MAX];
+  size_t    idx[CA_RANK_MAX];
+  ptrdiff_t step;
+  ptrdiff_t soff = 0, doff = 0;
+  int       last = ndims - 1;
+  int       p, i;
+
+  step = elsize;
+  for (i=last; i>=0; i--) {
+    sstep[i] = step;
+    step *= count[i];
+  }
+  step = elsize;
+  for (i=last; i>=0; i--) {
+    dstep[order[i]] = step;
+    step *= count[order[i]];
+  }
+
+  /* innermost dimension does not move */
+  if ( order[last] == last ) {
+    nc_copy_strided(ndims, count, elsize, src, sstep, dst, dstep);
+    return;
+  }
+
+  for (i=0; i<ndims; i++) {
+    if ( count[i] == 0 ) {
+      return;
+    }
+    idx[i] = 0;
+  }
+
+  /* tile over src dim p (innermost in dst) and src dim last */
+  p = order[last];
+
+  while ( 1 ) {
+    nc_transpose_2d(count[p], count[last], elsize, 
+                    src + soff, sstep[p], dst + doff, dstep[last]);
+    for (i=last-1; i>=0; i--) {
+      if ( i == p ) {
+        continue;
+      }
+      idx[i]++;
+      soff += sstep[i];
+      doff += dstep[i];
+      if ( idx[i] < count[i] ) {
+        break;
+      }
+      soff -= sstep[i] * count[i];
+      doff -= dstep[i] * count[i];
+      idx[i] = 0;
+    }
+    if ( i < 0 ) {
+      break;
+    }
+  }
+}
+
+static int
+nc_scan_order (VALUE vorder, int ndims, int order[])
+{
+  int seen[CA_RANK_MAX];
+  int identity = 1;
+  int i;
+
+  Check_Type(vorder, T_ARRAY);
+
+  if ( RARRAY_LEN(vorder) != ndims ) {
+    rb_raise(rb_eArgError, "order must be a permutation of %i dimensions", 
+             ndims);
+  }
+
+  for (i=0; i<ndims; i++) {
+    seen[i] = 0;
+  }
+  for (i=0; i<ndims; i++) {
+    long k = NUM2LONG(RARRAY_PTR(vorder)[i]);
+    if ( k < 0 ) {
+      k += ndims;
+    }
+    if ( k < 0 || k >= ndims || seen[k] ) {
+      rb_raise(rb_eArgError, "order must be a permutation of %i dimensions", 
+               ndims);
+    }
+    seen[k]  = 1;
+    order[i] = k;
+    if ( k != i ) {
+      identity = 0;
+    }
+  }
+
+  return ! identity;
+}
+
+static VALUE
+nc_get_var1_value (int ncid, int varid, nc_type type, size_t index[])
+{
+  int status;
+
+  switch ( type ) {
+  case NC_BYTE: {
+    uint8_t val;
+    status = nc_get_var1_numeric(ncid, varid, type, index, &val);
+    CHECK_STATUS(status);
+    return INT2NUM(val);
+  }
+  case NC_SHORT: {
+    int16_t val;
+    status = nc_get_var1_numeric(ncid, varid, type, index, &val);
+    CHECK_STATUS(status);
+    return INT2NUM(val);
+  }
+  case NC_INT: {
+    int32_t val;
+    status = nc_get_var1_numeric(ncid, varid, type, index, &val);
+    CHECK_STATUS(status);
+    return INT2NUM(val);
+  }
+  case NC_FLOAT: {
+    float32_t val;
+    status = nc_get_var1_numeric(ncid, varid, type, index, &val);
+    CHECK_STATUS(status);
+    return rb_float_new(val);
+  }
+  case NC_DOUBLE: {
+    float64_t val;
+    status = nc_get_var1_numeric(ncid, varid, type, index, &val);
+    CHECK_STATUS(status);
+    return rb_float_new(val);
+  }
+  default: 
+    rb_raise(rb_eRuntimeError, "unknown att nc_type");
+  }
+}
+
+static VALUE
+rb_nc_get_var1 (int argc, VALUE *argv, VALUE mod)
+{
+  int status;
+  nc_type type;
+  int ndims;
+  size_t index[NC_MAX_DIMS];
+  int i;
+
+  if ( argc < 3 ) {
+    rb_raise(rb_eArgError, "invalid # of arguments");
+  }
+
+  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+
+  CHECK_STATUS(status);
+
+  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+
+  CHECK_STATUS(status);
+
+  Check_Type(argv[2], T_ARRAY);
+  for (i=0; i<ndims; i++) {
+    index[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+  }
+
+  if ( argc == 3 ) {
+    return nc_get_var1_value(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                             type, index);
+  }
+  else {
+    volatile VALUE data = argv[3];
+    CArray *ca;
+
+    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+      rb_raise(rb_eTypeError, "arg4 must be a CArray object");
+    }
+
+    Data_Get_Struct(data, CArray, ca);
+
+    type = rb_nc_rtypemap(ca->data_type);
+
+    ca_attach(ca);
+    status = nc_get_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			       type, index, ca->ptr);
+
+    ca_sync(ca);
+    ca_detach(ca);
+
+    CHECK_STATUS(status);
+
+    return LONG2NUM(status);
+  }
+
+}
+
+static VALUE
+rb_nc_put_var1 (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE data;
+  int status;
+  nc_type type;
+  size_t index[NC_MAX_DIMS];
+  int ndims;
+  CArray *ca;
+  int i;
+
+  CHECK_ARGC(4);
+
+  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+
+  CHECK_STATUS(status);
+
+  Check_Type(argv[2], T_ARRAY);
+
+  for (i=0; i<ndims; i++) {
+    index[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+  }
+
+  data = argv[3];
+
+  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+    rb_raise(rb_eTypeError, "arg4 must be a CArray object");
+  }
+
+  Data_Get_Struct(data, CArray, ca);
+
+  type = rb_nc_rtypemap(ca->data_type);
+
+  ca_attach(ca);
+  status = nc_put_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			       type, index, ca->ptr);
+  ca_detach(ca);
+
+  CHECK_STATUS(status);
+  
+  return LONG2NUM(status);
+}
+
+static VALUE
+rb_nc_get_var (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE opts = Qnil;
+  nc_fills_t fills;
+  int status;
+  int ndims;
+  int dimid[NC_MAX_DIMS];
+  nc_type type;
+
+  if ( argc > 2 && TYPE(argv[argc-1]) == T_HASH ) {
+    opts = argv[--argc];
+  }
+
+  if ( argc < 2 ) {
+    rb_raise(rb_eArgError, "invalid # of arguments");
+  }
+
+  nc_scan_fills(opts, &fills);
+  
+  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+
+  CHECK_STATUS(status);
+
+  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+
+  CHECK_STATUS(status);
+
+  status = nc_inq_vardimid(NUM2LONG(argv[0]), NUM2LONG(argv[1]), dimid);
+
+  CHECK_STATUS(status);
+
+  if ( argc == 2 ) {
+    volatile VALUE out;
+    CArray *ca;
+    int8_t rank, data_type;
+    ca_size_t dim[CA_RANK_MAX];
+    size_t len;
+    int i;
+
+    data_type = rb_nc_typemap (type);
+    rank = ndims;
+    for (i=0; i<rank; i++) {
+      status = nc_inq_dimlen(NUM2LONG(argv[0]), dimid[i], &len);
+      CHECK_STATUS(status);
+      dim[i] = len;
+    }
+
+    out = rb_carray_new(data_type, rank, dim, 0, NULL);
+    Data_Get_Struct(out, CArray, ca);
+
+    if ( fills.n > 0 ) {
+      size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+      for (i=0; i<rank; i++) {
+        start[i] = 0;
+        count[i] = dim[i];
+      }
+      status = nc_get_masked(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                             type, ndims, start, count, NULL, ca, &fills);
+    }
+    else {
+      status = nc_get_var_blocking(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+				   type, ca->ptr);
+    }
+
+    CHECK_STATUS(status);
+  
+    return out;
+  }
+  else {
+    volatile VALUE data = argv[2];
+    CArray *ca;
+
+    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+      rb_raise(rb_eTypeError, "arg3 must be a CArray object");
+    }
+
+    Data_Get_Struct(data, CArray, ca);
+
+    type = rb_nc_rtypemap(ca->data_type);
+
+    ca_attach(ca);
+    status = nc_get_var_blocking(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+				type, ca->ptr);
+    ca_sync(ca);
+    ca_detach(ca);
+
+    CHECK_STATUS(status);
+  
+    return LONG2NUM(status);
+  }
+}
+
+static VALUE
+rb_nc_put_var (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE data;
+  int status;
+  nc_type type;
+  CArray *ca;
+
+  CHECK_ARGC(3);
+  
+  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+
+  CHECK_STATUS(status);
+
+  data = argv[2];
+
+  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+    rb_raise(rb_eTypeError, "arg3 must be a CArray object");
+  }
+
+  Data_Get_Struct(data, CArray, ca);
+
+  type = rb_nc_rtypemap(ca->data_type);
+
+  if ( ca_has_mask(ca) ) {
+    int ndims, dimid[NC_MAX_DIMS], i;
+    size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+    status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+    CHECK_STATUS(status);
+    status = nc_inq_vardimid(NUM2LONG(argv[0]), NUM2LONG(argv[1]), dimid);
+    CHECK_STATUS(status);
+    for (i=0; i<ndims; i++) {
+      start[i] = 0;
+      status = nc_inq_dimlen(NUM2LONG(argv[0]), dimid[i], &count[i]);
+      CHECK_STATUS(status);
+    }
+    ca_attach(ca);
+    status = nc_put_masked(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                           ndims, start, count, NULL, ca);
+    ca_detach(ca);
+    CHECK_STATUS(status);
+    return LONG2NUM(status);
+  }
+
+  ca_attach(ca);
+  status = nc_put_var_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			      type, ca->ptr);
+  ca_detach(ca);
+
+  CHECK_STATUS(status);
+  
+  return LONG2NUM(status);
+}
+
+static VALUE
+rb_nc_get_vara (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE opts = Qnil;
+  nc_fills_t fills;
+  int status;
+  nc_type type;
+  int ndims;
+  int dimid[NC_MAX_DIMS];
+  size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+  int i;
+
+  if ( argc > 4 && TYPE(argv[argc-1]) == T_HASH ) {
+    opts = argv[--argc];
+  }
+
+  if ( argc < 4 ) {
+    rb_raise(rb_eArgError, "invalid # of arguments");
+  }
+
+  nc_scan_fills(opts, &fills);
+  
+  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+
+  CHECK_STATUS(status);
+
+  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+
+  CHECK_STATUS(status);
+
+  status = nc_inq_vardimid(NUM2LONG(argv[0]), NUM2LONG(argv[1]), dimid);
+
+  CHECK_STATUS(status);
+
+  Check_Type(argv[2], T_ARRAY);
+  Check_Type(argv[3], T_ARRAY);
+
+  for (i=0; i<ndims; i++) {
+    start[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+    count[i] = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+  }
+
+  if ( argc == 4 ) {
+    volatile VALUE out;
+    CArray *ca;
+    int8_t rank, data_type;
+    ca_size_t dim[CA_RANK_MAX];
+    int i;
+
+    data_type = rb_nc_typemap (type);
+    rank = ndims;
+    for (i=0; i<rank; i++) {
+      dim[i] = count[i];
+    }
+
+    out = rb_carray_new(data_type, rank, dim, 0, NULL);
+    Data_Get_Struct(out, CArray, ca);
+
+    if ( fills.n > 0 ) {
+      status = nc_get_masked(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                             type, ndims, start, count, NULL, ca, &fills);
+    }
+    else {
+      status = nc_get_vara_blocking(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+				    type, start, count, ca->ptr);
+    }
+
+    CHECK_STATUS(status);
+  
+    return out;
+  }
+  else {
+    volatile VALUE data = argv[4];
+    CArray *ca;
+
+    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+      rb_raise(rb_eTypeError, "arg5 must be a CArray object");
+    }
+    Data_Get_Struct(data, CArray, ca);
+
+    if ( ca->rank != ndims ) {
+      rb_raise(rb_eRuntimeError, "rank mismatch");
+    }
+
+    for (i=0; i<ca->rank; i++) {
+      if ( ca->dim[i] != count[i] ) {
+	rb_raise(rb_eRuntimeError, "dim[%i] mismatch", i);
+      }
+    }
+
+    type = rb_nc_rtypemap(ca->data_type);
+
+    ca_attach(ca);
+    status = nc_get_vara_blocking(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			       type, start, count, ca->ptr);
+    ca_sync(ca);
+    ca_detach(ca);
+
+    CHECK_STATUS(status);
+  
+    return LONG2NUM(status);
+  }
+}
+
+static VALUE
+rb_nc_put_vara (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE data;
+  int status;
+  nc_type type;
+  int ndims;
+  size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+  CArray *ca;
+  int i;
+
+  CHECK_ARGC(5);
+
+  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+
+  CHECK_STATUS(status);
+
+  Check_Type(argv[2], T_ARRAY);
+  Check_Type(argv[3], T_ARRAY);
+
+  for (i=0; i<ndims; i++) {
+    start[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+    count[i] = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+  }
+
+  data = argv[4];
+
+  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+    rb_raise(rb_eTypeError, "arg5 must be a CArray object");
+  }
+
+  Data_Get_Struct(data, CArray, ca);
+
+  type = rb_nc_rtypemap(ca->data_type);
+
+  ca_attach(ca);
+  if ( ca_has_mask(ca) ) {
+    status = nc_put_masked(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                           ndims, start, count, NULL, ca);
+  }
+  else {
+    status = nc_put_vara_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			         type, start, count, ca->ptr);
+  }
+  ca_detach(ca);
+
+  CHECK_STATUS(status);
+  
+  return LONG2NUM(status);
+}
+
+static VALUE
+rb_nc_get_vars (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE opts = Qnil;
+  nc_fills_t fills;
+  int status;
+  nc_type type;
+  int ndims;
+  int dimid[NC_MAX_DIMS];
+  size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+  ptrdiff_t stride[NC_MAX_DIMS];
+  CArray *ca;
+  int i;
+
+  if ( argc > 5 && TYPE(argv[argc-1]) == T_HASH ) {
+    opts = argv[--argc];
+  }
+
+  if ( argc < 5 ) {
+    rb_raise(rb_eArgError, "invalid # of arguments");
+  }
+
+  nc_scan_fills(opts, &fills);
+  
+  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+
+  CHECK_STATUS(status);
+
+  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+
+  CHECK_STATUS(status);
+
+  status = nc_inq_vardimid(NUM2LONG(argv[0]), NUM2LONG(argv[1]), dimid);
+
+  CHECK_STATUS(status);
+
+  Check_Type(argv[2], T_ARRAY);
+  Check_Type(argv[3], T_ARRAY);
+  Check_Type(argv[4], T_ARRAY);
+
+  for (i=0; i<ndims; i++) {
+    start[i]  = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+    count[i]  = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+    stride[i] = NUM2ULONG(RARRAY_PTR(argv[4])[i]);
+  }
+
+  if ( argc == 5 ) {
+    volatile VALUE out;
+    CArray *ca;
+    int8_t rank, data_type;
+    ca_size_t dim[CA_RANK_MAX];
+    int i;
+
+    data_type = rb_nc_typemap (type);
+    rank = ndims;
+    for (i=0; i<rank; i++) {
+      dim[i] = count[i];
+    }
+
+    out = rb_carray_new(data_type, rank, dim, 0, NULL);
+    Data_Get_Struct(out, CArray, ca);
+
+    if ( fills.n > 0 ) {
+      status = nc_get_masked(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                             type, ndims, start, count, stride, ca, &fills);
+    }
+    else {
+      status = nc_get_vars_blocking(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			            type, ndims, start, count, stride, ca->ptr);
+    }
+
+    CHECK_STATUS(status);
+  
+    return out;
+  }
+  else {
+    volatile VALUE data = argv[5];
+    int i;
+
+    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+      rb_raise(rb_eTypeError, "arg6 must be a CArray object");
+    }
+
+    Data_Get_Struct(data, CArray, ca);
+
+    if ( ca->rank != ndims ) {
+      rb_raise(rb_eRuntimeError, "rank mismatch");
+    }
+
+    for (i=0; i<ca->rank; i++) {
+      if ( ca->dim[i] != count[i] ) {
+	rb_raise(rb_eRuntimeError, "dim[%i] mismatch", i);
+      }
+    }
+
+    type = rb_nc_rtypemap(ca->data_type);
+
+    ca_attach(ca);
+    status = nc_get_vars_blocking(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			      type, ndims, start, count, stride, ca->ptr);
+    ca_sync(ca);
+    ca_detach(ca);
+
+    CHECK_STATUS(status);
+  
+    return LONG2NUM(status);
+  }
+}
+
+static VALUE
+rb_nc_put_vars (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE data;
+  int status;
+  nc_type type;
+  int ndims;
+  size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+  ptrdiff_t stride[NC_MAX_DIMS];
+  CArray *ca;
+  int i;
+
+  CHECK_ARGC(6);
+
+  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+
+  CHECK_STATUS(status);
+
+  Check_Type(argv[2], T_ARRAY);
+  Check_Type(argv[3], T_ARRAY);
+  Check_Type(argv[4], T_ARRAY);
+
+  for (i=0; i<ndims; i++) {
+    start[i]  = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+    count[i]  = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+    stride[i] = NUM2ULONG(RARRAY_PTR(argv[4])[i]);
+  }
+
+  data = argv[5];
+
+  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+    rb_raise(rb_eTypeError, "arg6 must be a CArray object");
+  }
+
+  Data_Get_Struct(data, CArray, ca);
+
+  type = rb_nc_rtypemap(ca->data_type);
+
+  ca_attach(ca);
+  if ( ca_has_mask(ca) ) {
+    status = nc_put_masked(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                           ndims, start, count, stride, ca);
+  }
+  else {
+    status = nc_put_vars_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			         type, start, count, stride, ca->ptr);
+  }
+  ca_detach(ca);
+
+  CHECK_STATUS(status);
+  
+  return LONG2NUM(status);
+}
+
+static VALUE
+rb_nc_get_varm (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE opts = Qnil;
+  nc_fills_t fills;
+  int status;
+  nc_type type;
+  int ndims;
+  int dimid[NC_MAX_DIMS];
+  size_t    start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+  ptrdiff_t stride[NC_MAX_DIMS], imap[NC_MAX_DIMS];
+  CArray *ca;
+  int i;
+
+  if ( argc > 6 && TYPE(argv[argc-1]) == T_HASH ) {
+    opts = argv[--argc];
+  }
+
+  if ( argc < 6 ) {
+    rb_raise(rb_eArgError, "invalid # of arguments");
+  }
+
+  nc_scan_fills(opts, &fills);
+  
+  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+
+  CHECK_STATUS(status);
+
+  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+
+  CHECK_STATUS(status);
+
+  status = nc_inq_vardimid(NUM2LONG(argv[0]), NUM2LONG(argv[1]), dimid);
+
+  CHECK_STATUS(status);
+
+  Check_Type(argv[2], T_ARRAY);
+  Check_Type(argv[3], T_ARRAY);
+  Check_Type(argv[4], T_ARRAY);
+  Check_Type(argv[5], T_ARRAY);
+
+  for (i=0; i<ndims; i++) {
+    start[i]  = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+    count[i]  = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+    stride[i] = NUM2ULONG(RARRAY_PTR(argv[4])[i]);
+    imap[i]   = NUM2ULONG(RARRAY_PTR(argv[5])[i]);
+  }
+
+  if ( argc == 6 ) {
+    volatile VALUE out;
+    CArray *ca;
+    int8_t rank, data_type;
+    ca_size_t dim[CA_RANK_MAX];
+    int i;
+
+    data_type = rb_nc_typemap (type);
+    rank = ndims;
+    for (i=0; i<rank; i++) {
+      dim[i] = count[i];
+    }
+
+    out = rb_carray_new(data_type, rank, dim, 0, NULL);
+    Data_Get_Struct(out, CArray, ca);
+
+    status = nc_get_varm_blocking(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			       type, start, count, stride, imap, ca->ptr);
+
+    CHECK_STATUS(status);
+
+    nc_mask_fills(ca, 0, ca->elements, &fills);
+  
+    return out;
+  }
+  else {
+    volatile VALUE data = argv[6];
+    int i;
+
+    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+      rb_raise(rb_eTypeError, "arg6 must be a CArray object");
+    }
+
+    Data_Get_Struct(data, CArray, ca);
+
+    if ( ca->rank != ndims ) {
+      rb_raise(rb_eRuntimeError, "rank mismatch");
+    }
+
+    for (i=0; i<ca->rank; i++) {
+      if ( ca->dim[i] != count[i] ) {
+	rb_raise(rb_eRuntimeError, "dim[%i] mismatch", i);
+      }
+    }
+
+    type = rb_nc_rtypemap(ca->data_type);
+
+    ca_attach(ca);
+    status = nc_get_varm_blocking(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			       type, start, count, stride, imap, ca->ptr);
+    ca_sync(ca);
+    ca_detach(ca);
+  
+    CHECK_STATUS(status);
+  
+    return LONG2NUM(status);
+  }
+}
+
+static VALUE
+rb_nc_put_varm (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE data;
+  int status;
+  nc_type type;
+  int ndims;
+  size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
+  ptrdiff_t stride[NC_MAX_DIMS], imap[NC_MAX_DIMS];
+  CArray *ca;
+  int i;
+
+  CHECK_ARGC(7);
+
+  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+
+  CHECK_STATUS(status);
+
+  Check_Type(argv[2], T_ARRAY);
+  Check_Type(argv[3], T_ARRAY);
+  Check_Type(argv[4], T_ARRAY);
+  Check_Type(argv[5], T_ARRAY);
+
+  for (i=0; i<ndims; i++) {
+    start[i]  = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+    count[i]  = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+    stride[i] = NUM2ULONG(RARRAY_PTR(argv[4])[i]);
+    imap[i]   = NUM2ULONG(RARRAY_PTR(argv[5])[i]);
+  }
+
+  data = argv[6];
+
+  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+    rb_raise(rb_eTypeError, "arg7 must be a CArray object");
+  }
+
+  Data_Get_Struct(data, CArray, ca);
+
+  type = rb_nc_rtypemap(ca->data_type);
+
+  ca_attach(ca);
+  status = nc_put_varm_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+			       type, start, count, stride, imap, ca->ptr);
+  ca_detach(ca);
+
+  CHECK_STATUS(status);
+  
+  return LONG2NUM(status);
+}
+
+/* nc_get_vara_into(fd, varid, start, count, ca, offset)
+
+   Reads the hyperslab (start, count) into the block of ca at offset.
+   Used to assemble several hyperslabs into one output array. The block
+   is read directly when it is contiguous in ca, otherwise through 
+   a scratch buffer. */
+
+static VALUE
+rb_nc_get_vara_into (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE vbuf;
+  int       status;
+  int       ncid, varid, ndims, direct;
+  size_t    start[NC_MAX_VAR_DIMS], count[NC_MAX_VAR_DIMS];
+  size_t    offset[NC_MAX_VAR_DIMS], elsize;
+  ptrdiff_t sstep[NC_MAX_VAR_DIMS], dstep[NC_MAX_VAR_DIMS];
+  ptrdiff_t doff = 0;
+  nc_type   type;
+  CArray   *ca;
+  int       i;
+
+  CHECK_ARGC(6);
+  CHECK_TYPE_ID(argv[0]);
+  CHECK_TYPE_ID(argv[1]);
+  CHECK_TYPE_ARRAY(argv[2]);
+  CHECK_TYPE_ARRAY(argv[3]);
+  CHECK_TYPE_DATA(argv[4]);
+  CHECK_TYPE_ARRAY(argv[5]);
+
+  ncid  = NUM2LONG(argv[0]);
+  varid = NUM2LONG(argv[1]);
+
+  status = nc_inq_varndims(ncid, varid, &ndims);
+  CHECK_STATUS(status);
+
+  Data_Get_Struct(argv[4], CArray, ca);
+
+  if ( ca->rank != ndims || 
+       RARRAY_LEN(argv[2]) != ndims || 
+       RARRAY_LEN(argv[3]) != ndims || 
+       RARRAY_LEN(argv[5]) != ndims ) {
+    rb_raise(rb_eRuntimeError, "rank mismatch");
+  }
+
+  for (i=0; i<ndims; i++) {
+    start[i]  = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+    count[i]  = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+    offset[i] = NUM2ULONG(RARRAY_PTR(argv[5])[i]);
+    if ( offset[i] + count[i] > (size_t) ca->dim[i] ) {
+      rb_raise(rb_eRuntimeError, "dim[%i] out of range", i);
+    }
+  }
+
+  type   = rb_nc_rtypemap(ca->data_type);
+  elsize = ca->bytes;
+
+  dstep[ndims-1] = elsize;
+  sstep[ndims-1] = elsize;
+  for (i=ndims-2; i>=0; i--) {
+    dstep[i] = dstep[i+1] * ca->dim[i+1];
+    sstep[i] = sstep[i+1] * count[i+1];
+  }
+
+  direct = 1;
+  for (i=0; i<ndims; i++) {
+    doff += offset[i] * dstep[i];
+    if ( i > 0 && count[i] != (size_t) ca->dim[i] ) {
+      direct = 0;
+    }
+  }
+
+  ca_attach(ca);
+
+  if ( direct ) {
+    status = nc_get_vara_blocking(ncid, varid, type, start, count, 
+                                 ca->ptr + doff);
+  }
+  else {
+    vbuf = rb_str_new(NULL, sstep[0] * count[0]);
+    status = nc_get_vara_blocking(ncid, varid, type, start, count, 
+                                 RSTRING_PTR(vbuf));
+    if ( status == NC_NOERR ) {
+      nc_copy_strided(ndims, count, elsize, 
+                      RSTRING_PTR(vbuf), sstep, ca->ptr + doff, dstep);
+    }
+  }
+
+  ca_sync(ca);
+  ca_detach(ca);
+
+  CHECK_STATUS(status);
+
+  return LONG2NUM(status);
+}
+
+/* ------------------------------------------------------------------------
+ *  character arrays
+ *
+ *  A NC_CHAR variable whose last dimension is the string length is read 
+ *  directly into a fixed-length string CArray (CA_FIXLEN) of the leading
+ *  dimensions. Values are kept NUL-padded as stored; nc_text_strings 
+ *  trims the padding only when Ruby Strings are requested.
+ * ------------------------------------------------------------------------ */
+
+/* nc_get_vara_text(fd, varid, start, count) => CA_FIXLEN CArray */
+
+static VALUE
+rb_nc_get_vara_text (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE out;
+  int       status;
+  int       ncid, varid, ndims, rank, i;
+  size_t    start[NC_MAX_VAR_DIMS], count[NC_MAX_VAR_DIMS];
+  ca_size_t dim[CA_RANK_MAX];
+  CArray   *ca;
+
+  CHECK_ARGC(4);
+  CHECK_TYPE_ID(argv[0]);
+  CHECK_TYPE_ID(argv[1]);
+  CHECK_TYPE_ARRAY(argv[2]);
+  CHECK_TYPE_ARRAY(argv[3]);
+
+  ncid  = NUM2LONG(argv[0]);
+  varid = NUM2LONG(argv[1]);
+
+  status = nc_inq_varndims(ncid, varid, &ndims);
+  CHECK_STATUS(status);
+
+  if ( ndims < 1 || ndims > CA_RANK_MAX || 
+       RARRAY_LEN(argv[2]) != ndims || RARRAY_LEN(argv[3]) != ndims ) {
+    rb_raise(rb_eRuntimeError, "rank mismatch");
+  }
+
+  for (i=0; i<ndims; i++) {
+    start[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+    count[i] = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+  }
+
+  if ( count[ndims-1] == 0 ) {
+    rb_raise(rb_eRuntimeError, "string length must be positive");
+  }
+
+  rank = ndims - 1;
+  for (i=0; i<rank; i++) {
+    dim[i] = count[i];
+  }
+  if ( rank == 0 ) {
+    dim[rank++] = 1;
+  }
+
+  out = rb_carray_new(CA_FIXLEN, rank, dim, count[ndims-1], NULL);
+  Data_Get_Struct(out, CArray, ca);
+
+  status = nc_get_vara_text(ncid, varid, start, count, ca->ptr);
+  CHECK_STATUS(status);
+
+  return out;
+}
+
+/* nc_put_vara_text(fd, varid, start, count, value) 
+     value : CA_FIXLEN CArray, Array of Strings or String 
+     (padded with NUL to the string length) */
+
+static VALUE
+rb_nc_put_vara_text (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE data, vbuf;
+  int       status;
+  int       ncid, varid, ndims, i;
+  size_t    start[NC_MAX_VAR_DIMS], count[NC_MAX_VAR_DIMS];
+  size_t    nstr = 1, len, k, n;
+  char     *buf;
+  CArray   *ca;
+
+  CHECK_ARGC(5);
+  CHECK_TYPE_ID(argv[0]);
+  CHECK_TYPE_ID(argv[1]);
+  CHECK_TYPE_ARRAY(argv[2]);
+  CHECK_TYPE_ARRAY(argv[3]);
+
+  ncid  = NUM2LONG(argv[0]);
+  varid = NUM2LONG(argv[1]);
+  data  = argv[4];
+
+  status = nc_inq_varndims(ncid, varid, &ndims);
+  CHECK_STATUS(status);
+
+  if ( ndims < 1 || 
+       RARRAY_LEN(argv[2]) != ndims || RARRAY_LEN(argv[3]) != ndims ) {
+    rb_raise(rb_eRuntimeError, "rank mismatch");
+  }
+
+  for (i=0; i<ndims; i++) {
+    start[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
+    count[i] = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+    if ( i < ndims - 1 ) {
+      nstr *= count[i];
+    }
+  }
+  len = count[ndims-1];
+
+  if ( TYPE(data) == T_STRING ) {
+    data = rb_ary_new_from_args(1, data);
+  }
+
+  if ( rb_obj_is_kind_of(data, rb_cCArray) ) {
+    Data_Get_Struct(data, CArray, ca);
+    if ( ca->data_type != CA_FIXLEN ) {
+      rb_raise(rb_eRuntimeError, "fixlen CArray required for NC_CHAR");
+    }
+    if ( (size_t) ca->elements != nstr ) {
+      rb_raise(rb_eRuntimeError, "data size mismatch");
+    }
+    if ( (size_t) ca->bytes > len ) {
+      rb_raise(rb_eRuntimeError, "string too long (%ld for %ld)",
+               (long) ca->bytes, (long) len);
+    }
+    ca_attach(ca);
+    if ( (size_t) ca->bytes == len ) {
+      status = nc_put_vara_text(ncid, varid, start, count, ca->ptr);
+    }
+    else {
+      vbuf = rb_str_new(NULL, nstr * len);
+      buf  = RSTRING_PTR(vbuf);
+      memset(buf, 0, nstr * len);
+      for (k=0; k<nstr; k++) {
+        memcpy(buf + k * len, ca->ptr + k * ca->bytes, ca->bytes);
+      }
+      status = nc_put_vara_text(ncid, varid, start, count, buf);
+    }
+    ca_detach(ca);
+  }
+  else {
+    Check_Type(data, T_ARRAY);
+    data = rb_funcall(data, rb_intern("flatten"), 0);
+    if ( (size_t) RARRAY_LEN(data) != nstr ) {
+      rb_raise(rb_eRuntimeError, "data size mismatch");
+    }
+    vbuf = rb_str_new(NULL, nstr * len);
+    buf  = RSTRING_PTR(vbuf);
+    memset(buf, 0, nstr * len);
+    for (k=0; k<nstr; k++) {
+      VALUE str = RARRAY_PTR(data)[k];
+      StringValue(str);
+      n = RSTRING_LEN(str);
+      if ( n > len ) {
+        rb_raise(rb_eRuntimeError, "string too long (%ld for %ld)",
+                 (long) n, (long) len);
+      }
+      memcpy(buf + k * len, RSTRING_PTR(str), n);
+    }
+    status = nc_put_vara_text(ncid, varid, start, count, buf);
+  }
+
+  CHECK_STATUS(status);
+
+  return LONG2NUM(status);
+}
+
+/* nc_text_strings(ca) => Array of Strings without trailing NULs */
+
+static VALUE
+rb_nc_text_strings (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE list;
+  CArray   *ca;
+  ca_size_t i;
+  size_t    n;
+  const char *p;
+
+  CHECK_ARGC(1);
+  CHECK_TYPE_DATA(argv[0]);
+
+  Data_Get_Struct(argv[0], CArray, ca);
+  if ( ca->data_type != CA_FIXLEN ) {
+    rb_raise(rb_eRuntimeError, "fixlen CArray required");
+  }
+
+  list = rb_ary_new2(ca->elements);
+
+  ca_attach(ca);
+  for (i=0; i<ca->elements; i++) {
+    p = ca->ptr + i * ca->bytes;
+    n = ca->bytes;
+    while ( n > 0 && p[n-1] == '\0' ) {
+      n--;
+    }
+    rb_ary_push(list, rb_str_new(p, n));
+  }
+  ca_detach(ca);
+
+  return list;
+}
+
+/* ------------------------------------------------------------------------
+ *  file-backed arrays
+ *
+ *  Reads exceeding the memory budget can be spilled to a CArray whose data
+ *  lives in a memory-mapped scratch file (see NCVar#get with spill: true).
+ *  The file is unlinked as soon as it is mapped, and the mapping is 
+ *  released when the CArray is collected.
+ * ------------------------------------------------------------------------ */
+
+#ifdef HAVE_SYS_MMAN_H
+
+typedef struct {
+  void  *ptr;
+  size_t len;
+} nc_mmap_t;
+
+static void
+nc_mmap_free (void *p)
+{
+  nc_mmap_t *m = (nc_mmap_t *) p;
+  if ( m->ptr ) {
+    munmap(m->ptr, m->len);
+  }
+  free(m);
+}
+
+#endif
+
+/* nc_mmap_carray(data_type, dim, path) => CArray */
+
+static VALUE
+rb_nc_mmap_carray (int argc, VALUE *argv, VALUE mod)
+{
+#ifdef HAVE_SYS_MMAN_H
+  volatile VALUE refer;
+  nc_mmap_t *m;
+  ca_size_t dim[CA_RANK_MAX];
+  int8_t data_type;
+  int rank;
+  size_t len;
+  const char *path;
+  void *ptr;
+  int fd, err, i;
+
+  CHECK_ARGC(3);
+  Check_Type(argv[1], T_ARRAY);
+
+  data_type = NUM2INT(argv[0]);
+  rank      = RARRAY_LEN(argv[1]);
+  path      = StringValueCStr(argv[2]);
+
+  if ( rank < 1 || rank > CA_RANK_MAX ) {
+    rb_raise(rb_eRuntimeError, "invalid rank");
+  }
+
+  len = nc_type_size(rb_nc_rtypemap(data_type));
+  for (i=0; i<rank; i++) {
+    dim[i] = NUM2LONG(RARRAY_PTR(argv[1])[i]);
+    if ( dim[i] < 1 ) {
+      rb_raise(rb_eRuntimeError, "invalid dim[%i]", i);
+    }
+    len *= dim[i];
+  }
+  if ( len == 0 ) {
+    rb_raise(rb_eRuntimeError, "invalid data type");
+  }
+
+  m = ALLOC(nc_mmap_t);
+  m->ptr = NULL;
+  m->len = len;
+  refer = Data_Wrap_Struct(rb_cObject, 0, nc_mmap_free, m);
+
+  fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if ( fd < 0 ) {
+    rb_sys_fail(path);
+  }
+  if ( ftruncate(fd, len) != 0 ) {
+    err = errno;
+    close(fd);
+    unlink(path);
+    errno = err;
+    rb_sys_fail(path);
+  }
+  ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  err = errno;
+  close(fd);
+  unlink(path);
+  if ( ptr == MAP_FAILED ) {
+    errno = err;
+    rb_sys_fail(path);
+  }
+  m->ptr = ptr;
+
+  return rb_carray_wrap_ptr(data_type, rank, dim, 0, NULL, ptr, refer);
+#else
+  rb_notimplement();
+  return Qnil;
+#endif
+}
+
+/* ------------------------------------------------------------------------
+ *  record block reader (classic formats)
+ *
+ *  In CDF-1/2/5 files the record variables are interleaved record by 
+ *  record. libnetcdf does not expose the file offsets, so the header is
+ *  parsed here (only names, types, dimensions and begin offsets are kept).
+ *  nc_read_records(path, names, start, count[, opts]) reads the record 
+ *  section from record start with sequential reads of at most 
+ *  opts[:buffer] bytes (default 64 MiB) and de-interleaves the named 
+ *  record variables into one CArray each ([count, ...], native byte 
+ *  order, not decoded). It returns nil when the file is not in a classic
+ *  format.
+ * ------------------------------------------------------------------------ */
+
+#define NC_RECORD_BUFFER   (64*1024*1024)
+#define NC_HDR_SHORT       (-1)
+#define NC_HDR_STREAMING   (~(uint64_t) 0)     /* numrecs not known */
+
+#define NC_HDR_DIMENSION   0x0A
+#define NC_HDR_VARIABLE    0x0B
+#define NC_HDR_ATTRIBUTE   0x0C
+
+typedef struct {
+  const unsigned char *p, *end;
+  int version;
+} nc_hdr_t;
+
+typedef struct {
+  int       found;                 /* 1 : record variable, 2 : fixed */
+  nc_type   type;
+  int       rank;                  /* dimensions after the record one */
+  ca_size_t dim[CA_RANK_MAX];
+  size_t    size;                  /* bytes of one record */
+  off_t     begin;
+} nc_hdr_var_t;
+
+static size_t
+nc_hdr_type_size (nc_type type)
+{
+  switch ( type ) {
+  case 7:                          /* NC_UBYTE  (CDF-5) */
+    return 1;
+  case 8:                          /* NC_USHORT */
+    return 2;
+  case 9:                          /* NC_UINT   */
+    return 4;
+  case 10:                         /* NC_INT64  */
+  case 11:                         /* NC_UINT64 */
+    return 8;
+  default:
+    return nc_type_size(type);
+  }
+}
+
+static int
+nc_hdr_uint (nc_hdr_t *h, int bytes, uint64_t *v)
+{
+  int i;
+  if ( h->end - h->p < bytes ) {
+    return NC_HDR_SHORT;
+  }
+  *v = 0;
+  for (i=0; i<bytes; i++) {
+    *v = (*v << 8) | *h->p++;
+  }
+  return 0;
+}
+
+/* NON_NEG : 8 bytes in CDF-5, 4 bytes otherwise */
+
+static int
+nc_hdr_count (nc_hdr_t *h, uint64_t *v)
+{
+  return nc_hdr_uint(h, ( h->version == 5 ) ? 8 : 4, v);
+}
+
+static int
+nc_hdr_skip (nc_hdr_t *h, uint64_t n)
+{
+  n = ( n + 3 ) & ~(uint64_t) 3;
+  if ( (uint64_t) (h->end - h->p) < n ) {
+    return NC_HDR_SHORT;
+  }
+  h->p += n;
+  return 0;
+}
+
+/* list header : tag and nelems (ABSENT is ZERO ZERO) */
+
+static int
+nc_hdr_list (nc_hdr_t *h, int tag, uint64_t *n)
+{
+  uint64_t t;
+  int status;
+  if ( ( status = nc_hdr_uint(h, 4, &t) ) || 
+       ( status = nc_hdr_count(h, n) ) ) {
+    return status;
+  }
+  if ( t != (uint64_t) tag && ! ( t == 0 && *n == 0 ) ) {
+    return NC_ENOTNC;
+  }
+  return 0;
+}
+
+static int
+nc_hdr_atts (nc_hdr_t *h)
+{
+  uint64_t natts, len, type, nelems;
+  int status, i;
+  if ( ( status = nc_hdr_list(h, NC_HDR_ATTRIBUTE, &natts) ) ) {
+    return status;
+  }
+  for (i=0; i<natts; i++) {
+    if ( ( status = nc_hdr_count(h, &len) ) ||
+         ( status = nc_hdr_skip(h, len) ) ||
+         ( status = nc_hdr_uint(h, 4, &type) ) ||
+         ( status = nc_hdr_count(h, &nelems) ) ) {
+      return status;
+    }
+    if ( nc_hdr_type_size(type) == 0 ) {
+      return NC_ENOTNC;
+    }
+    if ( ( status = nc_hdr_skip(h, nelems * nc_hdr_type_size(type)) ) ) {
+      return status;
+    }
+  }
+  return 0;
+}
+
+/*
+ *  Parses the header in buf. The named variables are looked up in 
+ *  names (nvars entries of vars). numrecs is NC_HDR_STREAMING if the 
+ *  header does not hold the number of records. Returns NC_HDR_SHORT when
+ *  the header continues beyond len.
+ */
+
+static int
+nc_hdr_parse (const unsigned char *buf, size_t len, 
+              VALUE names, nc_hdr_var_t *vars, 
+              size_t *recsize, off_t *begin_rec, uint64_t *numrecs)
+{
+  volatile VALUE vdimlen;
+  nc_hdr_t h;
+  uint64_t ndims, nvars, n, v, type, nd, dimid;
+  uint64_t *dimlen;
+  size_t size, padded, sum = 0, single = 0;
+  off_t begin;
+  char name[NC_MAX_NAME+1];
+  int nrecvars = 0, record, status, i, j, k, m;
+
+  if ( len < 4 ) {
+    return NC_HDR_SHORT;
+  }
+  if ( memcmp(buf, "CDF", 3) != 0 ||
+       ( buf[3] != 1 && buf[3] != 2 && buf[3] != 5 ) ) {
+    return NC_ENOTNC;
+  }
+  h.p       = buf + 4;
+  h.end     = buf + len;
+  h.version = buf[3];
+
+  if ( ( status = nc_hdr_count(&h, numrecs) ) ||
+       ( status = nc_hdr_list(&h, NC_HDR_DIMENSION, &ndims) ) ) {
+    return status;
+  }
+  if ( h.version != 5 && *numrecs == 0xFFFFFFFF ) {
+    *numrecs = NC_HDR_STREAMING;
+  }
+  vdimlen = rb_str_new(NULL, sizeof(uint64_t) * ( ndims + 1 ));
+  dimlen  = (uint64_t *) RSTRING_PTR(vdimlen);
+  for (i=0; i<ndims; i++) {
+    if ( ( status = nc_hdr_count(&h, &n) ) ||
+         ( status = nc_hdr_skip(&h, n) ) ||
+         ( status = nc_hdr_count(&h, &dimlen[i]) ) ) {
+      return status;
+    }
+  }
+
+  if ( ( status = nc_hdr_atts(&h) ) ||
+       ( status = nc_hdr_list(&h, NC_HDR_VARIABLE, &nvars) ) ) {
+    return status;
+  }
+  *begin_rec = -1;
+  for (i=0; i<nvars; i++) {
+    if ( ( status = nc_hdr_count(&h, &n) ) ) {
+      return status;
+    }
+    if ( (uint64_t) (h.end - h.p) < n ) {
+      return NC_HDR_SHORT;
+    }
+    if ( n > NC_MAX_NAME ) {
+      return NC_ENOTNC;
+    }
+    memcpy(name, h.p, n);
+    name[n] = '\0';
+    if ( ( status = nc_hdr_skip(&h, n) ) ||
+         ( status = nc_hdr_count(&h, &nd) ) ) {
+      return status;
+    }
+    m = -1;
+    for (k=0; k<RARRAY_LEN(names); k++) {
+      VALUE vn = RARRAY_PTR(names)[k];
+      if ( RSTRING_LEN(vn) == (long) n && memcmp(RSTRING_PTR(vn), name, n) == 0 ) {
+        m = k;
+      }
+    }
+    record = 0;
+    size   = 1;
+    for (j=0; j<nd; j++) {
+      if ( ( status = nc_hdr_count(&h, &dimid) ) ) {
+        return status;
+      }
+      if ( dimid >= ndims ) {
+        return NC_ENOTNC;
+      }
+      if ( j == 0 && dimlen[dimid] == 0 ) {
+        record = 1;
+        continue;
+      }
+      size *= dimlen[dimid];
+      if ( m >= 0 ) {
+        if ( vars[m].rank >= CA_RANK_MAX - 1 ) {
+          return NC_EMAXDIMS;
+        }
+        vars[m].dim[vars[m].rank++] = dimlen[dimid];
+      }
+    }
+    if ( ( status = nc_hdr_atts(&h) ) ||
+         ( status = nc_hdr_uint(&h, 4, &type) ) ||
+         ( status = nc_hdr_count(&h, &v) ) ||                  /* vsize */
+         ( status = nc_hdr_uint(&h, ( h.version == 1 ) ? 4 : 8, &v) ) ) {
+      return status;
+    }
+    begin = (off_t) v;
+    if ( nc_hdr_type_size(type) == 0 ) {
+      return NC_ENOTNC;
+    }
+    size  *= nc_hdr_type_size(type);
+    if ( m >= 0 ) {
+      vars[m].found = record ? 1 : 2;
+      vars[m].type  = type;
+      vars[m].size  = size;
+      vars[m].begin = begin;
+    }
+    if ( record ) {
+      padded = ( size + 3 ) & ~(size_t) 3;
+      sum   += padded;
+      single = size;
+      nrecvars++;
+      if ( *begin_rec < 0 || begin < *begin_rec ) {
+        *begin_rec = begin;
+      }
+    }
+  }
+
+  /* a single record variable is not padded between records */
+  *recsize = ( nrecvars == 1 ) ? single : sum;
+
+  return NC_NOERR;
+}
+
+static void
+nc_swap_bytes (char *ptr, size_t n, size_t elsize)
+{
+#ifndef WORDS_BIGENDIAN
+  size_t i, j;
+  char c;
+  if ( elsize == 1 ) {
+    return;
+  }
+  for (i=0; i<n; i++, ptr+=elsize) {
+    for (j=0; j<elsize/2; j++) {
+      c = ptr[j];
+      ptr[j] = ptr[elsize-1-j];
+      ptr[elsize-1-j] = c;
+    }
+  }
+#endif
+}
+
+#ifdef HAVE_UNISTD_H
+
+typedef struct {
+  const char *path;
+  VALUE       names;
+  size_t      start, count, limit;
+  int         nnames;
+  int         fd;
+} nc_rec_read_t;
+
+static VALUE
+nc_read_records_body (VALUE arg)
+{
+  nc_rec_read_t *rd = (nc_rec_read_t *) arg;
+  volatile VALUE names = rd->names, vhdr, vvars, vbuf, out;
+  nc_hdr_var_t *vars;
+  CArray *ca;
+  const char *path = rd->path;
+  size_t start = rd->start, count = rd->count, limit = rd->limit;
+  size_t recsize, nrec, need, got, hlen = 65536, elsize, i, r;
+  uint64_t numrecs;
+  off_t begin_rec, pos;
+  ssize_t nread;
+  char *buf, **dst;
+  int fd = rd->fd, nnames = rd->nnames, status, k;
+
+  /* header (read again with a larger buffer while it is short) */
+
+  vvars = rb_str_new(NULL, sizeof(nc_hdr_var_t) * ( nnames + 1 ));
+  vars  = (nc_hdr_var_t *) RSTRING_PTR(vvars);
+  vhdr  = rb_str_new(NULL, 0);
+  do {
+    rb_str_resize(vhdr, hlen);
+    nread = pread(fd, RSTRING_PTR(vhdr), hlen, 0);
+    if ( nread < 0 ) {
+      rb_sys_fail(path);
+    }
+    memset(vars, 0, sizeof(nc_hdr_var_t) * nnames);
+    status = nc_hdr_parse((unsigned char *) RSTRING_PTR(vhdr), nread, 
+                          names, vars, &recsize, &begin_rec, &numrecs);
+    hlen *= 4;
+  } while ( status == NC_HDR_SHORT && (size_t) nread == hlen / 4 );
+
+  if ( status == NC_ENOTNC ) {
+    return Qnil;
+  }
+  if ( status == NC_HDR_SHORT ) {
+    status = NC_ENOTNC;
+  }
+  CHECK_STATUS(status);
+
+  if ( numrecs != NC_HDR_STREAMING && start + count > numrecs ) {
+    rb_raise(rb_eIndexError, "records %zu...%zu beyond %llu records", 
+             start, start + count, (unsigned long long) numrecs);
+  }
+
+  /* outputs */
+
+  out = rb_ary_new2(nnames);
+  dst = ALLOCA_N(char *, nnames + 1);
+  for (k=0; k<nnames; k++) {
+    nc_hdr_var_t *v = &vars[k];
+    ca_size_t dim[CA_RANK_MAX];
+    if ( v->found != 1 ) {
+      rb_raise(rb_eRuntimeError, "'%s' is not a record variable", 
+               StringValueCStr(RARRAY_PTR(names)[k]));
+    }
+    if ( nc_type_size(v->type) == 0 ) {
+      rb_raise(rb_eRuntimeError, "unsupported type of '%s'",
+               StringValueCStr(RARRAY_PTR(names)[k]));
+    }
+    dim[0] = count;
+    memcpy(&dim[1], v->dim, sizeof(ca_size_t) * v->rank);
+    rb_ary_store(out, k, rb_carray_new(rb_nc_typemap(v->type), 
+                                       v->rank + 1, dim, 0, NULL));
+    Data_Get_Struct(RARRAY_PTR(out)[k], CArray, ca);
+    dst[k] = ca->ptr;
+  }
+
+  if ( count == 0 || recsize == 0 ) {
+    return out;
+  }
+
+  /* sequential reads of nrec records, de-interleaved into the outputs */
+
+  nrec = ( limit / recsize > 0 ) ? limit / recsize : 1;
+  if ( nrec > count ) {
+    nrec = count;
+  }
+  vbuf = rb_str_new(NULL, nrec * recsize);
+  buf  = RSTRING_PTR(vbuf);
+
+  for (r=0; r<count; r+=nrec) {
+    if ( r + nrec > count ) {
+      nrec = count - r;
+    }
+    pos  = begin_rec + (off_t) ( start + r ) * recsize;
+    need = ( nrec - 1 ) * recsize;      /* last record may not be padded */
+    for (k=0; k<nnames; k++) {
+      size_t last = ( nrec - 1 ) * recsize + ( vars[k].begin - begin_rec ) + vars[k].size;
+      if ( last > need ) {
+        need = last;
+      }
+    }
+    got = 0;
+    while ( got < nrec * recsize ) {
+      nread = pread(fd, buf + got, nrec * recsize - got, pos + got);
+      if ( nread < 0 ) {
+        rb_sys_fail(path);
+      }
+      if ( nread == 0 ) {
+        break;
+      }
+      got += nread;
+    }
+    if ( got < need ) {
+      rb_raise(rb_eRuntimeError, "record %zu beyond the end of file", 
+               start + r + got / recsize);
+    }
+    for (k=0; k<nnames; k++) {
+      const char *src = buf + ( vars[k].begin - begin_rec );
+      for (i=0; i<nrec; i++) {
+        memcpy(dst[k], src + i * recsize, vars[k].size);
+        dst[k] += vars[k].size;
+      }
+      elsize = nc_type_size(vars[k].type);
+      nc_swap_bytes(dst[k] - nrec * vars[k].size, 
+                    nrec * vars[k].size / elsize, elsize);
+    }
+  }
+
+  return out;
+}
+
+static VALUE
+nc_read_records_close (VALUE arg)
+{
+  close(((nc_rec_read_t *) arg)->fd);
+  return Qnil;
+}
+
+#endif
+
+static VALUE
+rb_nc_read_records (int argc, VALUE *argv, VALUE mod)
+{
+#ifdef HAVE_UNISTD_H
+  volatile VALUE opts = Qnil, vbuffer;
+  nc_rec_read_t rd;
+  int k;
+
+  if ( argc == 5 ) {
+    opts = argv[4];
+    argc--;
+  }
+
+  CHECK_ARGC(4);
+  CHECK_TYPE_STRING(argv[0]);
+  CHECK_TYPE_ARRAY(argv[1]);
+
+  rd.path   = StringValueCStr(argv[0]);
+  rd.names  = argv[1];
+  rd.start  = NUM2SIZET(argv[2]);
+  rd.count  = NUM2SIZET(argv[3]);
+  rd.nnames = RARRAY_LEN(argv[1]);
+  rd.limit  = NC_RECORD_BUFFER;
+
+  if ( ! NIL_P(opts) ) {
+    Check_Type(opts, T_HASH);
+    vbuffer = rb_hash_aref(opts, ID2SYM(rb_intern("buffer")));
+    if ( ! NIL_P(vbuffer) ) {
+      rd.limit = NUM2SIZET(vbuffer);
+    }
+  }
+
+  for (k=0; k<rd.nnames; k++) {
+    CHECK_TYPE_STRING(RARRAY_PTR(argv[1])[k]);
+  }
+
+  rd.fd = open(rd.path, O_RDONLY);
+  if ( rd.fd < 0 ) {
+    rb_sys_fail(rd.path);
+  }
+
+  return rb_ensure(nc_read_records_body, (VALUE) &rd, 
+                   nc_read_records_close, (VALUE) &rd);
+#else
+  rb_notimplement();
+  return Qnil;
+#endif
+}
+
+/* ------------------------------------------------------------------------
+ *  index planner
+ *
+ *  Translates CArray-style index arguments (Integer, nil, Range and 
+ *  ArithmeticSequence) into start/count/stride of netCDF hyperslab
+ *  without building intermediate Ruby arrays. The arguments which can not 
+ *  be handled here (CArray, Symbol, Array, ...) are left to 
+ *  CArray.scan_index on the Ruby side (nc_get_index returns nil).
+ *
+ *  Recent plans are cached keyed by the variable shape and the index
+ *  arguments, so that repeated reads of the same region skip planning.
+ * ------------------------------------------------------------------------ */
+
+#define NC_PLAN_POINT  1
+#define NC_PLAN_BLOCK  2
+
+#define NC_ARG_NIL      1
+#define NC_ARG_INT      2
+#define NC_ARG_RANGE    3
+#define NC_ARG_KIND     0x0f
+#define NC_ARG_BEG_NIL  0x10
+#define NC_ARG_END_NIL  0x20
+#define NC_ARG_EXCL     0x40
+
+#define NC_PLAN_CACHE_SIZE 16
+
+typedef struct {
+  int       type;
+  int       ndims;
+  size_t    start[CA_RANK_MAX];
+  size_t    count[CA_RANK_MAX];
+  ptrdiff_t stride[CA_RANK_MAX];
+} nc_plan_t;
+
+typedef struct {
+  int       ndims;
+  int       argc;
+  size_t    dim[CA_RANK_MAX];
+  long      arg[CA_RANK_MAX][4];   /* kind, begin, end, step */
+} nc_plan_key_t;
+
+typedef struct {
+  int           valid;
+  nc_plan_key_t key;
+  nc_plan_t     plan;
+} nc_plan_entry_t;
+
+static nc_plan_entry_t nc_plan_cache[NC_PLAN_CACHE_SIZE];
+static int nc_plan_cache_next = 0;
+
+static int
+nc_plan_encode_bound (VALUE val, long *bound)
+{
+  if ( ! FIXNUM_P(val) ) {
+    return 0;
+  }
+  *bound = FIX2LONG(val);
+  return 1;
+}
+
+static int
+nc_plan_encode_range (VALUE beg, VALUE end, int excl, long step, long arg[4])
+{
+  arg[0] = NC_ARG_RANGE;
+  if ( NIL_P(beg) ) {
+    arg[0] |= NC_ARG_BEG_NIL;
+  }
+  else if ( ! nc_plan_encode_bound(beg, &arg[1]) ) {
+    return 0;
+  }
+  if ( NIL_P(end) ) {
+    arg[0] |= NC_ARG_END_NIL;
+  }
+  else if ( ! nc_plan_encode_bound(end, &arg[2]) ) {
+    return 0;
+  }
+  if ( excl ) {
+    arg[0] |= NC_ARG_EXCL;
+  }
+  arg[3] = step;
+  return 1;
+}
+
+static int
+nc_plan_encode (int ndims, const size_t dim[], int argc, VALUE *argv, 
+                nc_plan_key_t *key)
+{
+  int i;
+
+  if ( ndims < 1 || ndims > CA_RANK_MAX || argc > CA_RANK_MAX ) {
+    return 0;
+  }
+
+  memset(key, 0, sizeof(nc_plan_key_t));
+  key->ndims = ndims;
+  key->argc  = argc;
+  for (i=0; i<ndims; i++) {
+    key->dim[i] = dim[i];
+  }
+
+  for (i=0; i<argc; i++) {
+    VALUE arg = argv[i];
+    if ( NIL_P(arg) ) {
+      key->arg[i][0] = NC_ARG_NIL;
+    }
+    else if ( FIXNUM_P(arg) ) {
+      key->arg[i][0] = NC_ARG_INT;
+      key->arg[i][1] = FIX2LONG(arg);
+    }
+    else if ( rb_obj_is_kind_of(arg, rb_cRange) ) {
+      VALUE beg, end;
+      int excl;
+      rb_range_values(arg, &beg, &end, &excl);
+      if ( ! nc_plan_encode_range(beg, end, excl, 1, key->arg[i]) ) {
+        return 0;
+      }
+    }
+    else {
+#ifdef HAVE_RB_ARITHMETIC_SEQUENCE_EXTRACT
+      rb_arithmetic_sequence_components_t seq;
+      if ( ! rb_arithmetic_sequence_extract(arg, &seq) ) {
+        return 0;
+      }
+      if ( ! FIXNUM_P(seq.step) || FIX2LONG(seq.step) <= 0 ) {
+        return 0;
+      }
+      if ( ! nc_plan_encode_range(seq.begin, seq.end, seq.exclude_end,
+                                  FIX2LONG(seq.step), key->arg[i]) ) {
+        return 0;
+      }
+#else
+      return 0;
+#endif
+    }
+  }
+
+  return 1;
+}
+
+static int
+nc_plan_build (const nc_plan_key_t *key, nc_plan_t *plan)
+{
+  int ndims = key->ndims;
+  int point = 1;
+  int i;
+
+  plan->ndims = ndims;
+
+  /* CA_REG_ADDRESS : single integer for multi-dimensional variable */
+  if ( key->argc == 1 && ndims > 1 ) {
+    long elements = 1, addr;
+    if ( key->arg[0][0] != NC_ARG_INT ) {
+      return 0;
+    }
+    for (i=0; i<ndims; i++) {
+      elements *= key->dim[i];
+    }
+    addr = key->arg[0][1];
+    if ( addr < 0 ) {
+      addr += elements;
+    }
+    if ( addr < 0 || addr >= elements ) {
+      return 0;
+    }
+    for (i=ndims-1; i>=0; i--) {
+      plan->start[i]  = addr % key->dim[i];
+      plan->count[i]  = 1;
+      plan->stride[i] = 1;
+      addr /= key->dim[i];
+    }
+    plan->type = NC_PLAN_POINT;
+    return 1;
+  }
+
+  /* CA_REG_ALL */
+  if ( key->argc == 0 ) {
+    for (i=0; i<ndims; i++) {
+      plan->start[i]  = 0;
+      plan->count[i]  = key->dim[i];
+      plan->stride[i] = 1;
+    }
+    plan->type = NC_PLAN_BLOCK;
+    return 1;
+  }
+
+  if ( key->argc != ndims ) {
+    return 0;
+  }
+
+  for (i=0; i<ndims; i++) {
+    long n = key->dim[i];
+    long beg, end, step;
+    switch ( key->arg[i][0] & NC_ARG_KIND ) {
+    case NC_ARG_NIL:
+      plan->start[i]  = 0;
+      plan->count[i]  = n;
+      plan->stride[i] = 1;
+      point = 0;
+      break;
+    case NC_ARG_INT:
+      beg = key->arg[i][1];
+      if ( beg < 0 ) {
+        beg += n;
+      }
+      if ( beg < 0 || beg >= n ) {
+        return 0;
+      }
+      plan->start[i]  = beg;
+      plan->count[i]  = 1;
+      plan->stride[i] = 1;
+      break;
+    case NC_ARG_RANGE:
+      beg  = ( key->arg[i][0] & NC_ARG_BEG_NIL ) ? 0 : key->arg[i][1];
+      end  = ( key->arg[i][0] & NC_ARG_END_NIL ) ? n : key->arg[i][2];
+      step = key->arg[i][3];
+      if ( beg < 0 ) {
+        beg += n;
+      }
+      if ( ! ( key->arg[i][0] & NC_ARG_END_NIL ) && end < 0 ) {
+        end += n;
+      }
+      if ( ( key->arg[i][0] & NC_ARG_EXCL ) || 
+           ( key->arg[i][0] & NC_ARG_END_NIL ) ) {
+        end -= 1;
+      }
+      if ( beg < 0 || end >= n || end < beg ) {
+        return 0;
+      }
+      plan->start[i]  = beg;
+      plan->count[i]  = (end - beg)/step + 1;
+      plan->stride[i] = ( plan->count[i] > 1 ) ? step : 1;
+      point = 0;
+      break;
+    default:
+      return 0;
+    }
+  }
+
+  plan->type = ( point ) ? NC_PLAN_POINT : NC_PLAN_BLOCK;
+
+  return 1;
+}
+
+static int
+nc_plan_index (VALUE vshape, VALUE vindex, nc_plan_t *plan)
+{
+  nc_plan_key_t key;
+  size_t dim[CA_RANK_MAX];
+  int ndims;
+  int i;
+
+  Check_Type(vshape, T_ARRAY);
+  Check_Type(vindex, T_ARRAY);
+
+  ndims = RARRAY_LEN(vshape);
+  if ( ndims < 1 || ndims > CA_RANK_MAX ) {
+    return 0;
+  }
+  for (i=0; i<ndims; i++) {
+    dim[i] = NUM2ULONG(RARRAY_PTR(vshape)[i]);
+  }
+
+  if ( ! nc_plan_encode(ndims, dim, RARRAY_LEN(vindex), RARRAY_PTR(vindex), 
+                        &key) ) {
+    return 0;
+  }
+
+  for (i=0; i<NC_PLAN_CACHE_SIZE; i++) {
+    if ( nc_plan_cache[i].valid && 
+         memcmp(&nc_plan_cache[i].key, &key, sizeof(key)) == 0 ) {
+      *plan = nc_plan_cache[i].plan;
+      return 1;
+    }
+  }
+
+  if ( ! nc_plan_build(&key, plan) ) {
+    return 0;
+  }
+
+  i = nc_plan_cache_next;
+  nc_plan_cache[i].valid = 1;
+  nc_plan_cache[i].key   = key;
+  nc_plan_cache[i].plan  = *plan;
+  nc_plan_cache_next = (i + 1) % NC_PLAN_CACHE_SIZE;
+
+  return 1;
+}
+
+static int
+nc_plan_is_contiguous (const nc_plan_t *plan)
+{
+  int i;
+  for (i=0; i<plan->ndims; i++) {
+    if ( plan->stride[i] != 1 ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int
+nc_get_plan_numeric (int ncid, int varid, nc_type type, 
+                     const nc_plan_t *plan, void *value)
+{
+  if ( nc_plan_is_contiguous(plan) ) {
+    return nc_get_vara_blocking(ncid, varid, type, 
+                               plan->start, plan->count, value);
+  }
+  else {
+    return nc_get_vars_blocking(ncid, varid, type, plan->ndims,
+                            plan->start, plan->count, plan->stride, value);
+  }
+}
+
+static int
+nc_put_plan_numeric (int ncid, int varid, nc_type type, 
+                     const nc_plan_t *plan, void *value)
+{
+  if ( nc_plan_is_contiguous(plan) ) {
+    return nc_put_vara_numeric(ncid, varid, type, 
+                               plan->start, plan->count, value);
+  }
+  else {
+    return nc_put_vars_numeric(ncid, varid, type, 
+                               plan->start, plan->count, plan->stride, value);
+  }
+}
+
+/*
+ *  nc_get_index(fd, varid, shape, index[, opts]) => CArray | Numeric | nil
+ *
+ *  Reads the region given by CArray-style index arguments. Returns nil
+ *  if the index should be handled by CArray.scan_index.
+ *
+ *  opts :
+ *    :order => [i, j, ...]  permutes dimensions of result
+ *                           (result.dim[n] = region.dim[order[n]]),
+ *                           checked but not applied for a point index
+ *    :fill  => [v, ...]     masks elements equal to fill/missing values
+ */
+
+static VALUE
+rb_nc_get_index (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE out, vbuf, opts = Qnil, vorder = Qnil;
+  nc_fills_t fills;
+  nc_plan_t plan;
+  int status;
+  nc_type type;
+  CArray *ca;
+  ca_size_t dim[CA_RANK_MAX];
+  int order[CA_RANK_MAX];
+  int permute = 0;
+  int i;
+
+  if ( argc == 5 ) {
+    opts = argv[4];
+    argc--;
+  }
+
+  CHECK_ARGC(4);
+  CHECK_TYPE_ID(argv[0]);
+  CHECK_TYPE_ID(argv[1]);
+
+  if ( ! nc_plan_index(argv[2], argv[3], &plan) ) {
+    return Qnil;
+  }
+
+  if ( ! NIL_P(opts) ) {
+    Check_Type(opts, T_HASH);
+    vorder = rb_hash_aref(opts, ID2SYM(rb_intern("order")));
+  }
+
+  nc_scan_fills(opts, &fills);
+
+  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+
+  CHECK_STATUS(status);
+
+  /* checked for points too, though a scalar result is not permuted */
+  if ( ! NIL_P(vorder) ) {
+    permute = nc_scan_order(vorder, plan.ndims, order);
+  }
+
+  if ( plan.type == NC_PLAN_POINT ) {
+    return nc_get_var1_value(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                             type, plan.start);
+  }
+
+  for (i=0; i<plan.ndims; i++) {
+    dim[i] = ( permute ) ? plan.count[order[i]] : plan.count[i];
+  }
+
+  out = rb_carray_new(rb_nc_typemap(type), plan.ndims, dim, 0, NULL);
+  Data_Get_Struct(out, CArray, ca);
+
+  if ( permute ) {
+    vbuf = rb_str_new(NULL, ca->elements * ca->bytes);
+    status = nc_get_plan_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                                 type, &plan, RSTRING_PTR(vbuf));
+    if ( status == NC_NOERR ) {
+      nc_copy_permuted(plan.ndims, plan.count, order, ca->bytes, 
+                       RSTRING_PTR(vbuf), ca->ptr);
+      nc_mask_fills(ca, 0, ca->elements, &fills);
+    }
+  }
+  else if ( fills.n > 0 ) {
+    status = nc_get_masked(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                           type, plan.ndims, plan.start, plan.count, 
+                           nc_plan_is_contiguous(&plan) ? NULL : plan.stride,
+                           ca, &fills);
+  }
+  else {
+    status = nc_get_plan_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                                 type, &plan, ca->ptr);
+  }
+
+  CHECK_STATUS(status);
+
+  return out;
+}
+
+/*
+ *  nc_put_index(fd, varid, shape, index, value) => status | nil
+ *
+ *  Writes value to the region given by CArray-style index arguments. 
+ *  Returns nil if the index should be handled by CArray.scan_index.
+ */
+
+static VALUE
+rb_nc_put_index (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE data;
+  nc_plan_t plan;
+  int status;
+  nc_type type;
+  CArray *ca;
+  ca_size_t elements;
+  int i;
+
+  CHECK_ARGC(5);
+  CHECK_TYPE_ID(argv[0]);
+  CHECK_TYPE_ID(argv[1]);
+
+  data = argv[4];
+
+  if ( ! nc_plan_index(argv[2], argv[3], &plan) ) {
+    return Qnil;
+  }
+
+  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
+    if ( plan.type == NC_PLAN_POINT && rb_obj_is_kind_of(data, rb_cNumeric) ) {
+      float64_t val = NUM2DBL(data);
+      status = nc_put_var1_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                                   NC_DOUBLE, plan.start, &val);
+      CHECK_STATUS(status);
+      return LONG2NUM(status);
+    }
+    return Qnil;
+  }
+
+  Data_Get_Struct(data, CArray, ca);
+
+  elements = 1;
+  for (i=0; i<plan.ndims; i++) {
+    elements *= plan.count[i];
+  }
+  if ( ca->elements != elements ) {
+    rb_raise(rb_eRuntimeError, "data size mismatch (%lld for %lld)", 
+             (long long) ca->elements, (long long) elements);
+  }
+
+  type = rb_nc_rtypemap(ca->data_type);
+
+  ca_attach(ca);
+  if ( ca_has_mask(ca) ) {
+    status = nc_put_masked(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                           plan.ndims, plan.start, plan.count, 
+                           nc_plan_is_contiguous(&plan) ? NULL : plan.stride,
+                           ca);
+  }
+  else {
+    status = nc_put_plan_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
+                                 type, &plan, ca->ptr);
+  }
+  ca_detach(ca);
+
+  CHECK_STATUS(status);
+  
+  return LONG2NUM(status);
+}
+
+/*
+ *  nc_index_region(shape, index) => [start, count, stride] | nil
+ *
+ *  Returns the region nc_put_index/nc_get_index plan for the index 
+ *  arguments, or nil if the index is left to CArray.scan_index.
+ */
+
+static VALUE
+rb_nc_index_region (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE vstart, vcount, vstride;
+  nc_plan_t plan;
+  int i;
+
+  CHECK_ARGC(2);
+
+  if ( ! nc_plan_index(argv[0], argv[1], &plan) ) {
+    return Qnil;
+  }
+
+  vstart  = rb_ary_new2(plan.ndims);
+  vcount  = rb_ary_new2(plan.ndims);
+  vstride = rb_ary_new2(plan.ndims);
+  for (i=0; i<plan.ndims; i++) {
+    rb_ary_store(vstart,  i, ULONG2NUM(plan.start[i]));
+    rb_ary_store(vcount,  i, ULONG2NUM(plan.count[i]));
+    rb_ary_store(vstride, i, LONG2NUM(plan.stride[i]));
+  }
+
+  return rb_ary_new3(3, vstart, vcount, vstride);
+}
+
+/* ------------------------------------------------------------------------
+ *  streaming reduction
+ *
+ *  nc_reduce(fd, varid, op, dims[, opts]) reduces a variable over dims
+ *  without reading it as a whole. The variable is streamed in slabs of
+ *  at most opts[:budget] bytes. For each slab, fill values are skipped, 
+ *  scale_factor/add_offset are applied and the values are accumulated 
+ *  into the output cells in the same pass. Sums use compensated 
+ *  (Neumaier) summation, mean/variance use Welford's update and partial 
+ *  results of threads are combined by Chan's formula.
+ *
+ *  The slab is processed by worker threads without GVL. When a kept 
+ *  dimension spans the slab, the threads partition the slab along it and
+ *  update disjoint cells. Otherwise the whole slab belongs to one cell 
+ *  and each thread accumulates a private cell which is merged at the end.
+ * ------------------------------------------------------------------------ */
+
+#define NC_REDUCE_SUM    1
+#define NC_REDUCE_MEAN   2
+#define NC_REDUCE_MIN    3
+#define NC_REDUCE_MAX    4
+#define NC_REDUCE_VAR    5
+#define NC_REDUCE_STD    6
+#define NC_REDUCE_COUNT  7
+
+#define NC_REDUCE_FILL_MAX       8
+#define NC_REDUCE_BUDGET         (64*1024*1024)
+#define NC_REDUCE_PARALLEL_MIN   65536
+#define NC_THREADS_MAX           64
+
+typedef struct {
+  int       op;
+  int64_t  *n;
+  double   *v1;           /* sum | mean | min | max */
+  double   *v2;           /* compensation of sum | M2 */
+} nc_acc_t;
+
+typedef struct {
+  int           ndims;
+  size_t        count[CA_RANK_MAX];    /* slab shape */
+  ptrdiff_t     bstep[CA_RANK_MAX];    /* element step in slab buffer */
+  ptrdiff_t     ostep[CA_RANK_MAX];    /* cell step (0 for reduced dims) */
+  size_t        cell0;                 /* cell of slab origin */
+  const double *buf;
+  int           nfill;
+  double        fill[NC_REDUCE_FILL_MAX];
+  int           scaled;
+  double        scale, offset;
+  nc_acc_t      acc;
+} nc_reduce_slab_t;
+
+typedef struct {
+  nc_reduce_slab_t *slab;
+  int               dim;               /* partition dim, -1 for linear */
+  size_t            lo, hi;
+  nc_acc_t          acc;               /* private cell for linear */
+  int64_t           n;
+  double            v1, v2;
+} nc_reduce_task_t;
+
+static int
+nc_reduce_opcode (VALUE vop)
+{
+  const char *op;
+
+  if ( SYMBOL_P(vop) ) {
+    vop = rb_sym_to_s(vop);
+  }
+  CHECK_TYPE_STRING(vop);
+
+  op = StringValueCStr(vop);
+
+  if ( ! strcmp(op, "sum") ) {
+    return NC_REDUCE_SUM;
+  }
+  else if ( ! strcmp(op, "mean") ) {
+    return NC_REDUCE_MEAN;
+  }
+  else if ( ! strcmp(op, "min") ) {
+    return NC_REDUCE_MIN;
+  }
+  else if ( ! strcmp(op, "max") ) {
+    return NC_REDUCE_MAX;
+  }
+  else if ( ! strcmp(op, "variance") || ! strcmp(op, "var") ) {
+    return NC_REDUCE_VAR;
+  }
+  else if ( ! strcmp(op, "stddev") || ! strcmp(op, "std") ) {
+    return NC_REDUCE_STD;
+  }
+  else if ( ! strcmp(op, "count") ) {
+    return NC_REDUCE_COUNT;
+  }
+  rb_raise(rb_eArgError, "unknown reduction '%s'", op);
+}
+
+static inline void
+nc_acc_push (const nc_acc_t *acc, size_t k, double x)
+{
+  int64_t n = ++acc->n[k];
+  double d, t;
+
+  switch ( acc->op ) {
+  case NC_REDUCE_SUM:
+    t = acc->v1[k] + x;
+    if ( fabs(acc->v1[k]) >= fabs(x) ) {
+      acc->v2[k] += (acc->v1[k] - t) + x;
+    }
+    else {
+      acc->v2[k] += (x - t) + acc->v1[k];
+    }
+    acc->v1[k] = t;
+    break;
+  case NC_REDUCE_MEAN:
+    acc->v1[k] += (x - acc->v1[k]) / n;
+    break;
+  case NC_REDUCE_VAR:
+  case NC_REDUCE_STD:
+    d = x - acc->v1[k];
+    acc->v1[k] += d / n;
+    acc->v2[k] += d * (x - acc->v1[k]);
+    break;
+  case NC_REDUCE_MIN:
+    if ( n == 1 || x < acc->v1[k] ) {
+      acc->v1[k] = x;
+    }
+    break;
+  case NC_REDUCE_MAX:
+    if ( n == 1 || x > acc->v1[k] ) {
+      acc->v1[k] = x;
+    }
+    break;
+  }
+}
+
+static void
+nc_acc_merge (const nc_acc_t *dst, size_t k, const nc_acc_t *src, size_t j)
+{
+  int64_t na = dst->n[k], nb = src->n[j], n = na + nb;
+  double d, t;
+
+  if ( nb == 0 ) {
+    return;
+  }
+
+  switch ( dst->op ) {
+  case NC_REDUCE_SUM:
+    t = dst->v1[k] + src->v1[j];
+    if ( fabs(dst->v1[k]) >= fabs(src->v1[j]) ) {
+      dst->v2[k] += (dst->v1[k] - t) + src->v1[j];
+    }
+    else {
+      dst->v2[k] += (src->v1[j] - t) + dst->v1[k];
+    }
+    dst->v1[k]  = t;
+    dst->v2[k] += src->v2[j];
+    break;
+  case NC_REDUCE_MEAN:
+    dst->v1[k] += (src->v1[j] - dst->v1[k]) * ((double) nb / n);
+    break;
+  case NC_REDUCE_VAR:
+  case NC_REDUCE_STD:
+    d = src->v1[j] - dst->v1[k];
+    dst->v1[k] += d * ((double) nb / n);
+    dst->v2[k] += src->v2[j] + d * d * ((double) na * nb / n);
+    break;
+  case NC_REDUCE_MIN:
+    if ( na == 0 || src->v1[j] < dst->v1[k] ) {
+      dst->v1[k] = src->v1[j];
+    }
+    break;
+  case NC_REDUCE_MAX:
+    if ( na == 0 || src->v1[j] > dst->v1[k] ) {
+      dst->v1[k] = src->v1[j];
+    }
+    break;
+  }
+
+  dst->n[k] = n;
+}
+
+static inline int
+nc_reduce_value (const nc_reduce_slab_t *slab, double raw, double *x)
+{
+  int f;
+
+  for (f=0; f<slab->nfill; f++) {
+    if ( raw == slab->fill[f] ) {
+      return 0;
+    }
+  }
+  *x = ( slab->scaled ) ? raw * slab->scale + slab->offset : raw;
+  return 1;
+}
+
+static void *
+nc_reduce_task (void *arg)
+{
+  nc_reduce_task_t *task = (nc_reduce_task_t *) arg;
+  nc_reduce_slab_t *slab = task->slab;
+  int       ndims = slab->ndims;
+  int       last  = ndims - 1;
+  size_t    count[CA_RANK_MAX], idx[CA_RANK_MAX];
+  ptrdiff_t boff, coff;
+  double    x;
+  size_t    j;
+  int       i;
+
+  if ( task->dim < 0 ) {
+    for (j=task->lo; j<task->hi; j++) {
+      if ( nc_reduce_value(slab, slab->buf[j], &x) ) {
+        nc_acc_push(&task->acc, 0, x);
+      }
+    }
+    return NULL;
+  }
+
+  memcpy(count, slab->count, ndims * sizeof(size_t));
+  count[task->dim] = task->hi - task->lo;
+  boff = task->lo * slab->bstep[task->dim];
+  coff = slab->cell0 + task->lo * slab->ostep[task->dim];
+
+  for (i=0; i<ndims; i++) {
+    idx[i] = 0;
+  }
+
+  while ( 1 ) {
+    const double *b = slab->buf + boff;
+    ptrdiff_t os = slab->ostep[last];
+    for (j=0; j<count[last]; j++) {
+      if ( nc_reduce_value(slab, b[j], &x) ) {
+        nc_acc_push(&slab->acc, coff + j * os, x);
+      }
+    }
+    for (i=last-1; i>=0; i--) {
+      idx[i]++;
+      boff += slab->bstep[i];
+      coff += slab->ostep[i];
+      if ( idx[i] < count[i] ) {
+        break;
+      }
+      boff -= slab->bstep[i] * count[i];
+      coff -= slab->ostep[i] * count[i];
+      idx[i] = 0;
+    }
+    if ( i < 0 ) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static int
+nc_ncpus (void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return ( n > 0 ) ? (int) n : 1;
+#else
+  return 1;
+#endif
+}
+
+/* runs func on each of ntasks tasks, using a thread per task */
+
+static void
+nc_parallel_run (void *(*func)(void *), void *tasks, size_t size, int ntasks)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_t th[NC_THREADS_MAX];
+  int started[NC_THREADS_MAX];
+  int i;
+
+  for (i=1; i<ntasks; i++) {
+    started[i] = ( pthread_create(&th[i], NULL, func, 
+                                  (char *) tasks + i * size) == 0 );
+    if ( ! started[i] ) {
+      func((char *) tasks + i * size);
+    }
+  }
+  func(tasks);
+  for (i=1; i<ntasks; i++) {
+    if ( started[i] ) {
+      pthread_join(th[i], NULL);
+    }
+  }
+#else
+  int i;
+  for (i=0; i<ntasks; i++) {
+    func((char *) tasks + i * size);
+  }
+#endif
+}
+
+typedef struct {
+  nc_reduce_slab_t *slab;
+  int               nthreads;
+} nc_reduce_run_t;
+
+static void *
+nc_reduce_slab (void *arg)
+{
+  nc_reduce_run_t  *run  = (nc_reduce_run_t *) arg;
+  nc_reduce_slab_t *slab = run->slab;
+  nc_reduce_task_t  task[NC_THREADS_MAX];
+  size_t elements = 1, ext = 0, len;
+  int    ntasks = run->nthreads;
+  int    dim = -1;
+  int    i;
+
+  for (i=0; i<slab->ndims; i++) {
+    elements *= slab->count[i];
+    if ( slab->ostep[i] != 0 && slab->count[i] > ext ) {
+      ext = slab->count[i];
+      dim = i;
+    }
+  }
+
+  if ( ext < 2 ) {
+    dim = -1;
+    ext = elements;
+  }
+
+  if ( elements < NC_REDUCE_PARALLEL_MIN ) {
+    ntasks = 1;
+  }
+  if ( (size_t) ntasks > ext ) {
+    ntasks = ext;
+  }
+  if ( ntasks < 1 ) {
+    return NULL;
+  }
+
+  /* no empty trailing task (ext = 10, 8 threads -> 5 tasks of 2) */
+  len    = (ext + ntasks - 1) / ntasks;
+  ntasks = (ext + len - 1) / len;
+  for (i=0; i<ntasks; i++) {
+    task[i].slab   = slab;
+    task[i].dim    = dim;
+    task[i].lo     = i * len;
+    task[i].hi     = ( (i+1) * len < ext ) ? (i+1) * len : ext;
+    task[i].n      = 0;
+    task[i].v1     = 0.0;
+    task[i].v2     = 0.0;
+    task[i].acc.op = slab->acc.op;
+    task[i].acc.n  = &task[i].n;
+    task[i].acc.v1 = &task[i].v1;
+    task[i].acc.v2 = &task[i].v2;
+  }
+
+  nc_parallel_run(nc_reduce_task, task, sizeof(nc_reduce_task_t), ntasks);
+
+  if ( dim < 0 ) {
+    for (i=0; i<ntasks; i++) {
+      nc_acc_merge(&slab->acc, slab->cell0, &task[i].acc, 0);
+    }
+  }
+
+  return NULL;
+}
+
+static VALUE
+rb_nc_reduce (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE vdims, opts = Qnil, out, val;
+  nc_reduce_slab_t slab;
+  nc_reduce_run_t run;
+  int       status;
+  int       ncid, varid, ndims, op;
+  int       dimid[NC_MAX_VAR_DIMS];
+  int       reduce[CA_RANK_MAX];
+  size_t    start[CA_RANK_MAX], count[CA_RANK_MAX];
+  size_t    sstart[CA_RANK_MAX], scount[CA_RANK_MAX], idx[CA_RANK_MAX];
+  ptrdiff_t ostride[CA_RANK_MAX];
+  ca_size_t odim[CA_RANK_MAX];
+  size_t    budget = NC_REDUCE_BUDGET, inner, rows, ncell, k;
+  volatile VALUE vbuf, vn, vv2;
+  double   *buf;
+  int64_t  *n;
+  double   *v1 = NULL, *v2 = NULL;
+  double    ddof = 0.0;
+  int       orank, split, done, i;
+  CArray   *ca;
+
+  if ( argc == 5 ) {
+    opts = argv[4];
+    argc--;
+  }
+
+  CHECK_ARGC(4);
+  CHECK_TYPE_ID(argv[0]);
+  CHECK_TYPE_ID(argv[1]);
+  CHECK_TYPE_ARRAY(argv[3]);
+
+  ncid  = NUM2LONG(argv[0]);
+  varid = NUM2LONG(argv[1]);
+  op    = nc_reduce_opcode(argv[2]);
+  vdims = argv[3];
+
+  /* the library lock is taken only around the libnetcdf calls */
+
+  nc_lib_lock();
+  status = nc_inq_varndims(ncid, varid, &ndims);
+  if ( status == NC_NOERR && ndims >= 1 && ndims <= CA_RANK_MAX ) {
+    status = nc_inq_vardimid(ncid, varid, dimid);
+    for (i=0; i<ndims && status == NC_NOERR; i++) {
+      status = nc_inq_dimlen(ncid, dimid[i], &count[i]);
+    }
+  }
+  nc_lib_unlock();
+
+  CHECK_STATUS(status);
+
+  if ( ndims < 1 || ndims > CA_RANK_MAX ) {
+    rb_raise(rb_eRuntimeError, "can not reduce variable of rank %i", ndims);
+  }
+
+  for (i=0; i<ndims; i++) {
+    start[i]  = 0;
+    reduce[i] = 0;
+  }
+
+  for (i=0; i<RARRAY_LEN(vdims); i++) {
+    long d = NUM2LONG(RARRAY_PTR(vdims)[i]);
+    if ( d < 0 ) {
+      d += ndims;
+    }
+    if ( d < 0 || d >= ndims ) {
+      rb_raise(rb_eIndexError, "invalid dimension index %li", d);
+    }
+    reduce[d] = 1;
+  }
+
+  memset(&slab, 0, sizeof(slab));
+  slab.ndims  = ndims;
+  slab.scale  = 1.0;
+  slab.offset = 0.0;
+  run.slab     = &slab;
+  run.nthreads = nc_ncpus();
+
+  if ( ! NIL_P(opts) ) {
+    Check_Type(opts, T_HASH);
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("start")))) ) {
+      Check_Type(val, T_ARRAY);
+      for (i=0; i<ndims && i<RARRAY_LEN(val); i++) {
+        start[i] = NUM2ULONG(RARRAY_PTR(val)[i]);
+      }
+    }
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("count")))) ) {
+      Check_Type(val, T_ARRAY);
+      for (i=0; i<ndims && i<RARRAY_LEN(val); i++) {
+        count[i] = NUM2ULONG(RARRAY_PTR(val)[i]);
+      }
+    }
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("fill")))) ) {
+      val = rb_Array(val);
+      for (i=0; i<RARRAY_LEN(val); i++) {
+        if ( ! NIL_P(RARRAY_PTR(val)[i]) ) {
+          if ( slab.nfill >= NC_REDUCE_FILL_MAX ) {
+            rb_raise(rb_eArgError, "too many fill values (max %i)", 
+                     NC_REDUCE_FILL_MAX);
+          }
+          slab.fill[slab.nfill++] = NUM2DBL(RARRAY_PTR(val)[i]);
+        }
+      }
+    }
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("scale_factor")))) ) {
+      slab.scale  = NUM2DBL(val);
+      slab.scaled = 1;
+    }
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("add_offset")))) ) {
+      slab.offset = NUM2DBL(val);
+      slab.scaled = 1;
+    }
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("budget")))) ) {
+      budget = NUM2ULONG(val);
+    }
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("threads")))) ) {
+      run.nthreads = NUM2INT(val);
+    }
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("ddof")))) ) {
+      ddof = NUM2DBL(val);
+    }
+  }
+
+  if ( run.nthreads < 1 ) {
+    run.nthreads = 1;
+  }
+  if ( run.nthreads > NC_THREADS_MAX ) {
+    run.nthreads = NC_THREADS_MAX;
+  }
+
+  /* output cells */
+
+  orank = 0;
+  ncell = 1;
+  for (i=ndims-1; i>=0; i--) {
+    if ( reduce[i] ) {
+      ostride[i] = 0;
+    }
+    else {
+      ostride[i] = ncell;
+      ncell *= count[i];
+    }
+  }
+  for (i=0; i<ndims; i++) {
+    if ( ! reduce[i] ) {
+      odim[orank++] = count[i];
+    }
+  }
+  if ( orank == 0 ) {
+    odim[orank++] = 1;
+  }
+
+  if ( op == NC_REDUCE_COUNT ) {
+    out = rb_carray_new(CA_INT64, orank, odim, 0, NULL);
+    Data_Get_Struct(out, CArray, ca);
+    n = (int64_t *) ca->ptr;
+  }
+  else {
+    out = rb_carray_new(CA_FLOAT64, orank, odim, 0, NULL);
+    Data_Get_Struct(out, CArray, ca);
+    vn = rb_str_new(NULL, ncell * sizeof(int64_t));
+    n  = (int64_t *) RSTRING_PTR(vn);
+    v1 = (double *) ca->ptr;
+    if ( op == NC_REDUCE_SUM || op == NC_REDUCE_VAR || op == NC_REDUCE_STD ) {
+      vv2 = rb_str_new(NULL, ncell * sizeof(double));
+      v2  = (double *) RSTRING_PTR(vv2);
+      memset(v2, 0, ncell * sizeof(double));
+    }
+  }
+  memset(n, 0, ncell * sizeof(int64_t));
+  if ( v1 ) {
+    memset(v1, 0, ncell * sizeof(double));
+  }
+
+  slab.acc.op = op;
+  slab.acc.n  = n;
+  slab.acc.v1 = v1;
+  slab.acc.v2 = v2;
+
+  /* slab : dims before split have extent 1, dim split is chunked */
+
+  budget /= sizeof(double);
+  if ( budget < 1 ) {
+    budget = 1;
+  }
+  inner = 1;
+  for (split=ndims-1; split>0; split--) {
+    if ( inner * count[split] > budget ) {
+      break;
+    }
+    inner *= count[split];
+  }
+  rows = budget / inner;
+  if ( rows < 1 ) {
+    rows = 1;
+  }
+  if ( rows > count[split] ) {
+    rows = count[split];
+  }
+
+  vbuf = rb_str_new(NULL, rows * inner * sizeof(double));
+  buf  = (double *) RSTRING_PTR(vbuf);
+
+  slab.buf = buf;
+  done = 0;
+  for (i=0; i<ndims; i++) {
+    idx[i] = 0;
+    slab.ostep[i] = ostride[i];
+    if ( count[i] == 0 ) {
+      done = 1;
+    }
+  }
+
+  status = NC_NOERR;
+
+  while ( ! done ) {
+    size_t m = ( idx[split] + rows > count[split] ) ? 
+                                   count[split] - idx[split] : rows;
+    ptrdiff_t step = 1;
+    slab.cell0 = 0;
+    for (i=0; i<ndims; i++) {
+      sstart[i] = start[i] + idx[i];
+      scount[i] = ( i < split ) ? 1 : ( i == split ) ? m : count[i];
+      slab.cell0 += idx[i] * ostride[i];
+    }
+    for (i=ndims-1; i>=0; i--) {
+      slab.count[i] = scount[i];
+      slab.bstep[i] = step;
+      step *= scount[i];
+    }
+
+    nc_lib_lock();
+    status = nc_get_vara_double(ncid, varid, sstart, scount, buf);
+    nc_lib_unlock();
+    if ( status != NC_NOERR ) {
+      break;
+    }
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(nc_reduce_slab, &run, NULL, NULL);
+#else
+    nc_reduce_slab(&run);
+#endif
+
+    /* next slab */
+    idx[split] += m;
+    for (i=split; i>0 && idx[i] >= count[i]; i--) {
+      idx[i] = 0;
+      idx[i-1]++;
+    }
+    done = ( idx[0] >= count[0] );
+
+    rb_thread_check_ints();
+  }
+
+  /* finalize */
+
+  if ( status == NC_NOERR && op != NC_REDUCE_COUNT ) {
+    boolean8_t *mask = NULL;
+    for (k=0; k<ncell; k++) {
+      int undef = 0;
+      switch ( op ) {
+      case NC_REDUCE_SUM:
+        v1[k] += v2[k];
+        break;
+      case NC_REDUCE_VAR:
+      case NC_REDUCE_STD:
+        undef = ( n[k] - ddof <= 0 );
+        if ( ! undef ) {
+          v1[k] = v2[k] / (n[k] - ddof);
+          if ( op == NC_REDUCE_STD ) {
+            v1[k] = sqrt(v1[k]);
+          }
+        }
+        break;
+      default:
+        undef = ( n[k] == 0 );
+      }
+      if ( undef ) {
+        if ( ! mask ) {
+          ca_create_mask(ca);
+          mask = (boolean8_t *) ca->mask->ptr;
+        }
+        mask[k] = 1;
+      }
+    }
+  }
+
+  CHECK_STATUS(status);
+
+  return out;
+}
+
+/* ------------------------------------------------------------------------
+ *  coordinate index
+ *
+ *  nc_coord_scan(coords) examines the coordinate values (float64 CArray)
+ *  once and returns [direction, step], where direction is 1 (increasing),
+ *  -1 (decreasing) or 0 (not monotonic) and step is the grid interval if 
+ *  the coordinate is uniform (otherwise nil). nc_coord_locate and 
+ *  nc_coord_range look up the coordinate described by them, using 
+ *  interpolation for a uniform grid (O(1)) and binary search otherwise.
+ * ------------------------------------------------------------------------ */
+
+#define NC_LOCATE_EXACT    0
+#define NC_LOCATE_NEAREST  1
+
+#ifndef NC_COORD_TOL
+#define NC_COORD_TOL 1.0e-6
+#endif
+
+typedef struct {
+  const double *x;
+  ca_size_t n;
+  int       dir;
+  double    step;       /* grid interval (> 0) for uniform grid, else 0 */
+} nc_coord_t;
+
+/* coordinate value at j in the increasing order */
+
+static inline double
+nc_coord_at (const nc_coord_t *c, ca_size_t j)
+{
+  return ( c->dir > 0 ) ? c->x[j] : c->x[c->n-1-j];
+}
+
+/* first j in the increasing order where x(j) >= v (upper = 0) 
+   or x(j) > v (upper = 1) */
+
+#define NC_COORD_BELOW(j) \
+  ( upper ? nc_coord_at(c, j) <= v : nc_coord_at(c, j) < v )
+
+static ca_size_t
+nc_coord_bound (const nc_coord_t *c, double v, int upper)
+{
+  ca_size_t lo = 0, hi = c->n, j;
+
+  if ( c->step > 0 ) {
+    double g = (v - nc_coord_at(c, 0)) / c->step;
+    j = ( g <= 0 ) ? 0 : ( g >= (double) c->n ) ? c->n : (ca_size_t) ceil(g);
+    while ( j > 0 && ! NC_COORD_BELOW(j-1) ) {
+      j--;
+    }
+    while ( j < c->n && NC_COORD_BELOW(j) ) {
+      j++;
+    }
+    return j;
+  }
+
+  while ( lo < hi ) {
+    j = lo + (hi - lo)/2;
+    if ( NC_COORD_BELOW(j) ) {
+      lo = j + 1;
+    }
+    else {
+      hi = j;
+    }
+  }
+
+  return lo;
+}
+
+#undef NC_COORD_BELOW
+
+/* index of the coordinate value nearest to (or equal to) v, -1 if none */
+
+static ca_size_t
+nc_coord_locate (const nc_coord_t *c, double v, int mode)
+{
+  ca_size_t j;
+  double x, d;
+
+  if ( c->n == 0 || isnan(v) ) {
+    return -1;
+  }
+
+  j = nc_coord_bound(c, v, 0);
+  if ( j == c->n || 
+       ( j > 0 && v - nc_coord_at(c, j-1) <= nc_coord_at(c, j) - v ) ) {
+    j--;
+  }
+
+  if ( mode == NC_LOCATE_EXACT ) {
+    x = nc_coord_at(c, j);
+    if ( c->n > 1 ) {
+      d = ( j > 0 ) ? x - nc_coord_at(c, j-1) : nc_coord_at(c, 1) - x;
+    }
+    else {
+      d = fabs(x);
+    }
+    if ( fabs(x - v) > NC_COORD_TOL * d ) {
+      return -1;
+    }
+  }
+
+  return ( c->dir > 0 ) ? j : c->n - 1 - j;
+}
+
+static CArray *
+nc_coord_setup (VALUE vcoord, VALUE vdir, VALUE vstep, nc_coord_t *c)
+{
+  CArray *ca;
+
+  CHECK_TYPE_DATA(vcoord);
+  Data_Get_Struct(vcoord, CArray, ca);
+
+  if ( ca->data_type != CA_FLOAT64 ) {
+    rb_raise(rb_eRuntimeError, "coordinate must be a float64 CArray");
+  }
+
+  c->n    = ca->elements;
+  c->dir  = NUM2INT(vdir);
+  c->step = NIL_P(vstep) ? 0.0 : fabs(NUM2DBL(vstep));
+
+  if ( c->dir == 0 ) {
+    rb_raise(rb_eRuntimeError, "coordinate is not monotonic");
+  }
+
+  return ca;
+}
+
+static VALUE
+rb_nc_coord_scan (int argc, VALUE *argv, VALUE mod)
+{
+  CArray *ca;
+  double *x, step = 0.0;
+  ca_size_t n, i;
+  int dir = 1, uniform;
+
+  CHECK_ARGC(1);
+  CHECK_TYPE_DATA(argv[0]);
+
+  Data_Get_Struct(argv[0], CArray, ca);
+
+  if ( ca->data_type != CA_FLOAT64 ) {
+    rb_raise(rb_eRuntimeError, "coordinate must be a float64 CArray");
+  }
+
+  ca_attach(ca);
+
+  x = (double *) ca->ptr;
+  n = ca->elements;
+
+  if ( n > 1 ) {
+    dir = ( x[1] < x[0] ) ? -1 : 1;
+  }
+  for (i=1; dir && i<n; i++) {
+    if ( ! ( dir * (x[i] - x[i-1]) > 0 ) ) {
+      dir = 0;
+    }
+  }
+
+  uniform = ( dir != 0 && n > 1 );
+  if ( uniform ) {
+    step = (x[n-1] - x[0])/(n-1);
+  }
+  for (i=0; uniform && i<n; i++) {
+    if ( fabs(x[0] + i*step - x[i]) > NC_COORD_TOL * fabs(step) ) {
+      uniform = 0;
+    }
+  }
+
+  ca_detach(ca);
+
+  return rb_assoc_new(INT2NUM(dir), uniform ? rb_float_new(step) : Qnil);
+}
+
+/* nc_coord_locate(coords, dir, step, values, mode) 
+     values : Numeric => Integer (nil if not found) 
+              float64 CArray => int64 CArray (-1 if not found) */
+
+static VALUE
+rb_nc_coord_locate (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE out;
+  nc_coord_t coord;
+  CArray *ca, *cv, *co;
+  ca_size_t i;
+  int mode;
+
+  CHECK_ARGC(5);
+
+  ca   = nc_coord_setup(argv[0], argv[1], argv[2], &coord);
+  mode = NUM2INT(argv[4]);
+
+  if ( rb_obj_is_kind_of(argv[3], rb_cNumeric) ) {
+    ca_attach(ca);
+    coord.x = (double *) ca->ptr;
+    i = nc_coord_locate(&coord, NUM2DBL(argv[3]), mode);
+    ca_detach(ca);
+    return ( i < 0 ) ? Qnil : LONG2NUM(i);
+  }
+
+  CHECK_TYPE_DATA(argv[3]);
+  Data_Get_Struct(argv[3], CArray, cv);
+
+  if ( cv->data_type != CA_FLOAT64 ) {
+    rb_raise(rb_eRuntimeError, "values must be a float64 CArray");
+  }
+
+  out = rb_carray_new(CA_INT64, cv->rank, cv->dim, 0, NULL);
+  Data_Get_Struct(out, CArray, co);
+
+  ca_attach(ca);
+  ca_attach(cv);
+  coord.x = (double *) ca->ptr;
+  for (i=0; i<cv->elements; i++) {
+    ((int64_t *) co->ptr)[i] = 
+               nc_coord_locate(&coord, ((double *) cv->ptr)[i], mode);
+  }
+  ca_detach(cv);
+  ca_detach(ca);
+
+  return out;
+}
+
+/* nc_coord_range(coords, dir, step, lo, hi[, exclude_end]) 
+     => [first, last] of the indices of the coordinate values in lo..hi
+        (nil if none) */
+
+static VALUE
+rb_nc_coord_range (int argc, VALUE *argv, VALUE mod)
+{
+  nc_coord_t coord;
+  CArray *ca;
+  double lo, hi;
+  ca_size_t a, b;
+  int excl = 0;
+
+  if ( argc == 6 ) {
+    excl = RTEST(argv[5]);
+    argc--;
+  }
+
+  CHECK_ARGC(5);
+  CHECK_TYPE_NUMERIC(argv[3]);
+  CHECK_TYPE_NUMERIC(argv[4]);
+
+  ca = nc_coord_setup(argv[0], argv[1], argv[2], &coord);
+  lo = NUM2DBL(argv[3]);
+  hi = NUM2DBL(argv[4]);
 
-  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-    rb_raise(rb_eTypeError, "arg3 must be a CArray object");
+  if ( coord.n == 0 || isnan(lo) || isnan(hi) ) {
+    return Qnil;
   }
 
-  Data_Get_Struct(data, CArray, ca);
-
-  type = rb_nc_rtypemap(ca->data_type);
   ca_attach(ca);
-  status = nc_put_var_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			      type, ca->ptr);
+  coord.x = (double *) ca->ptr;
+  a = nc_coord_bound(&coord, lo, 0);
+  b = nc_coord_bound(&coord, hi, ! excl) - 1;
   ca_detach(ca);
 
-  CHECK_STATUS(status);
-  
-  return LONG2NUM(status);
+  if ( a > b ) {
+    return Qnil;
+  }
+
+  if ( coord.dir < 0 ) {
+    ca_size_t t = a;
+    a = coord.n - 1 - b;
+    b = coord.n - 1 - t;
+  }
+
+  return rb_assoc_new(LONG2NUM(a), LONG2NUM(b));
 }
 
-static VALUE
-rb_nc_get_vara (int argc, VALUE *argv, VALUE mod)
+/* ------------------------------------------------------------------------
+ *  spatial index for curvilinear grids
+ *
+ *  nc_kdtree_build(lat, lon) converts 2D coordinate values (degrees) into
+ *  unit vectors and builds an implicit KD-tree over them. The tree is an
+ *  int64 CArray holding a permutation of the valid grid points, in which
+ *  the median along axis (depth % 3) of each subrange sits at its middle.
+ *  nc_kdtree_query(xyz, tree, lats, lons) finds the nearest grid points 
+ *  of all query points at once. Chord distance between unit vectors is 
+ *  monotonic with great-circle distance, so the poles and the dateline 
+ *  need no special care.
+ * ------------------------------------------------------------------------ */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define NC_KD_PARALLEL_MIN 4096
+
+typedef struct {
+  const double  *xyz;
+  const int64_t *perm;
+} nc_kdtree_t;
+
+typedef struct {
+  const nc_kdtree_t *tree;
+  ca_size_t      n;
+  const double  *lat, *lon;
+  int64_t       *out;
+  ca_size_t      first, last;
+} nc_kd_task_t;
+
+typedef struct {
+  nc_kd_task_t  *task;
+  int            ntasks;
+} nc_kd_run_t;
+
+static void
+nc_latlon_xyz (double lat, double lon, double *p)
 {
-  int status;
-  nc_type type;
-  int ndims;
-  int dimid[NC_MAX_DIMS];
-  size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
-  int i;
+  double rlat = lat * M_PI / 180.0, rlon = lon * M_PI / 180.0;
+  p[0] = cos(rlat) * cos(rlon);
+  p[1] = cos(rlat) * sin(rlon);
+  p[2] = sin(rlat);
+}
 
-  if ( argc < 4 ) {
-    rb_raise(rb_eArgError, "invalid # of arguments");
+/* places the k-th smallest point along axis in perm[lo..hi) at k */
+
+static void
+nc_kd_select (int64_t *perm, const double *xyz, int axis, 
+              ca_size_t lo, ca_size_t hi, ca_size_t k)
+{
+  ca_size_t i, j;
+  int64_t   t;
+  double    pivot;
+
+  while ( hi - lo > 1 ) {
+    pivot = xyz[3*perm[lo + (hi - lo)/2] + axis];
+    i = lo;
+    j = hi - 1;
+    while ( i <= j ) {
+      while ( xyz[3*perm[i] + axis] < pivot ) {
+        i++;
+      }
+      while ( xyz[3*perm[j] + axis] > pivot ) {
+        j--;
+      }
+      if ( i <= j ) {
+        t = perm[i]; perm[i] = perm[j]; perm[j] = t;
+        i++;
+        j--;
+      }
+    }
+    if ( k <= j ) {
+      hi = j + 1;
+    }
+    else if ( k >= i ) {
+      lo = i;
+    }
+    else {
+      return;
+    }
   }
-  
-  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
+}
 
-  CHECK_STATUS(status);
+static void
+nc_kd_build (int64_t *perm, const double *xyz, 
+             ca_size_t lo, ca_size_t hi, int depth)
+{
+  ca_size_t mid;
+
+  while ( hi - lo > 1 ) {
+    mid = lo + (hi - lo)/2;
+    nc_kd_select(perm, xyz, depth % 3, lo, hi, mid);
+    nc_kd_build(perm, xyz, lo, mid, depth + 1);
+    lo = mid + 1;
+    depth++;
+  }
+}
 
-  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+static void
+nc_kd_nearest (const nc_kdtree_t *t, const double *q, 
+               ca_size_t lo, ca_size_t hi, int depth,
+               int64_t *best, double *dbest)
+{
+  const double *p;
+  ca_size_t mid;
+  double dx, dy, dz, d, diff;
+
+  while ( lo < hi ) {
+    mid  = lo + (hi - lo)/2;
+    p    = t->xyz + 3*t->perm[mid];
+    dx   = q[0] - p[0];
+    dy   = q[1] - p[1];
+    dz   = q[2] - p[2];
+    d    = dx*dx + dy*dy + dz*dz;
+    diff = q[depth % 3] - p[depth % 3];
+    if ( d < *dbest ) {
+      *dbest = d;
+      *best  = t->perm[mid];
+    }
+    /* nearer side first, the other side only if the splitting plane 
+       is closer than the best so far */
+    if ( diff < 0 ) {
+      nc_kd_nearest(t, q, lo, mid, depth + 1, best, dbest);
+      lo = mid + 1;
+    }
+    else {
+      nc_kd_nearest(t, q, mid + 1, hi, depth + 1, best, dbest);
+      hi = mid;
+    }
+    if ( diff * diff >= *dbest ) {
+      return;
+    }
+    depth++;
+  }
+}
 
-  CHECK_STATUS(status);
+static void *
+nc_kd_query_task (void *arg)
+{
+  nc_kd_task_t *task = (nc_kd_task_t *) arg;
+  double q[3], dbest;
+  int64_t best;
+  ca_size_t k;
+
+  for (k=task->first; k<task->last; k++) {
+    best = -1;
+    if ( isfinite(task->lat[k]) && isfinite(task->lon[k]) ) {
+      nc_latlon_xyz(task->lat[k], task->lon[k], q);
+      dbest = HUGE_VAL;
+      nc_kd_nearest(task->tree, q, 0, task->n, 0, &best, &dbest);
+    }
+    task->out[k] = best;
+  }
 
-  status = nc_inq_vardimid(NUM2LONG(argv[0]), NUM2LONG(argv[1]), dimid);
+  return NULL;
+}
 
-  CHECK_STATUS(status);
+static void *
+nc_kd_query_run (void *arg)
+{
+  nc_kd_run_t *run = (nc_kd_run_t *) arg;
+  nc_parallel_run(nc_kd_query_task, run->task, sizeof(nc_kd_task_t), 
+                  run->ntasks);
+  return NULL;
+}
 
-  Check_Type(argv[2], T_ARRAY);
-  Check_Type(argv[3], T_ARRAY);
+static CArray *
+nc_kd_float64 (VALUE obj, const char *name)
+{
+  CArray *ca;
 
-  for (i=0; i<ndims; i++) {
-    start[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
-    count[i] = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+  CHECK_TYPE_DATA(obj);
+  Data_Get_Struct(obj, CArray, ca);
+  if ( ca->data_type != CA_FLOAT64 ) {
+    rb_raise(rb_eRuntimeError, "%s must be a float64 CArray", name);
   }
 
-  if ( argc == 4 ) {
-    volatile VALUE out;
-    CArray *ca;
-    int8_t rank, data_type;
-    ca_size_t dim[CA_RANK_MAX];
-    int i;
+  return ca;
+}
 
-    data_type = rb_nc_typemap (type);
-    rank = ndims;
-    for (i=0; i<rank; i++) {
-      dim[i] = count[i];
-    }
+/* nc_kdtree_build(lat, lon) => [xyz, tree] */
 
-    out = rb_carray_new(data_type, rank, dim, 0, NULL);
-    Data_Get_Struct(out, CArray, ca);
+static VALUE
+rb_nc_kdtree_build (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE vxyz, vtree;
+  CArray *clat, *clon, *cxyz, *ctree;
+  ca_size_t dim[2], i, n, nvalid = 0;
+  double *lat, *lon, *xyz;
+  int64_t *perm;
 
-    status = nc_get_vara_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-				 type, start, count, ca->ptr);
+  CHECK_ARGC(2);
 
-    CHECK_STATUS(status);
-  
-    return out;
+  clat = nc_kd_float64(argv[0], "lat");
+  clon = nc_kd_float64(argv[1], "lon");
+
+  if ( clat->elements != clon->elements ) {
+    rb_raise(rb_eRuntimeError, "lat and lon differ in size");
   }
-  else {
-    volatile VALUE data = argv[4];
-    CArray *ca;
 
-    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-      rb_raise(rb_eTypeError, "arg5 must be a CArray object");
-    }
-    Data_Get_Struct(data, CArray, ca);
+  n      = clat->elements;
+  dim[0] = n;
+  dim[1] = 3;
+  vxyz = rb_carray_new(CA_FLOAT64, 2, dim, 0, NULL);
+  Data_Get_Struct(vxyz, CArray, cxyz);
 
-    if ( ca->rank != ndims ) {
-      rb_raise(rb_eRuntimeError, "rank mismatch");
+  ca_attach(clat);
+  ca_attach(clon);
+
+  lat  = (double *) clat->ptr;
+  lon  = (double *) clon->ptr;
+  xyz  = (double *) cxyz->ptr;
+
+  /* points with invalid coordinates (NaN) are left out of the tree */
+
+  for (i=0; i<n; i++) {
+    if ( isfinite(lat[i]) && isfinite(lon[i]) ) {
+      nc_latlon_xyz(lat[i], lon[i], xyz + 3*i);
+      nvalid++;
+    }
+    else {
+      xyz[3*i] = xyz[3*i+1] = xyz[3*i+2] = 0.0;
     }
+  }
 
-    for (i=0; i<ca->rank; i++) {
-      if ( ca->dim[i] != count[i] ) {
-	rb_raise(rb_eRuntimeError, "dim[%i] mismatch", i);
-      }
+  dim[0] = nvalid;
+  vtree = rb_carray_new(CA_INT64, 1, dim, 0, NULL);
+  Data_Get_Struct(vtree, CArray, ctree);
+  perm = (int64_t *) ctree->ptr;
+
+  nvalid = 0;
+  for (i=0; i<n; i++) {
+    if ( isfinite(lat[i]) && isfinite(lon[i]) ) {
+      perm[nvalid++] = i;
     }
+  }
 
-    type = rb_nc_rtypemap(ca->data_type);
+  ca_detach(clon);
+  ca_detach(clat);
 
-    ca_attach(ca);
-    status = nc_get_vara_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			       type, start, count, ca->ptr);
-    ca_sync(ca);
-    ca_detach(ca);
+  nc_kd_build(perm, xyz, 0, nvalid, 0);
 
-    CHECK_STATUS(status);
-  
-    return LONG2NUM(status);
-  }
+  return rb_assoc_new(vxyz, vtree);
 }
 
+/* nc_kdtree_query(xyz, tree, lats, lons[, threads])
+     => int64 CArray of flat grid indices (-1 for invalid query point) */
+
 static VALUE
-rb_nc_put_vara (int argc, VALUE *argv, VALUE mod)
+rb_nc_kdtree_query (int argc, VALUE *argv, VALUE mod)
 {
-  volatile VALUE data;
-  int status;
-  nc_type type;
-  int ndims;
-  size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
-  CArray *ca;
-  int i;
-
-  CHECK_ARGC(5);
+  volatile VALUE out;
+  nc_kdtree_t  tree;
+  nc_kd_task_t task[NC_THREADS_MAX];
+  nc_kd_run_t  run;
+  CArray *cxyz, *ctree, *clat, *clon, *co;
+  ca_size_t nq, per;
+  int ntasks, i;
 
-  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+  if ( argc == 5 ) {
+    ntasks = NUM2INT(argv[4]);
+    argc--;
+  }
+  else {
+    ntasks = nc_ncpus();
+  }
 
-  CHECK_STATUS(status);
+  CHECK_ARGC(4);
 
-  Check_Type(argv[2], T_ARRAY);
-  Check_Type(argv[3], T_ARRAY);
+  cxyz = nc_kd_float64(argv[0], "xyz");
+  CHECK_TYPE_DATA(argv[1]);
+  Data_Get_Struct(argv[1], CArray, ctree);
+  if ( ctree->data_type != CA_INT64 ) {
+    rb_raise(rb_eRuntimeError, "tree must be an int64 CArray");
+  }
+  clat = nc_kd_float64(argv[2], "lats");
+  clon = nc_kd_float64(argv[3], "lons");
 
-  for (i=0; i<ndims; i++) {
-    start[i] = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
-    count[i] = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
+  if ( clat->elements != clon->elements ) {
+    rb_raise(rb_eRuntimeError, "lats and lons differ in size");
   }
 
-  data = argv[4];
+  nq = clat->elements;
+  out = rb_carray_new(CA_INT64, clat->rank, clat->dim, 0, NULL);
+  Data_Get_Struct(out, CArray, co);
 
-  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-    rb_raise(rb_eTypeError, "arg5 must be a CArray object");
+  if ( nq < NC_KD_PARALLEL_MIN || ntasks < 1 ) {
+    ntasks = 1;
+  }
+  if ( ntasks > NC_THREADS_MAX ) {
+    ntasks = NC_THREADS_MAX;
   }
 
-  Data_Get_Struct(data, CArray, ca);
+  ca_attach(cxyz);
+  ca_attach(ctree);
+  ca_attach(clat);
+  ca_attach(clon);
+
+  tree.xyz  = (double *) cxyz->ptr;
+  tree.perm = (int64_t *) ctree->ptr;
+
+  per = (nq + ntasks - 1) / ntasks;
+  for (i=0; i<ntasks; i++) {
+    task[i].tree  = &tree;
+    task[i].n     = ctree->elements;
+    task[i].lat   = (double *) clat->ptr;
+    task[i].lon   = (double *) clon->ptr;
+    task[i].out   = (int64_t *) co->ptr;
+    task[i].first = ( i * per < nq ) ? i * per : nq;
+    task[i].last  = ( (i + 1) * per < nq ) ? (i + 1) * per : nq;
+  }
+  run.task   = task;
+  run.ntasks = ntasks;
 
-  type = rb_nc_rtypemap(ca->data_type);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(nc_kd_query_run, &run, NULL, NULL);
+#else
+  nc_kd_query_run(&run);
+#endif
 
-  ca_attach(ca);
-  status = nc_put_vara_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			       type, start, count, ca->ptr);
-  ca_detach(ca);
+  ca_detach(clon);
+  ca_detach(clat);
+  ca_detach(ctree);
+  ca_detach(cxyz);
 
-  CHECK_STATUS(status);
-  
-  return LONG2NUM(status);
+  return out;
+}
+
+/* ------------------------------------------------------------------------
+ *  multi-point time series
+ *
+ *  nc_timeseries(fd, varid, points, start, count[, opts]) extracts the time
+ *  series at many points of a variable (record, ...) for the records 
+ *  start...start+count. points are int64 flat addresses over the non-record
+ *  dimensions. Each record is read once: the block covering all the points
+ *  is read for as many records as fit in opts[:budget] bytes (default 
+ *  64 MiB) by one nc_get_vara, and the values are scattered into the 
+ *  [npoints, count] output (type of the variable, not decoded) by 
+ *  opts[:threads] worker threads. libnetcdf reads are serialized by the 
+ *  library lock, so only the scatter runs in parallel.
+ * ------------------------------------------------------------------------ */
+
+#define NC_TIMESERIES_BUDGET   (64*1024*1024)
+#define NC_TIMESERIES_PARALLEL_MIN  65536
+
+typedef struct {
+  const char *buf;          /* [nrec, block] */
+  char       *out;          /* [npoints, ntime] */
+  const size_t *boff;       /* offsets of points in block */
+  size_t      block;        /* elements of block */
+  size_t      nrec;
+  size_t      t0;           /* record of buf[0] in out */
+  size_t      ntime;
+  size_t      elsize;
+  size_t      first, last;  /* range of points */
+} nc_ts_task_t;
+
+typedef struct {
+  nc_ts_task_t *task;
+  int           ntasks;
+} nc_ts_run_t;
+
+static void *
+nc_ts_scatter_task (void *arg)
+{
+  nc_ts_task_t *task = (nc_ts_task_t *) arg;
+  size_t es = task->elsize, p, i;
+  const char *src;
+  char *dst;
+
+  for (p=task->first; p<task->last; p++) {
+    src = task->buf + task->boff[p] * es;
+    dst = task->out + ( p * task->ntime + task->t0 ) * es;
+    for (i=0; i<task->nrec; i++) {
+      memcpy(dst, src, es);
+      src += task->block * es;
+      dst += es;
+    }
+  }
+
+  return NULL;
+}
+
+static void *
+nc_ts_scatter_run (void *arg)
+{
+  nc_ts_run_t *run = (nc_ts_run_t *) arg;
+  nc_parallel_run(nc_ts_scatter_task, run->task, sizeof(nc_ts_task_t), 
+                  run->ntasks);
+  return NULL;
 }
 
 static VALUE
-rb_nc_get_vars (int argc, VALUE *argv, VALUE mod)
+rb_nc_timeseries (int argc, VALUE *argv, VALUE mod)
 {
-  int status;
-  nc_type type;
-  int ndims;
-  int dimid[NC_MAX_DIMS];
+  volatile VALUE opts = Qnil, val, out, voff, vbuf;
+  nc_ts_task_t task[NC_THREADS_MAX];
+  nc_ts_run_t  run;
+  CArray *cp, *co;
+  int ncid, varid, ndims, dimid[NC_MAX_DIMS], ntasks = nc_ncpus();
+  size_t dim[NC_MAX_DIMS], lo[NC_MAX_DIMS], hi[NC_MAX_DIMS];
   size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
-  ptrdiff_t stride[NC_MAX_DIMS];
-  CArray *ca;
-  int i;
+  size_t budget = NC_TIMESERIES_BUDGET, tstart, ntime, npoints;
+  size_t inner, block, elsize, nrec, t, p, per, *boff;
+  ca_size_t odim[2];
+  int64_t *addr, a;
+  nc_type type;
+  int status = NC_NOERR, d, i;
 
-  if ( argc < 5 ) {
-    rb_raise(rb_eArgError, "invalid # of arguments");
+  if ( argc == 6 ) {
+    opts = argv[5];
+    argc--;
   }
-  
-  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
 
-  CHECK_STATUS(status);
+  CHECK_ARGC(5);
+  CHECK_TYPE_ID(argv[0]);
+  CHECK_TYPE_ID(argv[1]);
+  CHECK_TYPE_DATA(argv[2]);
 
-  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+  ncid   = NUM2INT(argv[0]);
+  varid  = NUM2INT(argv[1]);
+  tstart = NUM2SIZET(argv[3]);
+  ntime  = NUM2SIZET(argv[4]);
 
-  CHECK_STATUS(status);
+  if ( ! NIL_P(opts) ) {
+    Check_Type(opts, T_HASH);
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("budget")))) ) {
+      budget = NUM2SIZET(val);
+    }
+    if ( ! NIL_P(val = rb_hash_aref(opts, ID2SYM(rb_intern("threads")))) ) {
+      ntasks = NUM2INT(val);
+    }
+  }
 
-  status = nc_inq_vardimid(NUM2LONG(argv[0]), NUM2LONG(argv[1]), dimid);
+  Data_Get_Struct(argv[2], CArray, cp);
+  if ( cp->data_type != CA_INT64 ) {
+    rb_raise(rb_eRuntimeError, "points must be an int64 CArray");
+  }
+  npoints = cp->elements;
 
+  status = nc_inq_varndims(ncid, varid, &ndims);
+  CHECK_STATUS(status);
+  if ( ndims < 2 ) {
+    rb_raise(rb_eRuntimeError, "variable of rank >= 2 required");
+  }
+  status = nc_inq_vardimid(ncid, varid, dimid);
+  CHECK_STATUS(status);
+  inner = 1;
+  for (d=0; d<ndims; d++) {
+    status = nc_inq_dimlen(ncid, dimid[d], &dim[d]);
+    CHECK_STATUS(status);
+    if ( d > 0 ) {
+      inner *= dim[d];
+    }
+  }
+  if ( tstart + ntime > dim[0] ) {
+    rb_raise(rb_eRuntimeError, "records out of range");
+  }
+  status = nc_inq_vartype(ncid, varid, &type);
   CHECK_STATUS(status);
+  elsize = nc_type_size(type);
 
-  Check_Type(argv[2], T_ARRAY);
-  Check_Type(argv[3], T_ARRAY);
-  Check_Type(argv[4], T_ARRAY);
+  odim[0] = npoints;
+  odim[1] = ntime;
+  out = rb_carray_new(rb_nc_typemap(type), 2, odim, 0, NULL);
+  Data_Get_Struct(out, CArray, co);
 
-  for (i=0; i<ndims; i++) {
-    start[i]  = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
-    count[i]  = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
-    stride[i] = NUM2ULONG(RARRAY_PTR(argv[4])[i]);
+  if ( npoints == 0 || ntime == 0 ) {
+    return out;
   }
 
-  if ( argc == 5 ) {
-    volatile VALUE out;
-    CArray *ca;
-    int8_t rank, data_type;
-    ca_size_t dim[CA_RANK_MAX];
-    int i;
+  /* block covering the points */
 
-    data_type = rb_nc_typemap (type);
-    rank = ndims;
-    for (i=0; i<rank; i++) {
-      dim[i] = count[i];
+  ca_attach(cp);
+  addr = (int64_t *) cp->ptr;
+  for (d=1; d<ndims; d++) {
+    lo[d] = dim[d];
+    hi[d] = 0;
+  }
+  for (p=0; p<npoints; p++) {
+    if ( addr[p] < 0 || (size_t) addr[p] >= inner ) {
+      ca_detach(cp);
+      rb_raise(rb_eIndexError, "point %zu out of range", p);
+    }
+    a = addr[p];
+    for (d=ndims-1; d>=1; d--) {
+      size_t k = a % dim[d];
+      a /= dim[d];
+      if ( k < lo[d] ) lo[d] = k;
+      if ( k > hi[d] ) hi[d] = k;
     }
+  }
 
-    out = rb_carray_new(data_type, rank, dim, 0, NULL);
-    Data_Get_Struct(out, CArray, ca);
+  block = 1;
+  for (d=1; d<ndims; d++) {
+    start[d] = lo[d];
+    count[d] = hi[d] - lo[d] + 1;
+    block   *= count[d];
+  }
+
+  voff = rb_str_new(NULL, sizeof(size_t) * npoints);
+  boff = (size_t *) RSTRING_PTR(voff);
+  for (p=0; p<npoints; p++) {
+    size_t o = 0, mul = 1;
+    a = addr[p];
+    for (d=ndims-1; d>=1; d--) {
+      o   += ( a % dim[d] - lo[d] ) * mul;
+      mul *= count[d];
+      a   /= dim[d];
+    }
+    boff[p] = o;
+  }
+  ca_detach(cp);
 
-    status = nc_get_vars_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-				 type, start, count, stride, ca->ptr);
+  /* records read at once */
 
-    CHECK_STATUS(status);
-  
-    return out;
+  nrec = budget / ( block * elsize );
+  if ( nrec < 1 ) {
+    nrec = 1;
   }
-  else {
-    volatile VALUE data = argv[5];
-    int i;
+  if ( nrec > ntime ) {
+    nrec = ntime;
+  }
+  vbuf = rb_str_new(NULL, nrec * block * elsize);
 
-    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-      rb_raise(rb_eTypeError, "arg6 must be a CArray object");
+  if ( ntasks < 1 || npoints * nrec < NC_TIMESERIES_PARALLEL_MIN ) {
+    ntasks = 1;
+  }
+  if ( ntasks > NC_THREADS_MAX ) {
+    ntasks = NC_THREADS_MAX;
+  }
+  if ( (size_t) ntasks > npoints ) {
+    ntasks = npoints;
+  }
+  per = ( npoints + ntasks - 1 ) / ntasks;
+
+  for (t=0; t<ntime; t+=nrec) {
+    if ( t + nrec > ntime ) {
+      nrec = ntime - t;
+    }
+    start[0] = tstart + t;
+    count[0] = nrec;
+    status = nc_get_vara_blocking(ncid, varid, type, start, count, 
+                                  RSTRING_PTR(vbuf));
+    if ( status != NC_NOERR ) {
+      break;
+    }
+    for (i=0; i<ntasks; i++) {
+      task[i].buf    = RSTRING_PTR(vbuf);
+      task[i].out    = co->ptr;
+      task[i].boff   = boff;
+      task[i].block  = block;
+      task[i].nrec   = nrec;
+      task[i].t0     = t;
+      task[i].ntime  = ntime;
+      task[i].elsize = elsize;
+      task[i].first  = ( i * per < npoints ) ? i * per : npoints;
+      task[i].last   = ( (i + 1) * per < npoints ) ? (i + 1) * per : npoints;
     }
+    run.task   = task;
+    run.ntasks = ntasks;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if ( ntasks > 1 ) {
+      rb_thread_call_without_gvl(nc_ts_scatter_run, &run, NULL, NULL);
+    }
+    else {
+      nc_ts_scatter_run(&run);
+    }
+#else
+    nc_ts_scatter_run(&run);
+#endif
+  }
+
+  CHECK_STATUS(status);
+
+  return out;
+}
+
+/* ------------------------------------------------------------------------
+ *  CF time coordinate
+ *
+ *  nc_cf_time_decode(values, units[, calendar]) converts the values of 
+ *  a time coordinate variable ("<unit> since <reference time>") into 
+ *  int64 nanoseconds since 1970-01-01 00:00:00 of the calendar in one
+ *  pass. The units and calendar are parsed once per call.
+ *  nc_cf_time_fields(ns[, calendar]) breaks them down into 
+ *  [year, month, day, hour, minute, second], and nc_cf_time_encode 
+ *  converts such fields back into a value of the time coordinate.
+ *
+ *  calendars : standard (gregorian; julian before 1582-10-15), 
+ *              proleptic_gregorian, julian, noleap (365_day), 
+ *              all_leap (366_day), 360_day
+ * ------------------------------------------------------------------------ */
+
+#define NC_CAL_STANDARD     0
+#define NC_CAL_PROLEPTIC    1
+#define NC_CAL_JULIAN       2
+#define NC_CAL_NOLEAP       3
+#define NC_CAL_ALL_LEAP     4
+#define NC_CAL_360_DAY      5
+
+#define NC_NS_PER_SEC       INT64_C(1000000000)
+#define NC_NS_PER_DAY       (INT64_C(86400) * NC_NS_PER_SEC)
+
+/* days of 1582-10-15 since 1970-01-01 (gregorian) */
+#define NC_GREGORIAN_START  INT64_C(-141427)
+
+typedef struct {
+  int64_t unit;         /* nanoseconds per unit */
+  int64_t ref;          /* reference time in nanoseconds since epoch */
+  int     calendar;
+} nc_cftime_t;
+
+static const int nc_month_days[2][13] = {
+  { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365 },
+  { 0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335, 366 },
+};
+
+static inline int64_t
+nc_floor_div (int64_t a, int64_t b)
+{
+  int64_t q = a / b;
+  return ( (a % b) != 0 && ((a < 0) != (b < 0)) ) ? q - 1 : q;
+}
+
+/* days since 1970-01-01 of the year counted from March 
+   (leap day at the end of the year) */
+
+static int64_t
+nc_days_gregorian (int64_t y, int m, int d)
+{
+  int64_t era, yoe, doy, doe;
+  y  -= ( m <= 2 );
+  era = nc_floor_div(y, 400);
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2)/5 + d - 1;
+  doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static void
+nc_civil_gregorian (int64_t z, int64_t *y, int *m, int *d)
+{
+  int64_t era, doe, yoe, doy, mp;
+  z  += 719468;
+  era = nc_floor_div(z, 146097);
+  doe = z - era * 146097;
+  yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+  doy = doe - (365 * yoe + yoe/4 - yoe/100);
+  mp  = (5 * doy + 2)/153;
+  *d  = (int) (doy - (153 * mp + 2)/5 + 1);
+  *m  = (int) ( mp < 10 ? mp + 3 : mp - 9 );
+  *y  = yoe + era * 400 + ( *m <= 2 );
+}
 
-    Data_Get_Struct(data, CArray, ca);
+/* julian calendar (1969-12-19 julian is 1970-01-01 gregorian) */
 
-    if ( ca->rank != ndims ) {
-      rb_raise(rb_eRuntimeError, "rank mismatch");
-    }
+#define NC_JULIAN_EPOCH  INT64_C(719470)
 
-    for (i=0; i<ca->rank; i++) {
-      if ( ca->dim[i] != count[i] ) {
-	rb_raise(rb_eRuntimeError, "dim[%i] mismatch", i);
-      }
-    }
+static int64_t
+nc_days_julian (int64_t y, int m, int d)
+{
+  int64_t era, yoe, doy;
+  y  -= ( m <= 2 );
+  era = nc_floor_div(y, 4);
+  yoe = y - era * 4;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2)/5 + d - 1;
+  return era * 1461 + yoe * 365 + doy - NC_JULIAN_EPOCH;
+}
 
-    type = rb_nc_rtypemap(ca->data_type);
+static void
+nc_civil_julian (int64_t z, int64_t *y, int *m, int *d)
+{
+  int64_t era, doe, yoe, doy, mp;
+  z  += NC_JULIAN_EPOCH;
+  era = nc_floor_div(z, 1461);
+  doe = z - era * 1461;
+  yoe = (doe - doe/1460) / 365;
+  doy = doe - 365 * yoe;
+  mp  = (5 * doy + 2)/153;
+  *d  = (int) (doy - (153 * mp + 2)/5 + 1);
+  *m  = (int) ( mp < 10 ? mp + 3 : mp - 9 );
+  *y  = yoe + era * 4 + ( *m <= 2 );
+}
 
-    ca_attach(ca);
-    status = nc_get_vars_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			       type, start, count, stride, ca->ptr);
-    ca_sync(ca);
-    ca_detach(ca);
+static int64_t
+nc_cal_days (int cal, int64_t y, int m, int d)
+{
+  int64_t days;
+
+  switch ( cal ) {
+  case NC_CAL_360_DAY:
+    return (y - 1970) * 360 + (m - 1) * 30 + (d - 1);
+  case NC_CAL_NOLEAP:
+    return (y - 1970) * 365 + nc_month_days[0][m-1] + (d - 1);
+  case NC_CAL_ALL_LEAP:
+    return (y - 1970) * 366 + nc_month_days[1][m-1] + (d - 1);
+  case NC_CAL_JULIAN:
+    return nc_days_julian(y, m, d);
+  case NC_CAL_PROLEPTIC:
+    return nc_days_gregorian(y, m, d);
+  default:
+    days = nc_days_gregorian(y, m, d);
+    return ( days >= NC_GREGORIAN_START ) ? days : nc_days_julian(y, m, d);
+  }
+}
 
-    CHECK_STATUS(status);
-  
-    return LONG2NUM(status);
+static void
+nc_cal_civil (int cal, int64_t days, int64_t *y, int *m, int *d)
+{
+  const int *table;
+  int64_t rest;
+  int leap;
+
+  switch ( cal ) {
+  case NC_CAL_360_DAY:
+    *y   = 1970 + nc_floor_div(days, 360);
+    rest = days - (*y - 1970) * 360;
+    *m   = (int) (rest / 30) + 1;
+    *d   = (int) (rest % 30) + 1;
+    break;
+  case NC_CAL_NOLEAP:
+  case NC_CAL_ALL_LEAP:
+    leap  = ( cal == NC_CAL_ALL_LEAP );
+    table = nc_month_days[leap];
+    *y    = 1970 + nc_floor_div(days, table[12]);
+    rest  = days - (*y - 1970) * table[12];
+    for (*m=1; rest >= table[*m]; (*m)++) {
+      ;
+    }
+    *d = (int) (rest - table[*m-1]) + 1;
+    break;
+  case NC_CAL_JULIAN:
+    nc_civil_julian(days, y, m, d);
+    break;
+  case NC_CAL_PROLEPTIC:
+    nc_civil_gregorian(days, y, m, d);
+    break;
+  default:
+    if ( days >= NC_GREGORIAN_START ) {
+      nc_civil_gregorian(days, y, m, d);
+    }
+    else {
+      nc_civil_julian(days, y, m, d);
+    }
   }
 }
 
-static VALUE
-rb_nc_put_vars (int argc, VALUE *argv, VALUE mod)
+static int
+nc_cal_parse (VALUE vcal)
 {
-  volatile VALUE data;
-  int status;
-  nc_type type;
-  int ndims;
-  size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
-  ptrdiff_t stride[NC_MAX_DIMS];
-  CArray *ca;
+  static const struct { const char *name; int cal; } table[] = {
+    { "standard",            NC_CAL_STANDARD  },
+    { "gregorian",           NC_CAL_STANDARD  },
+    { "proleptic_gregorian", NC_CAL_PROLEPTIC },
+    { "julian",              NC_CAL_JULIAN    },
+    { "noleap",              NC_CAL_NOLEAP    },
+    { "365_day",             NC_CAL_NOLEAP    },
+    { "all_leap",            NC_CAL_ALL_LEAP  },
+    { "366_day",             NC_CAL_ALL_LEAP  },
+    { "360_day",             NC_CAL_360_DAY   },
+  };
+  const char *name;
   int i;
 
-  CHECK_ARGC(6);
+  if ( NIL_P(vcal) ) {
+    return NC_CAL_STANDARD;
+  }
 
-  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+  vcal = rb_funcall(rb_String(vcal), rb_intern("downcase"), 0);
+  name = StringValueCStr(vcal);
 
-  CHECK_STATUS(status);
+  for (i=0; i<(int)(sizeof(table)/sizeof(table[0])); i++) {
+    if ( strcmp(name, table[i].name) == 0 ) {
+      return table[i].cal;
+    }
+  }
 
-  Check_Type(argv[2], T_ARRAY);
-  Check_Type(argv[3], T_ARRAY);
-  Check_Type(argv[4], T_ARRAY);
+  rb_raise(rb_eArgError, "unknown calendar '%s'", name);
+}
 
-  for (i=0; i<ndims; i++) {
-    start[i]  = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
-    count[i]  = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
-    stride[i] = NUM2ULONG(RARRAY_PTR(argv[4])[i]);
+static int
+nc_scan_int (const char **p, int64_t *val)
+{
+  const char *s = *p;
+  int sign = 1;
+  int64_t v = 0;
+
+  if ( *s == '+' || *s == '-' ) {
+    sign = ( *s == '-' ) ? -1 : 1;
+    s++;
+  }
+  if ( *s < '0' || *s > '9' ) {
+    return 0;
   }
+  while ( *s >= '0' && *s <= '9' ) {
+    v = v * 10 + (*s - '0');
+    s++;
+  }
+  *val = sign * v;
+  *p = s;
+  return 1;
+}
 
-  data = argv[5];
+static void
+nc_cftime_parse (VALUE vunits, VALUE vcal, nc_cftime_t *cf)
+{
+  static const struct { const char *name; int64_t ns; } units[] = {
+    { "nanosecond",  INT64_C(1) },
+    { "ns",          INT64_C(1) },
+    { "microsecond", INT64_C(1000) },
+    { "us",          INT64_C(1000) },
+    { "millisecond", INT64_C(1000000) },
+    { "msec",        INT64_C(1000000) },
+    { "ms",          INT64_C(1000000) },
+    { "second",      NC_NS_PER_SEC },
+    { "sec",         NC_NS_PER_SEC },
+    { "s",           NC_NS_PER_SEC },
+    { "minute",      60 * NC_NS_PER_SEC },
+    { "min",         60 * NC_NS_PER_SEC },
+    { "hour",        3600 * NC_NS_PER_SEC },
+    { "hr",          3600 * NC_NS_PER_SEC },
+    { "h",           3600 * NC_NS_PER_SEC },
+    { "day",         NC_NS_PER_DAY },
+    { "d",           NC_NS_PER_DAY },
+  };
+  const char *str, *p;
+  char    word[16];
+  size_t  len;
+  int64_t y, mo, d, hh = 0, mi = 0, ss = 0, tz, frac = 0, scale;
+  int     i;
+
+  str = StringValueCStr(vunits);
+  p   = str;
+
+  cf->calendar = nc_cal_parse(vcal);
+  cf->unit     = 0;
+
+  while ( *p == ' ' ) p++;
+  for (len=0; ( (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ); p++) {
+    if ( len < sizeof(word) - 1 ) {
+      word[len++] = ( *p >= 'A' && *p <= 'Z' ) ? *p - 'A' + 'a' : *p;
+    }
+  }
+  word[len] = '\0';
+  if ( len > 1 && word[len-1] == 's' ) {     /* plural */
+    for (i=0; i<(int)(sizeof(units)/sizeof(units[0])); i++) {
+      if ( strcmp(word, units[i].name) == 0 ) {
+        break;
+      }
+    }
+    if ( i == (int)(sizeof(units)/sizeof(units[0])) ) {
+      word[--len] = '\0';
+    }
+  }
+  for (i=0; i<(int)(sizeof(units)/sizeof(units[0])); i++) {
+    if ( strcmp(word, units[i].name) == 0 ) {
+      cf->unit = units[i].ns;
+      break;
+    }
+  }
+  if ( cf->unit == 0 ) {
+    rb_raise(rb_eArgError, "unknown time unit in '%s'", str);
+  }
 
-  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-    rb_raise(rb_eTypeError, "arg6 must be a CArray object");
+  while ( *p == ' ' ) p++;
+  if ( strncmp(p, "since", 5) != 0 && strncmp(p, "SINCE", 5) != 0 ) {
+    rb_raise(rb_eArgError, "invalid CF time units '%s'", str);
   }
+  p += 5;
+  while ( *p == ' ' ) p++;
 
-  Data_Get_Struct(data, CArray, ca);
+  if ( ! nc_scan_int(&p, &y)  || *p++ != '-' || 
+       ! nc_scan_int(&p, &mo) || *p++ != '-' || 
+       ! nc_scan_int(&p, &d) || mo < 1 || mo > 12 || d < 1 || d > 31 ) {
+    rb_raise(rb_eArgError, "invalid reference time in '%s'", str);
+  }
 
-  type = rb_nc_rtypemap(ca->data_type);
+  while ( *p == ' ' || *p == 'T' ) p++;
+  if ( nc_scan_int(&p, &hh) ) {
+    if ( *p == ':' ) {
+      p++;
+      nc_scan_int(&p, &mi);
+      if ( *p == ':' ) {
+        p++;
+        nc_scan_int(&p, &ss);
+        if ( *p == '.' ) {
+          p++;
+          for (scale=NC_NS_PER_SEC/10; *p >= '0' && *p <= '9'; p++) {
+            frac += (*p - '0') * scale;
+            scale /= 10;
+          }
+        }
+      }
+    }
+  }
 
-  ca_attach(ca);
-  status = nc_put_vars_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			       type, start, count, stride, ca->ptr);
-  ca_detach(ca);
+  cf->ref = ( nc_cal_days(cf->calendar, y, (int) mo, (int) d) * 86400 
+              + hh * 3600 + mi * 60 + ss ) * NC_NS_PER_SEC + frac;
+
+  /* time zone */
+  while ( *p == ' ' ) p++;
+  if ( ( *p == '+' || *p == '-' ) && nc_scan_int(&p, &tz) ) {
+    int64_t sign = ( tz < 0 ) ? -1 : 1, tm = 0;
+    tz *= sign;
+    if ( *p == ':' ) {
+      p++;
+      nc_scan_int(&p, &tm);
+    }
+    else if ( tz >= 100 ) {
+      tm = tz % 100;
+      tz = tz / 100;
+    }
+    cf->ref -= sign * (tz * 3600 + tm * 60) * NC_NS_PER_SEC;
+  }
+}
 
-  CHECK_STATUS(status);
-  
-  return LONG2NUM(status);
+/* value of the time coordinate => nanoseconds since epoch */
+
+static inline int64_t
+nc_cftime_ns (const nc_cftime_t *cf, double v)
+{
+  double iv = floor(v);
+  return cf->ref + (int64_t) iv * cf->unit 
+                 + (int64_t) llround((v - iv) * (double) cf->unit);
 }
 
 static VALUE
-rb_nc_get_varm (int argc, VALUE *argv, VALUE mod)
+rb_nc_cf_time_decode (int argc, VALUE *argv, VALUE mod)
 {
-  int status;
-  nc_type type;
-  int ndims;
-  int dimid[NC_MAX_DIMS];
-  size_t    start[NC_MAX_DIMS], count[NC_MAX_DIMS];
-  ptrdiff_t stride[NC_MAX_DIMS], imap[NC_MAX_DIMS];
-  CArray *ca;
-  int i;
+  volatile VALUE out, vcal = Qnil;
+  nc_cftime_t cf;
+  CArray *cv, *co;
+  boolean8_t *mi = NULL, *mo = NULL;
+  double *v;
+  int64_t *ns;
+  ca_size_t i;
 
-  if ( argc < 6 ) {
-    rb_raise(rb_eArgError, "invalid # of arguments");
+  if ( argc == 3 ) {
+    vcal = argv[2];
+    argc--;
   }
-  
-  status = nc_inq_vartype(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &type);
 
-  CHECK_STATUS(status);
+  CHECK_ARGC(2);
+  CHECK_TYPE_DATA(argv[0]);
+  CHECK_TYPE_STRING(argv[1]);
 
-  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+  Data_Get_Struct(argv[0], CArray, cv);
+  if ( cv->data_type != CA_FLOAT64 ) {
+    rb_raise(rb_eRuntimeError, "values must be a float64 CArray");
+  }
 
-  CHECK_STATUS(status);
+  nc_cftime_parse(argv[1], vcal, &cf);
 
-  status = nc_inq_vardimid(NUM2LONG(argv[0]), NUM2LONG(argv[1]), dimid);
+  out = rb_carray_new(CA_INT64, cv->rank, cv->dim, 0, NULL);
+  Data_Get_Struct(out, CArray, co);
 
-  CHECK_STATUS(status);
+  ca_attach(cv);
 
-  Check_Type(argv[2], T_ARRAY);
-  Check_Type(argv[3], T_ARRAY);
-  Check_Type(argv[4], T_ARRAY);
-  Check_Type(argv[5], T_ARRAY);
+  v  = (double *) cv->ptr;
+  ns = (int64_t *) co->ptr;
+  if ( ca_has_mask(cv) ) {
+    mi = (boolean8_t *) cv->mask->ptr;
+  }
 
-  for (i=0; i<ndims; i++) {
-    start[i]  = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
-    count[i]  = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
-    stride[i] = NUM2ULONG(RARRAY_PTR(argv[4])[i]);
-    imap[i]   = NUM2ULONG(RARRAY_PTR(argv[5])[i]);
+  for (i=0; i<cv->elements; i++) {
+    if ( ( mi && mi[i] ) || ! isfinite(v[i]) ) {
+      if ( ! mo ) {
+        ca_create_mask(co);
+        mo = (boolean8_t *) co->mask->ptr;
+      }
+      mo[i]  = 1;
+      ns[i]  = 0;
+    }
+    else {
+      ns[i] = nc_cftime_ns(&cf, v[i]);
+    }
   }
 
-  if ( argc == 6 ) {
-    volatile VALUE out;
-    CArray *ca;
-    int8_t rank, data_type;
-    ca_size_t dim[CA_RANK_MAX];
-    int i;
+  ca_detach(cv);
 
-    data_type = rb_nc_typemap (type);
-    rank = ndims;
-    for (i=0; i<rank; i++) {
-      dim[i] = count[i];
-    }
+  return out;
+}
 
-    out = rb_carray_new(data_type, rank, dim, 0, NULL);
-    Data_Get_Struct(out, CArray, ca);
+/* nc_cf_time_encode([year, month, day, hour, minute, second], units[, calendar])
+     => value of the time coordinate */
 
-    status = nc_get_varm_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			       type, start, count, stride, imap, ca->ptr);
+static VALUE
+rb_nc_cf_time_encode (int argc, VALUE *argv, VALUE mod)
+{
+  volatile VALUE vcal = Qnil;
+  nc_cftime_t cf;
+  VALUE *f;
+  double sec;
+  int64_t days, ns;
+  long n;
 
-    CHECK_STATUS(status);
-  
-    return out;
+  if ( argc == 3 ) {
+    vcal = argv[2];
+    argc--;
   }
-  else {
-    volatile VALUE data = argv[6];
-    int i;
 
-    if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-      rb_raise(rb_eTypeError, "arg6 must be a CArray object");
-    }
-
-    Data_Get_Struct(data, CArray, ca);
+  CHECK_ARGC(2);
+  CHECK_TYPE_ARRAY(argv[0]);
+  CHECK_TYPE_STRING(argv[1]);
 
-    if ( ca->rank != ndims ) {
-      rb_raise(rb_eRuntimeError, "rank mismatch");
-    }
+  nc_cftime_parse(argv[1], vcal, &cf);
 
-    for (i=0; i<ca->rank; i++) {
-      if ( ca->dim[i] != count[i] ) {
-	rb_raise(rb_eRuntimeError, "dim[%i] mismatch", i);
-      }
-    }
+  n = RARRAY_LEN(argv[0]);
+  f = RARRAY_PTR(argv[0]);
+  if ( n < 3 || n > 6 ) {
+    rb_raise(rb_eArgError, "fields must be [year, month, day[, hour, minute, second]]");
+  }
 
-    type = rb_nc_rtypemap(ca->data_type);
+  days = nc_cal_days(cf.calendar, NUM2LL(f[0]), NUM2INT(f[1]), NUM2INT(f[2]));
+  sec  = ( n > 3 ? NUM2DBL(f[3]) * 3600 : 0 ) + 
+         ( n > 4 ? NUM2DBL(f[4]) * 60 : 0 ) + 
+         ( n > 5 ? NUM2DBL(f[5]) : 0 );
+  ns   = days * NC_NS_PER_DAY + (int64_t) llround(sec * NC_NS_PER_SEC);
 
-    ca_attach(ca);
-    status = nc_get_varm_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			       type, start, count, stride, imap, ca->ptr);
-    ca_sync(ca);
-    ca_detach(ca);
-  
-    CHECK_STATUS(status);
-  
-    return LONG2NUM(status);
-  }
+  return rb_float_new((double)(ns - cf.ref) / (double) cf.unit);
 }
 
+/* nc_cf_time_fields(ns[, calendar]) 
+     => int64 CArray [..., 6] of [year, month, day, hour, minute, second] */
+
 static VALUE
-rb_nc_put_varm (int argc, VALUE *argv, VALUE mod)
+rb_nc_cf_time_fields (int argc, VALUE *argv, VALUE mod)
 {
-  volatile VALUE data;
-  int status;
-  nc_type type;
-  int ndims;
-  size_t start[NC_MAX_DIMS], count[NC_MAX_DIMS];
-  ptrdiff_t stride[NC_MAX_DIMS], imap[NC_MAX_DIMS];
-  CArray *ca;
-  int i;
-
-  CHECK_ARGC(7);
-
-  status = nc_inq_varndims(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &ndims);
+  volatile VALUE out, vcal = Qnil;
+  CArray *cn, *co;
+  ca_size_t dim[CA_RANK_MAX], i;
+  int64_t *ns, *fld, days, rest, y;
+  int cal, m, d, k;
 
-  CHECK_STATUS(status);
-
-  Check_Type(argv[2], T_ARRAY);
-  Check_Type(argv[3], T_ARRAY);
-  Check_Type(argv[4], T_ARRAY);
-  Check_Type(argv[5], T_ARRAY);
-
-  for (i=0; i<ndims; i++) {
-    start[i]  = NUM2ULONG(RARRAY_PTR(argv[2])[i]);
-    count[i]  = NUM2ULONG(RARRAY_PTR(argv[3])[i]);
-    stride[i] = NUM2ULONG(RARRAY_PTR(argv[4])[i]);
-    imap[i]   = NUM2ULONG(RARRAY_PTR(argv[5])[i]);
+  if ( argc == 2 ) {
+    vcal = argv[1];
+    argc--;
   }
 
-  data = argv[6];
+  CHECK_ARGC(1);
+  CHECK_TYPE_DATA(argv[0]);
 
-  if ( ! rb_obj_is_kind_of(data, rb_cCArray) ) {
-    rb_raise(rb_eTypeError, "arg7 must be a CArray object");
+  Data_Get_Struct(argv[0], CArray, cn);
+  if ( cn->data_type != CA_INT64 ) {
+    rb_raise(rb_eRuntimeError, "ns must be an int64 CArray");
+  }
+  if ( cn->rank >= CA_RANK_MAX ) {
+    rb_raise(rb_eRuntimeError, "rank too large");
   }
 
-  Data_Get_Struct(data, CArray, ca);
+  cal = nc_cal_parse(vcal);
 
-  type = rb_nc_rtypemap(ca->data_type);
+  for (k=0; k<cn->rank; k++) {
+    dim[k] = cn->dim[k];
+  }
+  dim[cn->rank] = 6;
+
+  out = rb_carray_new(CA_INT64, cn->rank + 1, dim, 0, NULL);
+  Data_Get_Struct(out, CArray, co);
+
+  ca_attach(cn);
+
+  ns  = (int64_t *) cn->ptr;
+  fld = (int64_t *) co->ptr;
+
+  for (i=0; i<cn->elements; i++, fld+=6) {
+    days = nc_floor_div(ns[i], NC_NS_PER_DAY);
+    rest = (ns[i] - days * NC_NS_PER_DAY) / NC_NS_PER_SEC;
+    nc_cal_civil(cal, days, &y, &m, &d);
+    fld[0] = y;
+    fld[1] = m;
+    fld[2] = d;
+    fld[3] = rest / 3600;
+    fld[4] = (rest / 60) % 60;
+    fld[5] = rest % 60;
+  }
 
-  ca_attach(ca);
-  status = nc_put_varm_numeric(NUM2LONG(argv[0]), NUM2LONG(argv[1]), 
-			       type, start, count, stride, imap, ca->ptr);
-  ca_detach(ca);
+  ca_detach(cn);
 
-  CHECK_STATUS(status);
-  
-  return LONG2NUM(status);
+  return out;
 }
 
 static VALUE
@@ -1741,8 +6801,6 @@ rb_nc_rename_att (int argc, VALUE *argv, VALUE mod)
   return LONG2NUM(status);
 }
 
-int nc_setfill(int ncid, int fillmode, int* old_fillemode);
-
 static VALUE
 rb_nc_setfill (int argc, VALUE *argv, VALUE mod)
 {
@@ -1753,7 +6811,7 @@ rb_nc_setfill (int argc, VALUE *argv, VALUE mod)
   CHECK_TYPE_ID(argv[0]);
   CHECK_TYPE_INT(argv[1]);
 
-  status = nc_setfill(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &old_fillmode);
+  status = nc_set_fill(NUM2LONG(argv[0]), NUM2LONG(argv[1]), &old_fillmode);
 
   CHECK_STATUS(status);
 
@@ -1780,129 +6838,365 @@ rb_nc_copy_att (int argc, VALUE *argv, VALUE mod)
   return LONG2NUM(status);
 }
 
+/* ------------------------------------------------------------------------
+ *  Ractor safety
+ *
+ *  The extension is declared Ractor-safe. Since libnetcdf is not 
+ *  thread-safe, the functions calling it are serialized by a process-wide
+ *  (recursive) lock held during the whole call and released by rb_ensure
+ *  on exceptions. The lock is waited for without GVL, so that a Ractor 
+ *  waiting for it does not hold up the GC barrier of the others. The pure
+ *  functions (coordinate index, KD-tree, CF time, text strings) are not 
+ *  locked and run in parallel. nc_reduce takes the lock only around its
+ *  reads, so that other Ractors are not held up by the reduction itself.
+ *  The plan cache is only touched under the lock. A file ID belongs to 
+ *  the Ractor which opened it. Without the lock (no pthread) the 
+ *  extension is not declared Ractor-safe.
+ * ------------------------------------------------------------------------ */
+
+#ifdef NC_USE_LIB_LOCK
+
+static pthread_mutex_t nc_lib_mutex;
+
+typedef struct {
+  VALUE (*func)(int, VALUE *, VALUE);
+  int    argc;
+  VALUE *argv;
+  VALUE  mod;
+} nc_locked_call_t;
+
+static void *
+nc_lib_lock_nogvl (void *arg)
+{
+  pthread_mutex_lock(&nc_lib_mutex);
+  return NULL;
+}
+
+/* waits for the lock without GVL */
+
+static void
+nc_lib_lock (void)
+{
+  if ( pthread_mutex_trylock(&nc_lib_mutex) != 0 ) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(nc_lib_lock_nogvl, NULL, NULL, NULL);
+#else
+    nc_lib_lock_nogvl(NULL);
+#endif
+  }
+}
+
+static void
+nc_lib_unlock (void)
+{
+  pthread_mutex_unlock(&nc_lib_mutex);
+}
+
+static VALUE
+nc_locked_body (VALUE arg)
+{
+  nc_locked_call_t *call = (nc_locked_call_t *) arg;
+  return call->func(call->argc, call->argv, call->mod);
+}
+
+static VALUE
+nc_locked_ensure (VALUE arg)
+{
+  nc_lib_unlock();
+  return Qnil;
+}
+
+static VALUE
+nc_call_locked (VALUE (*func)(int, VALUE *, VALUE), 
+                int argc, VALUE *argv, VALUE mod)
+{
+  nc_locked_call_t call;
+
+  call.func = func;
+  call.argc = argc;
+  call.argv = argv;
+  call.mod  = mod;
+
+  nc_lib_lock();
+
+  return rb_ensure(nc_locked_body, (VALUE) &call, nc_locked_ensure, Qnil);
+}
+
+#define NC_DEFINE_LOCKED(func) \
+  static VALUE \
+  func##_locked (int argc, VALUE *argv, VALUE mod) \
+  { \
+    return nc_call_locked(func, argc, argv, mod); \
+  }
+
+#define NC_LOCKED(func)  func##_locked
+
+#else
+
+#define NC_DEFINE_LOCKED(func)
+#define NC_LOCKED(func)  func
+
+#endif
+
+NC_DEFINE_LOCKED(rb_nc_create)
+NC_DEFINE_LOCKED(rb_nc_open)
+NC_DEFINE_LOCKED(rb_nc_close)
+NC_DEFINE_LOCKED(rb_nc_redef)
+NC_DEFINE_LOCKED(rb_nc_enddef)
+NC_DEFINE_LOCKED(rb_nc_sync)
+NC_DEFINE_LOCKED(rb_nc_inq_ndims)
+NC_DEFINE_LOCKED(rb_nc_inq_nvars)
+NC_DEFINE_LOCKED(rb_nc_inq_natts)
+NC_DEFINE_LOCKED(rb_nc_inq_unlimdim)
+NC_DEFINE_LOCKED(rb_nc_inq_format)
+NC_DEFINE_LOCKED(rb_nc_inq_dimid)
+NC_DEFINE_LOCKED(rb_nc_inq_varid)
+NC_DEFINE_LOCKED(rb_nc_inq_attid)
+NC_DEFINE_LOCKED(rb_nc_inq_dimlen)
+NC_DEFINE_LOCKED(rb_nc_inq_dimname)
+NC_DEFINE_LOCKED(rb_nc_inq_varname)
+NC_DEFINE_LOCKED(rb_nc_inq_vartype)
+NC_DEFINE_LOCKED(rb_nc_inq_varndims)
+NC_DEFINE_LOCKED(rb_nc_inq_vardimid)
+NC_DEFINE_LOCKED(rb_nc_inq_varnatts)
+NC_DEFINE_LOCKED(rb_nc_inq_attname)
+NC_DEFINE_LOCKED(rb_nc_inq_atttype)
+NC_DEFINE_LOCKED(rb_nc_inq_attlen)
+NC_DEFINE_LOCKED(rb_nc_def_dim)
+NC_DEFINE_LOCKED(rb_nc_def_var)
+NC_DEFINE_LOCKED(rb_nc_rename_dim)
+NC_DEFINE_LOCKED(rb_nc_rename_var)
+NC_DEFINE_LOCKED(rb_nc_rename_att)
+NC_DEFINE_LOCKED(rb_nc_del_att)
+NC_DEFINE_LOCKED(rb_nc_setfill)
+NC_DEFINE_LOCKED(rb_nc_put_att)
+NC_DEFINE_LOCKED(rb_nc_get_att)
+NC_DEFINE_LOCKED(rb_nc_copy_att)
+NC_DEFINE_LOCKED(rb_nc_get_var1)
+NC_DEFINE_LOCKED(rb_nc_put_var1)
+NC_DEFINE_LOCKED(rb_nc_get_var)
+NC_DEFINE_LOCKED(rb_nc_put_var)
+NC_DEFINE_LOCKED(rb_nc_get_vara)
+NC_DEFINE_LOCKED(rb_nc_put_vara)
+NC_DEFINE_LOCKED(rb_nc_get_vars)
+NC_DEFINE_LOCKED(rb_nc_put_vars)
+NC_DEFINE_LOCKED(rb_nc_get_varm)
+NC_DEFINE_LOCKED(rb_nc_put_varm)
+NC_DEFINE_LOCKED(rb_nc_get_vara_text)
+NC_DEFINE_LOCKED(rb_nc_put_vara_text)
+NC_DEFINE_LOCKED(rb_nc_get_vara_into)
+NC_DEFINE_LOCKED(rb_nc_get_index)
+NC_DEFINE_LOCKED(rb_nc_put_index)
+NC_DEFINE_LOCKED(rb_nc_index_region)
+NC_DEFINE_LOCKED(rb_nc_put_scatter)
+NC_DEFINE_LOCKED(rb_nc_put_var_fill)
+NC_DEFINE_LOCKED(rb_nc_timeseries)
+
 void
 Init_netcdflib ()
 {
 
+#ifdef NC_USE_LIB_LOCK
+  rb_ext_ractor_safe(true);
+#endif
+
+#ifdef NC_USE_LIB_LOCK
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&nc_lib_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+#endif
+
   mNetCDF = rb_define_module("NC");
 
   rb_define_singleton_method(mNetCDF, "ca_type",  rb_nc_ca_type, -1);
   rb_define_singleton_method(mNetCDF, "nc_type",  rb_nc_nc_type, -1);
 
-  rb_define_module_function(mNetCDF, "nc_create", rb_nc_create, -1);
-  rb_define_singleton_method(mNetCDF,   "create", rb_nc_create, -1);
-  rb_define_module_function(mNetCDF, "nc_open",   rb_nc_open, -1);
-  rb_define_singleton_method(mNetCDF,   "open",   rb_nc_open, -1);
-  rb_define_module_function(mNetCDF, "nc_close",  rb_nc_close, -1);
-  rb_define_singleton_method(mNetCDF,   "close",  rb_nc_close, -1);
-  rb_define_module_function(mNetCDF, "nc_redef",  rb_nc_redef, -1);
-  rb_define_singleton_method(mNetCDF,   "redef",  rb_nc_redef, -1);
-  rb_define_module_function(mNetCDF, "nc_enddef", rb_nc_enddef, -1);
-  rb_define_singleton_method(mNetCDF,   "enddef", rb_nc_enddef, -1);
-  rb_define_module_function(mNetCDF, "nc_sync",   rb_nc_sync, -1);
-  rb_define_singleton_method(mNetCDF,   "sync",   rb_nc_sync, -1);
-
-  rb_define_module_function(mNetCDF, "nc_inq_ndims",   rb_nc_inq_ndims, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_ndims",   rb_nc_inq_ndims, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_nvars",   rb_nc_inq_nvars, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_nvars",   rb_nc_inq_nvars, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_natts",   rb_nc_inq_natts, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_natts",   rb_nc_inq_natts, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_unlimdim",   rb_nc_inq_unlimdim, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_unlimdim",   rb_nc_inq_unlimdim, -1);
-
-  rb_define_module_function(mNetCDF, "nc_inq_dimid",   rb_nc_inq_dimid, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_dimid",   rb_nc_inq_dimid, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_varid",   rb_nc_inq_varid, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_varid",   rb_nc_inq_varid, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_attid",   rb_nc_inq_attid, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_attid",   rb_nc_inq_attid, -1);
-
-  rb_define_module_function(mNetCDF, "nc_inq_dimlen",  rb_nc_inq_dimlen, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_dimlen",  rb_nc_inq_dimlen, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_dimname", rb_nc_inq_dimname, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_dimname", rb_nc_inq_dimname, -1);
-
-  rb_define_module_function(mNetCDF, "nc_inq_varname",    rb_nc_inq_varname, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_varname",    rb_nc_inq_varname, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_vartype",    rb_nc_inq_vartype, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_vartype",    rb_nc_inq_vartype, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_varndims",   rb_nc_inq_varndims, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_varndims",   rb_nc_inq_varndims, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_vardimid",  rb_nc_inq_vardimid, -1);
-  rb_define_singleton_method(mNetCDF,    "inq_vardimid",  rb_nc_inq_vardimid, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_varnatts",   rb_nc_inq_varnatts, -1);
-  rb_define_singleton_method(mNetCDF,    "inq_varnatts",  rb_nc_inq_varnatts, -1);
-
-  rb_define_module_function(mNetCDF, "nc_inq_attname", rb_nc_inq_attname, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_attname", rb_nc_inq_attname, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_atttype", rb_nc_inq_atttype, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_atttype", rb_nc_inq_atttype, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_attlen",  rb_nc_inq_attlen, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_attlen",  rb_nc_inq_attlen, -1);
-  rb_define_module_function(mNetCDF, "nc_inq_attid",   rb_nc_inq_attid, -1);
-  rb_define_singleton_method(mNetCDF,   "inq_attid",   rb_nc_inq_attid, -1);
-
-  rb_define_module_function(mNetCDF, "nc_def_dim",  rb_nc_def_dim, -1);
-  rb_define_singleton_method(mNetCDF,   "def_dim",  rb_nc_def_dim, -1);
-  rb_define_module_function(mNetCDF, "nc_def_var",  rb_nc_def_var, -1);
-  rb_define_singleton_method(mNetCDF,   "def_var",  rb_nc_def_var, -1);
-  rb_define_module_function(mNetCDF, "nc_rename_dim",  rb_nc_rename_dim, -1);
-  rb_define_singleton_method(mNetCDF,   "rename_dim",  rb_nc_rename_dim, -1);
-  rb_define_module_function(mNetCDF, "nc_rename_var",  rb_nc_rename_var, -1);
-  rb_define_singleton_method(mNetCDF,   "rename_var",  rb_nc_rename_var, -1);
-  rb_define_module_function(mNetCDF, "nc_rename_att",  rb_nc_rename_att, -1);
-  rb_define_singleton_method(mNetCDF,   "rename_att",  rb_nc_rename_att, -1);
-  rb_define_module_function(mNetCDF, "nc_del_att",  rb_nc_del_att, -1);
-  rb_define_singleton_method(mNetCDF,   "del_att",  rb_nc_del_att, -1);
-  rb_define_module_function(mNetCDF, "nc_setfill",  rb_nc_setfill, -1);
-  rb_define_singleton_method(mNetCDF,   "setfill",  rb_nc_setfill, -1);
-
-  rb_define_module_function(mNetCDF, "nc_put_att",  rb_nc_put_att, -1);
-  rb_define_singleton_method(mNetCDF,   "put_att",  rb_nc_put_att, -1);
-  rb_define_module_function(mNetCDF, "nc_get_att",  rb_nc_get_att, -1);
-  rb_define_singleton_method(mNetCDF,   "get_att",  rb_nc_get_att, -1);
-  rb_define_module_function(mNetCDF, "nc_copy_att", rb_nc_copy_att, -1);
-  rb_define_singleton_method(mNetCDF,   "copy_att", rb_nc_copy_att, -1);
-
-  rb_define_module_function(mNetCDF, "nc_get_var1", rb_nc_get_var1, -1);
-  rb_define_singleton_method(mNetCDF,   "get_var1", rb_nc_get_var1, -1);
-  rb_define_module_function(mNetCDF, "nc_put_var1", rb_nc_put_var1, -1);
-  rb_define_singleton_method(mNetCDF,   "put_var1", rb_nc_put_var1, -1);
-  rb_define_module_function(mNetCDF, "nc_get_var",  rb_nc_get_var, -1);
-  rb_define_singleton_method(mNetCDF,   "get_var",  rb_nc_get_var, -1);
-  rb_define_module_function(mNetCDF, "nc_put_var",  rb_nc_put_var, -1);
-  rb_define_singleton_method(mNetCDF,   "put_var",  rb_nc_put_var, -1);
-  rb_define_module_function(mNetCDF, "nc_get_vara", rb_nc_get_vara, -1);
-  rb_define_singleton_method(mNetCDF,   "get_vara", rb_nc_get_vara, -1);
-  rb_define_module_function(mNetCDF, "nc_put_vara", rb_nc_put_vara, -1);
-  rb_define_singleton_method(mNetCDF,   "put_vara", rb_nc_put_vara, -1);
-  rb_define_module_function(mNetCDF, "nc_get_vars", rb_nc_get_vars, -1);
-  rb_define_singleton_method(mNetCDF,   "get_vars", rb_nc_get_vars, -1);
-  rb_define_module_function(mNetCDF, "nc_put_vars", rb_nc_put_vars, -1);
-  rb_define_singleton_method(mNetCDF,   "put_vars", rb_nc_put_vars, -1);
-  rb_define_module_function(mNetCDF, "nc_get_varm", rb_nc_get_varm, -1);
-  rb_define_singleton_method(mNetCDF,   "get_varm", rb_nc_get_varm, -1);
-  rb_define_module_function(mNetCDF, "nc_put_varm", rb_nc_put_varm, -1);
-  rb_define_singleton_method(mNetCDF,   "put_varm", rb_nc_put_varm, -1);
+  rb_define_module_function(mNetCDF, "nc_create", NC_LOCKED(rb_nc_create), -1);
+  rb_define_singleton_method(mNetCDF,   "create", NC_LOCKED(rb_nc_create), -1);
+  rb_define_module_function(mNetCDF, "nc_open",   NC_LOCKED(rb_nc_open), -1);
+  rb_define_singleton_method(mNetCDF,   "open",   NC_LOCKED(rb_nc_open), -1);
+  rb_define_module_function(mNetCDF, "nc_close",  NC_LOCKED(rb_nc_close), -1);
+  rb_define_singleton_method(mNetCDF,   "close",  NC_LOCKED(rb_nc_close), -1);
+  rb_define_module_function(mNetCDF, "nc_redef",  NC_LOCKED(rb_nc_redef), -1);
+  rb_define_singleton_method(mNetCDF,   "redef",  NC_LOCKED(rb_nc_redef), -1);
+  rb_define_module_function(mNetCDF, "nc_enddef", NC_LOCKED(rb_nc_enddef), -1);
+  rb_define_singleton_method(mNetCDF,   "enddef", NC_LOCKED(rb_nc_enddef), -1);
+  rb_define_module_function(mNetCDF, "nc_sync",   NC_LOCKED(rb_nc_sync), -1);
+  rb_define_singleton_method(mNetCDF,   "sync",   NC_LOCKED(rb_nc_sync), -1);
+
+  rb_define_module_function(mNetCDF, "nc_inq_ndims",   NC_LOCKED(rb_nc_inq_ndims), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_ndims",   NC_LOCKED(rb_nc_inq_ndims), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_nvars",   NC_LOCKED(rb_nc_inq_nvars), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_nvars",   NC_LOCKED(rb_nc_inq_nvars), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_natts",   NC_LOCKED(rb_nc_inq_natts), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_natts",   NC_LOCKED(rb_nc_inq_natts), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_unlimdim",   NC_LOCKED(rb_nc_inq_unlimdim), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_unlimdim",   NC_LOCKED(rb_nc_inq_unlimdim), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_format",   NC_LOCKED(rb_nc_inq_format), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_format",   NC_LOCKED(rb_nc_inq_format), -1);
+
+  rb_define_module_function(mNetCDF, "nc_inq_dimid",   NC_LOCKED(rb_nc_inq_dimid), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_dimid",   NC_LOCKED(rb_nc_inq_dimid), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_varid",   NC_LOCKED(rb_nc_inq_varid), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_varid",   NC_LOCKED(rb_nc_inq_varid), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_attid",   NC_LOCKED(rb_nc_inq_attid), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_attid",   NC_LOCKED(rb_nc_inq_attid), -1);
+
+  rb_define_module_function(mNetCDF, "nc_inq_dimlen",  NC_LOCKED(rb_nc_inq_dimlen), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_dimlen",  NC_LOCKED(rb_nc_inq_dimlen), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_dimname", NC_LOCKED(rb_nc_inq_dimname), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_dimname", NC_LOCKED(rb_nc_inq_dimname), -1);
+
+  rb_define_module_function(mNetCDF, "nc_inq_varname",    NC_LOCKED(rb_nc_inq_varname), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_varname",    NC_LOCKED(rb_nc_inq_varname), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_vartype",    NC_LOCKED(rb_nc_inq_vartype), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_vartype",    NC_LOCKED(rb_nc_inq_vartype), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_varndims",   NC_LOCKED(rb_nc_inq_varndims), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_varndims",   NC_LOCKED(rb_nc_inq_varndims), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_vardimid",  NC_LOCKED(rb_nc_inq_vardimid), -1);
+  rb_define_singleton_method(mNetCDF,    "inq_vardimid",  NC_LOCKED(rb_nc_inq_vardimid), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_varnatts",   NC_LOCKED(rb_nc_inq_varnatts), -1);
+  rb_define_singleton_method(mNetCDF,    "inq_varnatts",  NC_LOCKED(rb_nc_inq_varnatts), -1);
+
+  rb_define_module_function(mNetCDF, "nc_inq_attname", NC_LOCKED(rb_nc_inq_attname), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_attname", NC_LOCKED(rb_nc_inq_attname), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_atttype", NC_LOCKED(rb_nc_inq_atttype), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_atttype", NC_LOCKED(rb_nc_inq_atttype), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_attlen",  NC_LOCKED(rb_nc_inq_attlen), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_attlen",  NC_LOCKED(rb_nc_inq_attlen), -1);
+  rb_define_module_function(mNetCDF, "nc_inq_attid",   NC_LOCKED(rb_nc_inq_attid), -1);
+  rb_define_singleton_method(mNetCDF,   "inq_attid",   NC_LOCKED(rb_nc_inq_attid), -1);
+
+  rb_define_module_function(mNetCDF, "nc_def_dim",  NC_LOCKED(rb_nc_def_dim), -1);
+  rb_define_singleton_method(mNetCDF,   "def_dim",  NC_LOCKED(rb_nc_def_dim), -1);
+  rb_define_module_function(mNetCDF, "nc_def_var",  NC_LOCKED(rb_nc_def_var), -1);
+  rb_define_singleton_method(mNetCDF,   "def_var",  NC_LOCKED(rb_nc_def_var), -1);
+  rb_define_module_function(mNetCDF, "nc_rename_dim",  NC_LOCKED(rb_nc_rename_dim), -1);
+  rb_define_singleton_method(mNetCDF,   "rename_dim",  NC_LOCKED(rb_nc_rename_dim), -1);
+  rb_define_module_function(mNetCDF, "nc_rename_var",  NC_LOCKED(rb_nc_rename_var), -1);
+  rb_define_singleton_method(mNetCDF,   "rename_var",  NC_LOCKED(rb_nc_rename_var), -1);
+  rb_define_module_function(mNetCDF, "nc_rename_att",  NC_LOCKED(rb_nc_rename_att), -1);
+  rb_define_singleton_method(mNetCDF,   "rename_att",  NC_LOCKED(rb_nc_rename_att), -1);
+  rb_define_module_function(mNetCDF, "nc_del_att",  NC_LOCKED(rb_nc_del_att), -1);
+  rb_define_singleton_method(mNetCDF,   "del_att",  NC_LOCKED(rb_nc_del_att), -1);
+  rb_define_module_function(mNetCDF, "nc_setfill",  NC_LOCKED(rb_nc_setfill), -1);
+  rb_define_singleton_method(mNetCDF,   "setfill",  NC_LOCKED(rb_nc_setfill), -1);
+  rb_define_module_function(mNetCDF, "nc_set_fill",  NC_LOCKED(rb_nc_setfill), -1);
+  rb_define_singleton_method(mNetCDF,   "set_fill",  NC_LOCKED(rb_nc_setfill), -1);
+
+  rb_define_module_function(mNetCDF, "nc_put_att",  NC_LOCKED(rb_nc_put_att), -1);
+  rb_define_singleton_method(mNetCDF,   "put_att",  NC_LOCKED(rb_nc_put_att), -1);
+  rb_define_module_function(mNetCDF, "nc_get_att",  NC_LOCKED(rb_nc_get_att), -1);
+  rb_define_singleton_method(mNetCDF,   "get_att",  NC_LOCKED(rb_nc_get_att), -1);
+  rb_define_module_function(mNetCDF, "nc_copy_att", NC_LOCKED(rb_nc_copy_att), -1);
+  rb_define_singleton_method(mNetCDF,   "copy_att", NC_LOCKED(rb_nc_copy_att), -1);
+
+  rb_define_module_function(mNetCDF, "nc_get_var1", NC_LOCKED(rb_nc_get_var1), -1);
+  rb_define_singleton_method(mNetCDF,   "get_var1", NC_LOCKED(rb_nc_get_var1), -1);
+  rb_define_module_function(mNetCDF, "nc_put_var1", NC_LOCKED(rb_nc_put_var1), -1);
+  rb_define_singleton_method(mNetCDF,   "put_var1", NC_LOCKED(rb_nc_put_var1), -1);
+  rb_define_module_function(mNetCDF, "nc_get_var",  NC_LOCKED(rb_nc_get_var), -1);
+  rb_define_singleton_method(mNetCDF,   "get_var",  NC_LOCKED(rb_nc_get_var), -1);
+  rb_define_module_function(mNetCDF, "nc_put_var",  NC_LOCKED(rb_nc_put_var), -1);
+  rb_define_singleton_method(mNetCDF,   "put_var",  NC_LOCKED(rb_nc_put_var), -1);
+  rb_define_module_function(mNetCDF, "nc_get_vara", NC_LOCKED(rb_nc_get_vara), -1);
+  rb_define_singleton_method(mNetCDF,   "get_vara", NC_LOCKED(rb_nc_get_vara), -1);
+  rb_define_module_function(mNetCDF, "nc_put_vara", NC_LOCKED(rb_nc_put_vara), -1);
+  rb_define_singleton_method(mNetCDF,   "put_vara", NC_LOCKED(rb_nc_put_vara), -1);
+  rb_define_module_function(mNetCDF, "nc_get_vars", NC_LOCKED(rb_nc_get_vars), -1);
+  rb_define_singleton_method(mNetCDF,   "get_vars", NC_LOCKED(rb_nc_get_vars), -1);
+  rb_define_module_function(mNetCDF, "nc_put_vars", NC_LOCKED(rb_nc_put_vars), -1);
+  rb_define_singleton_method(mNetCDF,   "put_vars", NC_LOCKED(rb_nc_put_vars), -1);
+  rb_define_module_function(mNetCDF, "nc_get_varm", NC_LOCKED(rb_nc_get_varm), -1);
+  rb_define_singleton_method(mNetCDF,   "get_varm", NC_LOCKED(rb_nc_get_varm), -1);
+  rb_define_module_function(mNetCDF, "nc_put_varm", NC_LOCKED(rb_nc_put_varm), -1);
+  rb_define_singleton_method(mNetCDF,   "put_varm", NC_LOCKED(rb_nc_put_varm), -1);
+  rb_define_module_function(mNetCDF, "nc_get_vara_text", NC_LOCKED(rb_nc_get_vara_text), -1);
+  rb_define_singleton_method(mNetCDF,   "get_vara_text", NC_LOCKED(rb_nc_get_vara_text), -1);
+  rb_define_module_function(mNetCDF, "nc_put_vara_text", NC_LOCKED(rb_nc_put_vara_text), -1);
+  rb_define_singleton_method(mNetCDF,   "put_vara_text", NC_LOCKED(rb_nc_put_vara_text), -1);
+  rb_define_module_function(mNetCDF, "nc_text_strings", rb_nc_text_strings, -1);
+  rb_define_singleton_method(mNetCDF,   "text_strings", rb_nc_text_strings, -1);
+  rb_define_module_function(mNetCDF, "nc_mmap_carray", rb_nc_mmap_carray, -1);
+  rb_define_singleton_method(mNetCDF,   "mmap_carray", rb_nc_mmap_carray, -1);
+  rb_define_module_function(mNetCDF, "nc_get_vara_into", NC_LOCKED(rb_nc_get_vara_into), -1);
+  rb_define_singleton_method(mNetCDF,   "get_vara_into", NC_LOCKED(rb_nc_get_vara_into), -1);
+  rb_define_module_function(mNetCDF, "nc_get_index", NC_LOCKED(rb_nc_get_index), -1);
+  rb_define_singleton_method(mNetCDF,   "get_index", NC_LOCKED(rb_nc_get_index), -1);
+  rb_define_module_function(mNetCDF, "nc_put_index", NC_LOCKED(rb_nc_put_index), -1);
+  rb_define_singleton_method(mNetCDF,   "put_index", NC_LOCKED(rb_nc_put_index), -1);
+  rb_define_module_function(mNetCDF, "nc_index_region", NC_LOCKED(rb_nc_index_region), -1);
+  rb_define_singleton_method(mNetCDF,   "index_region", NC_LOCKED(rb_nc_index_region), -1);
+  rb_define_module_function(mNetCDF, "nc_put_scatter", NC_LOCKED(rb_nc_put_scatter), -1);
+  rb_define_singleton_method(mNetCDF,   "put_scatter", NC_LOCKED(rb_nc_put_scatter), -1);
+  rb_define_module_function(mNetCDF, "nc_read_records", rb_nc_read_records, -1);
+  rb_define_singleton_method(mNetCDF,   "read_records", rb_nc_read_records, -1);
+  rb_define_module_function(mNetCDF, "nc_put_var_fill", NC_LOCKED(rb_nc_put_var_fill), -1);
+  rb_define_singleton_method(mNetCDF,   "put_var_fill", NC_LOCKED(rb_nc_put_var_fill), -1);
+  rb_define_module_function(mNetCDF, "nc_reduce",  rb_nc_reduce, -1);
+  rb_define_singleton_method(mNetCDF,   "reduce",  rb_nc_reduce, -1);
+  rb_define_module_function(mNetCDF, "nc_coord_scan",   rb_nc_coord_scan, -1);
+  rb_define_singleton_method(mNetCDF,   "coord_scan",   rb_nc_coord_scan, -1);
+  rb_define_module_function(mNetCDF, "nc_coord_locate", rb_nc_coord_locate, -1);
+  rb_define_singleton_method(mNetCDF,   "coord_locate", rb_nc_coord_locate, -1);
+  rb_define_module_function(mNetCDF, "nc_coord_range",  rb_nc_coord_range, -1);
+  rb_define_singleton_method(mNetCDF,   "coord_range",  rb_nc_coord_range, -1);
+  rb_define_module_function(mNetCDF, "nc_kdtree_build", rb_nc_kdtree_build, -1);
+  rb_define_singleton_method(mNetCDF,   "kdtree_build", rb_nc_kdtree_build, -1);
+  rb_define_module_function(mNetCDF, "nc_kdtree_query", rb_nc_kdtree_query, -1);
+  rb_define_singleton_method(mNetCDF,   "kdtree_query", rb_nc_kdtree_query, -1);
+  rb_define_module_function(mNetCDF, "nc_timeseries", NC_LOCKED(rb_nc_timeseries), -1);
+  rb_define_singleton_method(mNetCDF,   "timeseries", NC_LOCKED(rb_nc_timeseries), -1);
+  rb_define_module_function(mNetCDF, "nc_cf_time_decode", rb_nc_cf_time_decode, -1);
+  rb_define_singleton_method(mNetCDF,   "cf_time_decode", rb_nc_cf_time_decode, -1);
+  rb_define_module_function(mNetCDF, "nc_cf_time_encode", rb_nc_cf_time_encode, -1);
+  rb_define_singleton_method(mNetCDF,   "cf_time_encode", rb_nc_cf_time_encode, -1);
+  rb_define_module_function(mNetCDF, "nc_cf_time_fields", rb_nc_cf_time_fields, -1);
+  rb_define_singleton_method(mNetCDF,   "cf_time_fields", rb_nc_cf_time_fields, -1);
 
   rb_define_const(mNetCDF, "NC_NOERR",     INT2FIX(NC_NOERR));
 
+  rb_define_const(mNetCDF, "NC_MASK_FILL_MAX",  INT2FIX(NC_MASK_FILL_MAX));
+  rb_define_const(mNetCDF, "NC_LOCATE_EXACT",   INT2FIX(NC_LOCATE_EXACT));
+  rb_define_const(mNetCDF, "NC_LOCATE_NEAREST", INT2FIX(NC_LOCATE_NEAREST));
+
   rb_define_const(mNetCDF, "NC_NOWRITE",   INT2FIX(NC_NOWRITE));
   rb_define_const(mNetCDF, "NC_WRITE",     INT2FIX(NC_WRITE));
   rb_define_const(mNetCDF, "NC_SHARE",     INT2FIX(NC_SHARE));
   rb_define_const(mNetCDF, "NC_LOCK",      INT2FIX(NC_LOCK));
   rb_define_const(mNetCDF, "NC_CLOBBER",   INT2FIX(NC_CLOBBER));
   rb_define_const(mNetCDF, "NC_NOCLOBBER", INT2FIX(NC_NOCLOBBER));
+  rb_define_const(mNetCDF, "NC_64BIT_OFFSET", INT2FIX(NC_64BIT_OFFSET));
+#ifdef NC_64BIT_DATA
+  rb_define_const(mNetCDF, "NC_64BIT_DATA", INT2FIX(NC_64BIT_DATA));
+#endif
   rb_define_const(mNetCDF, "NC_SIZEHINT_DEFAULT", INT2FIX(NC_SIZEHINT_DEFAULT));
 
+  rb_define_const(mNetCDF, "NC_FORMAT_CLASSIC",     INT2FIX(NC_FORMAT_CLASSIC));
+  rb_define_const(mNetCDF, "NC_FORMAT_64BIT_OFFSET", INT2FIX(NC_FORMAT_64BIT_OFFSET));
+#ifdef NC_FORMAT_64BIT_DATA
+  rb_define_const(mNetCDF, "NC_FORMAT_64BIT_DATA",  INT2FIX(NC_FORMAT_64BIT_DATA));
+#endif
+
   rb_define_const(mNetCDF, "NC_GLOBAL",       INT2FIX(NC_GLOBAL));
   rb_define_const(mNetCDF, "NC_MAX_NAME",     INT2FIX(NC_MAX_NAME));
   rb_define_const(mNetCDF, "NC_MAX_VAR_DIMS", INT2FIX(NC_MAX_VAR_DIMS));
   rb_define_const(mNetCDF, "NC_MAX_DIMS",     INT2FIX(NC_MAX_DIMS));
+  rb_define_const(mNetCDF, "NC_UNLIMITED",    LONG2NUM(NC_UNLIMITED));
   rb_define_const(mNetCDF, "NC_NOFILL",       INT2FIX(NC_NOFILL));
   rb_define_const(mNetCDF, "NC_FILL",         INT2FIX(NC_FILL));
 
+  rb_define_const(mNetCDF, "NC_FILL_BYTE",   INT2FIX(NC_FILL_BYTE));
+  rb_define_const(mNetCDF, "NC_FILL_CHAR",   INT2FIX(NC_FILL_CHAR));
+  rb_define_const(mNetCDF, "NC_FILL_SHORT",  INT2FIX(NC_FILL_SHORT));
+  rb_define_const(mNetCDF, "NC_FILL_INT",    INT2NUM(NC_FILL_INT));
+  rb_define_const(mNetCDF, "NC_FILL_FLOAT",  rb_float_new(NC_FILL_FLOAT));
+  rb_define_const(mNetCDF, "NC_FILL_DOUBLE", rb_float_new(NC_FILL_DOUBLE));
+
   rb_define_const(mNetCDF, "NC_NAT",     INT2FIX(NC_NAT));
   rb_define_const(mNetCDF, "NC_BYTE",    INT2FIX(NC_BYTE));
   rb_define_const(mNetCDF, "NC_CHAR",    INT2FIX(NC_CHAR));